@@ -0,0 +1,157 @@
+#ifndef BUS_DISPATCH_H
+#define BUS_DISPATCH_H
+
+#include "stm32f1xx_hal.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// Keyboard layout
+#define BUS_LOWEST_NOTE 21      // A0, first key of an 88-key piano
+#define BUS_NUM_NOTES 88        // Keys on the piano
+#ifndef BUS_CHANNELS_PER_BOARD
+#define BUS_CHANNELS_PER_BOARD 12 // Must match NUM_KEYS on the drivers, at most 64
+#endif
+
+// Number of driver boards on the bus. Consecutive groups of
+// BUS_CHANNELS_PER_BOARD keys go to units 0, 1, 2, ...; with fewer boards
+// than needed the keyboard folds onto the available boards (1 board of 12
+// keys = every octave on unit 0, 8 boards of 12 = the whole keyboard). 2
+// boards of 48 also cover it, but most of their keys are on the drivers'
+// opt-in PWM expanders, which are not at parity with the timer outputs.
+#ifndef BUS_NUM_BOARDS
+#define BUS_NUM_BOARDS 1
+#endif
+
+// Timed playback
+// Commands are sent ahead of time stamped with the master time at which they
+// should execute; drivers hold them until then, so wire and queueing latency
+// is hidden as long as it stays below the playout delay. At 9600 baud a frame
+// takes ~20 ms, so the delay must cover the densest chord in the song.
+#ifndef BUS_PLAYOUT_DELAY_US
+#define BUS_PLAYOUT_DELAY_US 100000
+#endif
+#define BUS_SYNC_INTERVAL_MS 250 // Clock sync beacon period
+#define BUS_EXECUTE_NOW 0        // Execute-at value for commands that run on arrival
+
+// Compact (running status) encoding
+// After a full press ("keyframe") on a channel, further presses and releases
+// on that board go out as "<channel>[+/-duty delta]@<offset>", e.g.
+// "3+2@850" instead of "P:3:75@123456789". The offset counts from the start
+// of the frame in BUS_COMPACT_TIME_UNIT_US, so it needs no absolute clock.
+// Drivers only update their reference on full frames; each channel gets a
+// fresh keyframe every BUS_KEYFRAME_INTERVAL_MS, and each board one after
+// every BUS_KEYFRAME_MAX_COMPACT compact frames, which bounds the effect of a
+// lost keyframe or a driver reset however fast the notes come. Releases
+// always go out as "<channel>:0", which drivers refuse to read as a press.
+#define BUS_COMPACT_TIME_UNIT_US 100  // Must match COMMAND_COMPACT_TIME_UNIT_US on the drivers
+#define BUS_KEYFRAME_INTERVAL_MS 1000 // Maximum age of a channel's reference press
+#define BUS_KEYFRAME_MAX_COMPACT 16   // Compact frames to a board between keyframes
+
+// Strike envelope profiles
+// The drivers hold a table of envelope profiles uploaded at startup; notes
+// go out as "N:<channel>:<profile id>" with the profile chosen by velocity,
+// so every note carries a fully shaped strike. Loading another table with
+// BusDispatch_LoadProfiles changes the touch of the whole performance. A note
+// struck again while still held goes out as "T:<channel>:<profile id>", which
+// the driver plays as a fast re-strike: a brief partial release just long
+// enough to reset the action, then the new strike. A driver plays a press by
+// a profile it does not hold (after a reset without a saved table, or a lost
+// upload frame) as a plain press, so credit replies carry the driver's valid
+// profiles and a missing one is re-sent to that board before the next note
+// that uses it.
+#define BUS_NUM_PROFILES 32 // Must match ENVELOPE_PROFILE_COUNT on the drivers, at most 32
+
+// Release ramps
+// Each key can be let back up along a short ramp instead of being cut off,
+// set per key with "D:<channel>:<ramp>:<ms>" and applied by the driver on
+// arrival. Ramp shapes must match KeyRamp_t on the drivers.
+#define BUS_RAMP_STEP 0        // No ramp, output cut at once
+#define BUS_RAMP_LINEAR 1
+#define BUS_RAMP_EXPONENTIAL 2
+
+// Key calibration
+// Each driver keeps a calibration per key in flash: the strike duty at
+// BUS_CALIBRATION_POINTS velocities spread evenly over 0-127, a minimum
+// strike duty, a hold duty and the key's strike latency. Timed presses are
+// started early by the latency whichever way notes are sent. Updates are
+// applied by the driver on arrival; BusDispatch_SaveCalibration has every
+// driver store its table.
+#define BUS_CALIBRATION_POINTS 8 // Must match KEY_CALIBRATION_POINTS on the drivers
+
+// Driver-side velocity
+// With BUS_DRIVER_VELOCITY set, notes go out as "V:<channel>:<velocity>"
+// ("U:..." for a re-strike) and the driver turns the raw velocity into a
+// strike through the key's calibration, instead of the velocity choosing a
+// profile here. Compact frames then only repeat a channel's last velocity.
+#ifndef BUS_DRIVER_VELOCITY
+#define BUS_DRIVER_VELOCITY 0
+#endif
+
+// Envelope profile, parameters as in a full-format press
+typedef struct
+{
+  uint8_t duty_cycle;           // Initial duty cycle (0-100)
+  uint16_t initial_strike_time; // Initial strike time in ms (0 = driver default)
+  uint8_t followup_duty_cycle;  // Follow-up duty cycle (0-100, 0 = no follow-up)
+  uint16_t followup_time;       // Follow-up time in ms (0 = no follow-up)
+  uint8_t hold_duty_cycle;      // Hold duty cycle (0-50, 0 = driver default; drivers reject more)
+} BusEnvelopeProfile_t;
+
+// Calibration of one key
+typedef struct
+{
+  uint8_t curve[BUS_CALIBRATION_POINTS]; // Strike duty (0-100) at velocity 127 * n / (BUS_CALIBRATION_POINTS - 1)
+  uint8_t min_strike_duty;               // Lowest strike duty for any velocity above 0
+  uint8_t hold_duty;                     // Hold duty (0-100, 0 = the envelope's own)
+  uint16_t latency_us;                   // Time from coil on to the hammer reaching the string
+} BusKeyCalibration_t;
+
+// Flow control
+// Each driver answers a credit query ("C:?") with the free slots in its key
+// command queue and in its pedal queue, which are separate lanes. The main
+// controller spends one credit of the matching lane per command sent to a
+// board and only asks again once they run out, so a full queue stalls sending
+// instead of dropping commands. Group and broadcast commands spend a credit on
+// every board, which is conservative for boards outside the group. The reply
+// also carries the board's hottest coil temperature estimate and its valid
+// envelope profiles.
+#define BUS_DRIVER_QUEUE_SIZE 32           // Slots in each driver's command queue
+#define BUS_DRIVER_PEDAL_QUEUE_SIZE 8      // Slots in each driver's pedal queue (COMMAND_PEDAL_QUEUE_SIZE)
+#define BUS_CREDIT_POLL_INTERVAL_MS 10     // Re-poll interval while a board's queue is full
+#define BUS_OFFLINE_POLL_INTERVAL_MS 1000  // Re-poll interval for a board that stopped answering
+
+// Per-board flow control state and counters
+typedef struct
+{
+  uint8_t credits;         // Free driver queue slots not yet spent since the last poll
+  uint8_t pedal_credits;   // Free driver pedal queue slots not yet spent since the last poll
+  bool online;             // Board answered its last credit query
+  uint32_t last_poll_time; // HAL tick of the last credit query
+  uint32_t polls;          // Credit queries sent
+  uint32_t poll_timeouts;  // Credit queries that got no reply
+  uint32_t stalls;         // Sends deferred because the board had no free slots
+  uint32_t driver_drops;   // Queue overflows reported by the board itself
+  uint32_t unacknowledged; // Commands sent while the board was not answering
+  uint32_t keyframes;      // Key commands sent in full format
+  uint32_t compact_frames; // Key commands sent in compact format
+  uint32_t restrikes;      // Notes struck again while still held
+  uint16_t coil_temperature; // Hottest coil on the board in degrees C, as last reported
+  uint32_t profiles;       // Envelope profiles the board holds, bit n for profile n
+  uint32_t profile_resends; // Profiles re-sent because the board reported them missing
+} BusBoardStatus_t;
+
+// Function prototypes
+void BusDispatch_Init(void);
+void BusDispatch_Update(void);
+HAL_StatusTypeDef BusDispatch_SendSyncBeacon(void);
+HAL_StatusTypeDef BusDispatch_LoadProfiles(const BusEnvelopeProfile_t *profiles, uint8_t count, bool save);
+HAL_StatusTypeDef BusDispatch_SetRelease(uint8_t note, uint8_t ramp, uint16_t duration_ms);
+HAL_StatusTypeDef BusDispatch_SetCalibration(uint8_t note, const BusKeyCalibration_t *calibration);
+HAL_StatusTypeDef BusDispatch_SaveCalibration(void);
+HAL_StatusTypeDef BusDispatch_NoteOn(uint8_t note, uint8_t velocity, uint32_t execute_at);
+HAL_StatusTypeDef BusDispatch_NoteOff(uint8_t note, uint32_t execute_at);
+HAL_StatusTypeDef BusDispatch_Pedal(bool pressed, uint32_t execute_at);
+HAL_StatusTypeDef BusDispatch_AllNotesOff(void);
+const BusBoardStatus_t *BusDispatch_GetBoardStatus(uint8_t unit);
+
+#endif // BUS_DISPATCH_H
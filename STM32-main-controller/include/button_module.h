@@ -2,7 +2,7 @@
 #define BUTTON_MODULE_H
 
 #include "stm32f1xx_hal.h"
-#include "rs485.h"
+#include "bus_dispatch.h"
 
 // Button configuration
 #define BUTTON_DEBOUNCE_TIME_MS 20
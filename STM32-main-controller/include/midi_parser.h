@@ -53,6 +53,7 @@ typedef struct
 // Function prototypes
 HAL_StatusTypeDef MidiParser_Init(MidiParser_t *parser);
 HAL_StatusTypeDef MidiParser_LoadEmbeddedData(MidiParser_t *parser);
+HAL_StatusTypeDef MidiParser_LoadData(MidiParser_t *parser, const uint8_t *data, uint32_t size);
 MidiEvent_t *MidiParser_GetEvent(MidiParser_t *parser, uint32_t index);
 uint32_t MidiParser_GetEventCount(MidiParser_t *parser);
 void MidiParser_Cleanup(MidiParser_t *parser);
@@ -67,6 +68,7 @@ uint32_t MidiParser_GetCurrentEventIndex(MidiParser_t *parser);
 uint32_t MidiParser_GetTempo(MidiParser_t *parser);
 uint16_t MidiParser_GetTimeDivision(MidiParser_t *parser);
 uint32_t MidiParser_TicksToMilliseconds(MidiParser_t *parser, uint32_t ticks);
+uint32_t MidiParser_TicksToMicroseconds(MidiParser_t *parser, uint32_t ticks);
 
 // Utility functions
 uint32_t MidiParser_ReadVariableLength(uint8_t *data, uint32_t *offset);
@@ -0,0 +1,13 @@
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include "stm32f1xx_hal.h"
+#include "midi_parser.h"
+#include <stdbool.h>
+
+// Function prototypes
+void Playback_Init(MidiParser_t *parser);
+void Playback_Update(void);
+bool Playback_IsFinished(void);
+
+#endif // PLAYBACK_H
@@ -5,12 +5,41 @@
 
 // RS485 Configuration
 #define RS485_UART_INSTANCE USART3
+#ifndef RS485_BAUDRATE
 #define RS485_BAUDRATE 9600
+#endif
 #define RS485_TIMEOUT 1000
+#define RS485_MAX_FRAME_SIZE 64
+// Wait for a driver's reply. The longest credit reply,
+// "C:110:32:8:4294967295:130:ffffffff" with its address byte and newline, is
+// 37 bytes, about 39 ms at 9600 baud. The rest is margin for the driver's main
+// loop and both transceivers' direction turnaround, which is assumed to be
+// well under a millisecond but has not been measured.
+#define RS485_REPLY_TIMEOUT 50 // ms
+
+// Frame addressing
+// Every frame starts with one address byte followed by the ASCII command and
+// a newline. Address bytes have bit 7 set, so they can never be confused with
+// command text and always mark the start of a new frame:
+//   0x80-0xEE  unicast to unit 0-110
+//   0xEF       main controller (replies from driver boards)
+//   0xF0-0xFE  group 0-14
+//   0xFF       broadcast to every board
+#define RS485_ADDR_UNICAST_BASE 0x80
+#define RS485_ADDR_MASTER 0xEF
+#define RS485_ADDR_GROUP_BASE 0xF0
+#define RS485_ADDR_BROADCAST 0xFF
+#define RS485_ADDR_UNICAST(unit) (RS485_ADDR_UNICAST_BASE + (unit))
+#define RS485_ADDR_GROUP(group) (RS485_ADDR_GROUP_BASE + (group))
+
+// Well-known groups
+#define RS485_GROUP_PEDAL 0 // Boards driving the sustain pedal stepper
 
 // Function prototypes
 HAL_StatusTypeDef RS485_Init(void);
 HAL_StatusTypeDef RS485_SendString(const char *str);
+HAL_StatusTypeDef RS485_SendFrame(uint8_t address, const char *payload);
+HAL_StatusTypeDef RS485_ReceiveFrame(uint8_t *address, char *payload, uint16_t size, uint32_t timeout_ms);
 void RS485_UART_Init(void);
 
 #endif // RS485_H
@@ -0,0 +1,711 @@
+#include "bus_dispatch.h"
+#include "rs485.h"
+#include "timebase.h"
+#include <stdio.h>
+
+// Time of the last clock sync beacon
+static uint32_t last_sync_time = 0;
+
+// Flow control state for each driver board
+static BusBoardStatus_t g_boards[BUS_NUM_BOARDS];
+
+// Reference press for a channel, as last sent in full format
+typedef struct
+{
+  bool valid;
+  uint8_t duty_cycle;
+  uint8_t profile;        // Envelope profile of the keyframe
+  uint8_t velocity;       // MIDI velocity of the keyframe (BUS_DRIVER_VELOCITY)
+  uint32_t keyframe_time; // HAL tick at which the keyframe was sent
+} BusChannelReference_t;
+
+// Running status the main controller believes each board holds
+typedef struct
+{
+  char opcode;           // Opcode of the last full P/R command, 0 if none yet
+  uint8_t compact_count; // Compact frames sent since the last full P/R command
+  BusChannelReference_t channels[BUS_CHANNELS_PER_BOARD];
+} BusRunningStatus_t;
+
+static BusRunningStatus_t g_running_status[BUS_NUM_BOARDS];
+
+// Channels pressed and not released since, one bit per channel
+static uint64_t g_held_channels[BUS_NUM_BOARDS];
+
+// Envelope profile table as last uploaded to the drivers, and which entries
+// have been uploaded
+static BusEnvelopeProfile_t g_profiles[BUS_NUM_PROFILES];
+static uint32_t g_profiles_loaded;
+
+/**
+ * @brief Map a MIDI note to its driver board and channel
+ * @param note: MIDI note number
+ * @param unit: Receives the unit number of the board
+ * @param channel: Receives the channel on that board (0-11)
+ * @return HAL_OK if the note is on the keyboard, HAL_ERROR otherwise
+ */
+static HAL_StatusTypeDef BusDispatch_MapNote(uint8_t note, uint8_t *unit, uint8_t *channel)
+{
+  if (note < BUS_LOWEST_NOTE || note >= BUS_LOWEST_NOTE + BUS_NUM_NOTES)
+  {
+    return HAL_ERROR;
+  }
+
+  uint8_t key_index = note - BUS_LOWEST_NOTE;
+
+  *unit = (key_index / BUS_CHANNELS_PER_BOARD) % BUS_NUM_BOARDS;
+  *channel = key_index % BUS_CHANNELS_PER_BOARD;
+
+  return HAL_OK;
+}
+
+/**
+ * @brief Send one entry of the profile table as an "E" frame
+ * @param address: Destination address byte
+ * @param id: Profile ID
+ * @return HAL status
+ */
+static HAL_StatusTypeDef BusDispatch_SendProfile(uint8_t address, uint8_t id)
+{
+  const BusEnvelopeProfile_t *profile = &g_profiles[id];
+  char command[RS485_MAX_FRAME_SIZE];
+
+  snprintf(command, sizeof(command), "E:%u:%u:%u:%u:%u:%u", id, profile->duty_cycle,
+           profile->initial_strike_time, profile->followup_duty_cycle, profile->followup_time,
+           profile->hold_duty_cycle);
+  return RS485_SendFrame(address, command);
+}
+
+/**
+ * @brief Ask a board how many free slots its command queue has
+ * @param unit: Board unit number
+ * @return HAL_OK if the board answered, HAL_TIMEOUT otherwise
+ */
+static HAL_StatusTypeDef BusDispatch_PollCredits(uint8_t unit)
+{
+  BusBoardStatus_t *board = &g_boards[unit];
+
+  board->polls++;
+  board->last_poll_time = HAL_GetTick();
+
+  if (RS485_SendFrame(RS485_ADDR_UNICAST(unit), "C:?") == HAL_OK)
+  {
+    // Reply: "C:<unit>:<free slots>:<free pedal slots>:<dropped>:<hottest coil C>:<profile mask, hex>"
+    uint8_t address;
+    char reply[48];
+    while (RS485_ReceiveFrame(&address, reply, sizeof(reply), RS485_REPLY_TIMEOUT) == HAL_OK)
+    {
+      unsigned int reply_unit;
+      unsigned int free_slots;
+      unsigned int free_pedal_slots;
+      unsigned long dropped;
+      unsigned int coil_temperature;
+      unsigned long profiles;
+      if (address == RS485_ADDR_MASTER &&
+          sscanf(reply, "C:%u:%u:%u:%lu:%u:%lx", &reply_unit, &free_slots, &free_pedal_slots, &dropped,
+                 &coil_temperature, &profiles) == 6 &&
+          reply_unit == unit)
+      {
+        board->credits = (free_slots > BUS_DRIVER_QUEUE_SIZE) ? BUS_DRIVER_QUEUE_SIZE : free_slots;
+        board->pedal_credits =
+            (free_pedal_slots > BUS_DRIVER_PEDAL_QUEUE_SIZE) ? BUS_DRIVER_PEDAL_QUEUE_SIZE : free_pedal_slots;
+        board->driver_drops = dropped;
+        board->coil_temperature = (uint16_t)coil_temperature;
+        board->profiles = (uint32_t)profiles;
+        board->online = true;
+        return HAL_OK;
+      }
+    }
+  }
+
+  board->poll_timeouts++;
+  board->credits = 0;
+  board->pedal_credits = 0;
+  board->online = false;
+  return HAL_TIMEOUT;
+}
+
+/**
+ * @brief Spend one credit on every board a command is addressed to
+ *
+ * Nothing is spent unless every board has room, so a deferred command can be
+ * retried as a whole. Boards that do not answer polls are not waited for;
+ * commands to them are counted as unacknowledged.
+ * @param address: Destination address byte
+ * @param pedal: true for a pedal command, which drivers queue in their pedal lane
+ * @return HAL_OK if the command may be sent, HAL_BUSY if a board is full
+ */
+static HAL_StatusTypeDef BusDispatch_AcquireCredits(uint8_t address, bool pedal)
+{
+  uint8_t first_unit = 0;
+  uint8_t num_units = BUS_NUM_BOARDS;
+
+  if (address < RS485_ADDR_MASTER)
+  {
+    first_unit = address - RS485_ADDR_UNICAST_BASE;
+    num_units = 1;
+  }
+
+  for (uint8_t unit = first_unit; unit < first_unit + num_units; unit++)
+  {
+    BusBoardStatus_t *board = &g_boards[unit];
+    const uint8_t *credits = pedal ? &board->pedal_credits : &board->credits;
+    if (*credits > 0)
+    {
+      continue;
+    }
+
+    uint32_t interval = board->online ? BUS_CREDIT_POLL_INTERVAL_MS : BUS_OFFLINE_POLL_INTERVAL_MS;
+    if ((HAL_GetTick() - board->last_poll_time) >= interval)
+    {
+      BusDispatch_PollCredits(unit);
+    }
+
+    if (board->online && *credits == 0)
+    {
+      board->stalls++;
+      return HAL_BUSY;
+    }
+  }
+
+  for (uint8_t unit = first_unit; unit < first_unit + num_units; unit++)
+  {
+    BusBoardStatus_t *board = &g_boards[unit];
+    uint8_t *credits = pedal ? &board->pedal_credits : &board->credits;
+    if (*credits > 0)
+    {
+      (*credits)--;
+    }
+    else
+    {
+      board->unacknowledged++;
+    }
+  }
+
+  return HAL_OK;
+}
+
+/**
+ * @brief Send a command frame, appending the execute-at time if given
+ *
+ * The command is only sent if every addressed board has a free queue slot.
+ * @param address: Destination address byte
+ * @param command: Command text without time suffix
+ * @param execute_at: Master time to execute at, or BUS_EXECUTE_NOW
+ * @param pedal: true for a pedal command, which spends pedal lane credits
+ * @return HAL status, HAL_BUSY if the command must be retried later
+ */
+static HAL_StatusTypeDef BusDispatch_Send(uint8_t address, const char *command, uint32_t execute_at, bool pedal)
+{
+  if (BusDispatch_AcquireCredits(address, pedal) != HAL_OK)
+  {
+    return HAL_BUSY;
+  }
+
+  if (execute_at == BUS_EXECUTE_NOW)
+  {
+    return RS485_SendFrame(address, command);
+  }
+
+  char frame[RS485_MAX_FRAME_SIZE];
+  snprintf(frame, sizeof(frame), "%s@%lu", command, (unsigned long)execute_at);
+  return RS485_SendFrame(address, frame);
+}
+
+/**
+ * @brief Send a compact frame with its execute-at time relative to the frame start
+ *
+ * The offset is taken right before the frame goes out; drivers measure it
+ * from the start of the address byte, as for sync beacons.
+ * @param address: Destination address byte
+ * @param command: Compact command text without time suffix
+ * @param execute_at: Master time to execute at, or BUS_EXECUTE_NOW
+ * @return HAL status, HAL_BUSY if the command must be retried later
+ */
+static HAL_StatusTypeDef BusDispatch_SendCompact(uint8_t address, const char *command, uint32_t execute_at)
+{
+  if (BusDispatch_AcquireCredits(address, false) != HAL_OK)
+  {
+    return HAL_BUSY;
+  }
+
+  int32_t offset = (int32_t)(execute_at - Timebase_Micros());
+  if (execute_at == BUS_EXECUTE_NOW || offset <= 0)
+  {
+    // Due already - run on arrival
+    return RS485_SendFrame(address, command);
+  }
+
+  char frame[RS485_MAX_FRAME_SIZE];
+  snprintf(frame, sizeof(frame), "%s@%lu", command,
+           (unsigned long)((offset + BUS_COMPACT_TIME_UNIT_US / 2) / BUS_COMPACT_TIME_UNIT_US));
+  return RS485_SendFrame(address, frame);
+}
+
+/**
+ * @brief Check whether a key command can use the compact encoding
+ * @param unit: Board unit number
+ * @param channel: Channel on that board
+ * @return true if the board holds a fresh press reference for the channel
+ */
+static bool BusDispatch_CanCompact(uint8_t unit, uint8_t channel)
+{
+  const BusRunningStatus_t *status = &g_running_status[unit];
+  const BusChannelReference_t *reference = &status->channels[channel];
+
+  return status->opcode == 'P' && reference->valid && status->compact_count < BUS_KEYFRAME_MAX_COMPACT &&
+         (HAL_GetTick() - reference->keyframe_time) < BUS_KEYFRAME_INTERVAL_MS;
+}
+
+/**
+ * @brief Check whether a press with a profile can be sent relative to a channel's reference
+ *
+ * Compact frames only change the duty cycle, so the rest of the envelope
+ * must match the reference profile's.
+ * @param reference: Channel reference held by the board
+ * @param profile: Profile ID of the new press
+ * @return true if the two profiles differ at most in duty cycle
+ */
+static bool BusDispatch_SameEnvelope(const BusChannelReference_t *reference, uint8_t profile)
+{
+  const BusEnvelopeProfile_t *a = &g_profiles[reference->profile];
+  const BusEnvelopeProfile_t *b = &g_profiles[profile];
+
+  return a->initial_strike_time == b->initial_strike_time && a->followup_duty_cycle == b->followup_duty_cycle &&
+         a->followup_time == b->followup_time && a->hold_duty_cycle == b->hold_duty_cycle;
+}
+
+/**
+ * @brief Fill in the default profile table
+ *
+ * Profile n covers MIDI velocities 4n to 4n+3 and only sets the duty cycle,
+ * 65-80% as the direct duty mapping did; everything else is left to the
+ * driver defaults.
+ */
+static void BusDispatch_DefaultProfiles(BusEnvelopeProfile_t *profiles)
+{
+  for (uint8_t id = 0; id < BUS_NUM_PROFILES; id++)
+  {
+    uint8_t velocity = (id * 4) + 2;
+    profiles[id] = (BusEnvelopeProfile_t){0};
+    profiles[id].duty_cycle = 65 + ((velocity * 15) / 127);
+  }
+}
+
+/**
+ * @brief Initialize bus dispatch and put every driver into a known state
+ */
+void BusDispatch_Init(void)
+{
+  Timebase_Init();
+
+  // Learn how much room each board has
+  for (uint8_t unit = 0; unit < BUS_NUM_BOARDS; unit++)
+  {
+    g_boards[unit] = (BusBoardStatus_t){0};
+    g_running_status[unit] = (BusRunningStatus_t){0};
+    g_held_channels[unit] = 0;
+    BusDispatch_PollCredits(unit);
+  }
+
+  BusDispatch_AllNotesOff();
+
+  // Give every driver the default envelopes
+  BusEnvelopeProfile_t profiles[BUS_NUM_PROFILES];
+  BusDispatch_DefaultProfiles(profiles);
+  BusDispatch_LoadProfiles(profiles, BUS_NUM_PROFILES, false);
+
+  // Sync driver clocks before any timed command goes out
+  BusDispatch_SendSyncBeacon();
+  last_sync_time = HAL_GetTick();
+}
+
+/**
+ * @brief Periodic bus housekeeping (call this in main loop)
+ */
+void BusDispatch_Update(void)
+{
+  uint32_t current_time = HAL_GetTick();
+
+  if ((current_time - last_sync_time) >= BUS_SYNC_INTERVAL_MS)
+  {
+    BusDispatch_SendSyncBeacon();
+    last_sync_time = current_time;
+  }
+}
+
+/**
+ * @brief Broadcast the master clock so drivers can track offset and drift
+ *
+ * The timestamp is taken immediately before the frame goes out; drivers
+ * timestamp the address byte and correct for its wire time.
+ * @return HAL status
+ */
+HAL_StatusTypeDef BusDispatch_SendSyncBeacon(void)
+{
+  char command[16];
+  snprintf(command, sizeof(command), "S:%lu", (unsigned long)Timebase_Micros());
+  return RS485_SendFrame(RS485_ADDR_BROADCAST, command);
+}
+
+/**
+ * @brief Upload an envelope profile table to every driver
+ *
+ * Uploads are applied by the drivers as they arrive and are not queued, so
+ * they need no credits. Notes already sent keep the envelope they were sent
+ * with; every channel gets a fresh keyframe afterwards.
+ * @param profiles: Profile table
+ * @param count: Number of profiles, at most BUS_NUM_PROFILES
+ * @param save: true to have the drivers store the table in flash as well
+ * @return HAL status
+ */
+HAL_StatusTypeDef BusDispatch_LoadProfiles(const BusEnvelopeProfile_t *profiles, uint8_t count, bool save)
+{
+  if (profiles == NULL || count > BUS_NUM_PROFILES)
+  {
+    return HAL_ERROR;
+  }
+
+  HAL_StatusTypeDef status = HAL_OK;
+
+  for (uint8_t id = 0; id < count && status == HAL_OK; id++)
+  {
+    g_profiles[id] = profiles[id];
+    g_profiles_loaded |= (uint32_t)1 << id;
+    status = BusDispatch_SendProfile(RS485_ADDR_BROADCAST, id);
+    for (uint8_t unit = 0; unit < BUS_NUM_BOARDS && status == HAL_OK; unit++)
+    {
+      g_boards[unit].profiles |= (uint32_t)1 << id;
+    }
+  }
+
+  if (status == HAL_OK && save)
+  {
+    status = RS485_SendFrame(RS485_ADDR_BROADCAST, "E:W");
+  }
+
+  // References may now name a profile with a different envelope
+  for (uint8_t unit = 0; unit < BUS_NUM_BOARDS; unit++)
+  {
+    for (uint8_t channel = 0; channel < BUS_CHANNELS_PER_BOARD; channel++)
+    {
+      g_running_status[unit].channels[channel].valid = false;
+    }
+  }
+
+  return status;
+}
+
+/**
+ * @brief Set the release ramp of the key that plays a note
+ *
+ * Settings are applied by the driver as they arrive and are not queued, so
+ * they need no credits. With fewer boards than the keyboard needs, every
+ * note folded onto the same key shares its ramp.
+ * @param note: MIDI note number
+ * @param ramp: BUS_RAMP_STEP, BUS_RAMP_LINEAR or BUS_RAMP_EXPONENTIAL
+ * @param duration_ms: Ramp length (0 = cut at once)
+ * @return HAL status
+ */
+HAL_StatusTypeDef BusDispatch_SetRelease(uint8_t note, uint8_t ramp, uint16_t duration_ms)
+{
+  uint8_t unit;
+  uint8_t channel;
+  if (ramp > BUS_RAMP_EXPONENTIAL || BusDispatch_MapNote(note, &unit, &channel) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  char command[24];
+  snprintf(command, sizeof(command), "D:%u:%u:%u", channel, ramp, duration_ms);
+  return RS485_SendFrame(RS485_ADDR_UNICAST(unit), command);
+}
+
+/**
+ * @brief Set the calibration of the key that plays a note
+ *
+ * Sent as one "K:<channel>:<point>:<duty>" frame per curve point and a
+ * "K:<channel>:<min strike>:<hold>:<latency us>" frame. Settings are applied
+ * by the driver as they arrive and are not queued, so they need no credits.
+ * @param note: MIDI note number
+ * @param calibration: New calibration
+ * @return HAL status
+ */
+HAL_StatusTypeDef BusDispatch_SetCalibration(uint8_t note, const BusKeyCalibration_t *calibration)
+{
+  uint8_t unit;
+  uint8_t channel;
+  if (calibration == NULL || BusDispatch_MapNote(note, &unit, &channel) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  HAL_StatusTypeDef status = HAL_OK;
+  char command[32];
+
+  for (uint8_t point = 0; point < BUS_CALIBRATION_POINTS && status == HAL_OK; point++)
+  {
+    snprintf(command, sizeof(command), "K:%u:%u:%u", channel, point, calibration->curve[point]);
+    status = RS485_SendFrame(RS485_ADDR_UNICAST(unit), command);
+  }
+
+  if (status == HAL_OK)
+  {
+    snprintf(command, sizeof(command), "K:%u:%u:%u:%u", channel, calibration->min_strike_duty,
+             calibration->hold_duty, calibration->latency_us);
+    status = RS485_SendFrame(RS485_ADDR_UNICAST(unit), command);
+  }
+
+  return status;
+}
+
+/**
+ * @brief Have every driver store its calibration table in flash
+ * @return HAL status
+ */
+HAL_StatusTypeDef BusDispatch_SaveCalibration(void)
+{
+  return RS485_SendFrame(RS485_ADDR_BROADCAST, "K:W");
+}
+
+/**
+ * @brief Send a key press by raw velocity, for the driver to calibrate
+ *
+ * The driver's reference duty comes from its own calibration, so a compact
+ * frame is only used to repeat the reference velocity exactly.
+ * @param unit: Board unit number
+ * @param channel: Channel on that board
+ * @param velocity: MIDI velocity (1-127)
+ * @param execute_at: Master time to execute at, or BUS_EXECUTE_NOW
+ * @return HAL status, HAL_BUSY if the board is full and the note must be retried
+ */
+static HAL_StatusTypeDef BusDispatch_NoteOnVelocity(uint8_t unit, uint8_t channel, uint8_t velocity, uint32_t execute_at)
+{
+  BusChannelReference_t *reference = &g_running_status[unit].channels[channel];
+  uint64_t channel_bit = (uint64_t)1 << channel;
+  bool held = (g_held_channels[unit] & channel_bit) != 0;
+  HAL_StatusTypeDef status;
+  char command[16];
+
+  if (!held && BusDispatch_CanCompact(unit, channel) && reference->velocity == velocity)
+  {
+    sprintf(command, "%d", channel);
+    status = BusDispatch_SendCompact(RS485_ADDR_UNICAST(unit), command, execute_at);
+    if (status == HAL_OK)
+    {
+      g_held_channels[unit] |= channel_bit;
+      g_boards[unit].compact_frames++;
+      g_running_status[unit].compact_count++;
+    }
+    return status;
+  }
+
+  // "V:channel:velocity", or "U:channel:velocity" to re-strike a held note
+  sprintf(command, "%c:%d:%d", held ? 'U' : 'V', channel, velocity);
+  status = BusDispatch_Send(RS485_ADDR_UNICAST(unit), command, execute_at, false);
+  if (status == HAL_OK)
+  {
+    g_running_status[unit].opcode = 'P';
+    reference->valid = true;
+    reference->velocity = velocity;
+    reference->keyframe_time = HAL_GetTick();
+    g_held_channels[unit] |= channel_bit;
+    g_boards[unit].keyframes++;
+    g_running_status[unit].compact_count = 0;
+    if (held)
+    {
+      g_boards[unit].restrikes++;
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief Send a key press to the board that owns the note
+ * @param note: MIDI note number
+ * @param velocity: MIDI velocity (1-127)
+ * @param execute_at: Master time to execute at, or BUS_EXECUTE_NOW
+ * @return HAL status, HAL_BUSY if the board is full and the note must be retried
+ */
+HAL_StatusTypeDef BusDispatch_NoteOn(uint8_t note, uint8_t velocity, uint32_t execute_at)
+{
+  uint8_t unit;
+  uint8_t channel;
+  if (BusDispatch_MapNote(note, &unit, &channel) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  if (BUS_DRIVER_VELOCITY)
+  {
+    return BusDispatch_NoteOnVelocity(unit, channel, velocity, execute_at);
+  }
+
+  // Velocity (0-127) selects one of the envelope profiles
+  uint8_t profile = (velocity >> 2) % BUS_NUM_PROFILES;
+  uint8_t duty_cycle = g_profiles[profile].duty_cycle;
+
+  BusChannelReference_t *reference = &g_running_status[unit].channels[channel];
+  uint64_t channel_bit = (uint64_t)1 << channel;
+  HAL_StatusTypeDef status;
+  char command[16];
+
+  // A board that reported the profile missing gets it again right before
+  // the first note that uses it; uploads are applied on arrival and need no
+  // credits, and re-sending only what is played keeps a reset board from
+  // tying up the bus with the whole table
+  uint32_t profile_bit = (uint32_t)1 << profile;
+  if ((g_profiles_loaded & profile_bit) && !(g_boards[unit].profiles & profile_bit) &&
+      BusDispatch_SendProfile(RS485_ADDR_UNICAST(unit), profile) == HAL_OK)
+  {
+    g_boards[unit].profiles |= profile_bit;
+    g_boards[unit].profile_resends++;
+  }
+
+  // A note struck again before its release is re-struck from where the key
+  // is: "T:channel:profile"
+  if (g_held_channels[unit] & channel_bit)
+  {
+    sprintf(command, "T:%d:%d", channel, profile);
+    status = BusDispatch_Send(RS485_ADDR_UNICAST(unit), command, execute_at, false);
+    if (status == HAL_OK)
+    {
+      g_running_status[unit].opcode = 'P';
+      reference->valid = true;
+      reference->duty_cycle = duty_cycle;
+      reference->profile = profile;
+      reference->keyframe_time = HAL_GetTick();
+      g_boards[unit].keyframes++;
+      g_running_status[unit].compact_count = 0;
+      g_boards[unit].restrikes++;
+    }
+    return status;
+  }
+
+  if (BusDispatch_CanCompact(unit, channel) && BusDispatch_SameEnvelope(reference, profile))
+  {
+    // Compact press: "channel" alone repeats the reference duty
+    int delta = (int)duty_cycle - reference->duty_cycle;
+    if (delta == 0)
+    {
+      sprintf(command, "%d", channel);
+    }
+    else
+    {
+      sprintf(command, "%d%+d", channel, delta);
+    }
+
+    status = BusDispatch_SendCompact(RS485_ADDR_UNICAST(unit), command, execute_at);
+    if (status == HAL_OK)
+    {
+      g_held_channels[unit] |= channel_bit;
+      g_boards[unit].compact_frames++;
+      g_running_status[unit].compact_count++;
+    }
+    return status;
+  }
+
+  // Send note on command as a keyframe: "N:channel:profile"
+  sprintf(command, "N:%d:%d", channel, profile);
+  status = BusDispatch_Send(RS485_ADDR_UNICAST(unit), command, execute_at, false);
+  if (status == HAL_OK)
+  {
+    g_running_status[unit].opcode = 'P';
+    reference->valid = true;
+    reference->duty_cycle = duty_cycle;
+    reference->profile = profile;
+    reference->keyframe_time = HAL_GetTick();
+    g_held_channels[unit] |= channel_bit;
+    g_boards[unit].keyframes++;
+    g_running_status[unit].compact_count = 0;
+  }
+  return status;
+}
+
+/**
+ * @brief Send a key release to the board that owns the note
+ * @param note: MIDI note number
+ * @param execute_at: Master time to execute at, or BUS_EXECUTE_NOW
+ * @return HAL status, HAL_BUSY if the board is full and the note must be retried
+ */
+HAL_StatusTypeDef BusDispatch_NoteOff(uint8_t note, uint32_t execute_at)
+{
+  uint8_t unit;
+  uint8_t channel;
+  if (BusDispatch_MapNote(note, &unit, &channel) != HAL_OK)
+  {
+    return HAL_ERROR;
+  }
+
+  HAL_StatusTypeDef status;
+  char command[16];
+
+  if (BusDispatch_CanCompact(unit, channel))
+  {
+    // Compact release: running press with duty 0, "channel:0"
+    sprintf(command, "%d:0", channel);
+    status = BusDispatch_SendCompact(RS485_ADDR_UNICAST(unit), command, execute_at);
+    if (status == HAL_OK)
+    {
+      g_held_channels[unit] &= ~((uint64_t)1 << channel);
+      g_boards[unit].compact_frames++;
+      g_running_status[unit].compact_count++;
+    }
+    return status;
+  }
+
+  // Send note off command: "R:channel:0"
+  sprintf(command, "R:%d:0", channel);
+  status = BusDispatch_Send(RS485_ADDR_UNICAST(unit), command, execute_at, false);
+  if (status == HAL_OK)
+  {
+    g_running_status[unit].opcode = 'R';
+    g_held_channels[unit] &= ~((uint64_t)1 << channel);
+    g_boards[unit].keyframes++;
+    g_running_status[unit].compact_count = 0;
+  }
+  return status;
+}
+
+/**
+ * @brief Press or release the sustain pedal on every pedal board
+ * @param pressed: true to press, false to release
+ * @param execute_at: Master time to execute at, or BUS_EXECUTE_NOW
+ * @return HAL status, HAL_BUSY if a board is full and the command must be retried
+ */
+HAL_StatusTypeDef BusDispatch_Pedal(bool pressed, uint32_t execute_at)
+{
+  return BusDispatch_Send(RS485_ADDR_GROUP(RS485_GROUP_PEDAL), pressed ? "P:P" : "R:P", execute_at, true);
+}
+
+/**
+ * @brief Release every key on every board with a single broadcast frame
+ * @return HAL status, HAL_BUSY if a board is full and the command must be retried
+ */
+HAL_StatusTypeDef BusDispatch_AllNotesOff(void)
+{
+  HAL_StatusTypeDef status = BusDispatch_Send(RS485_ADDR_BROADCAST, "R:A", BUS_EXECUTE_NOW, false);
+  if (status == HAL_OK)
+  {
+    for (uint8_t unit = 0; unit < BUS_NUM_BOARDS; unit++)
+    {
+      g_held_channels[unit] = 0;
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief Get flow control state and drop counters of a board (for diagnostics)
+ * @param unit: Board unit number
+ * @return Pointer to board status, or NULL if the unit is not on the bus
+ */
+const BusBoardStatus_t *BusDispatch_GetBoardStatus(uint8_t unit)
+{
+  if (unit >= BUS_NUM_BOARDS)
+  {
+    return NULL;
+  }
+
+  return &g_boards[unit];
+}
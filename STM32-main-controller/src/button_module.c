@@ -70,17 +70,8 @@ void ButtonModule_Update(ButtonModule_t *button)
         button->debounce_active = 0;
 
         // Send appropriate command based on state change
-        if (button->current_state == BUTTON_STATE_PRESSED)
-        {
-          // Max duty cycle 80
-          // Button pressed - send "P:0:100\n"
-          RS485_SendString("P:P\n");
-        }
-        else
-        {
-          // Button released - send "R:0:0\n"
-          RS485_SendString("R:P\n");
-        }
+        // Button pressed - send "P:P", released - send "R:P"
+        BusDispatch_Pedal(button->current_state == BUTTON_STATE_PRESSED, BUS_EXECUTE_NOW);
       }
     }
   }
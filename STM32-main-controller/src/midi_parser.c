@@ -71,7 +71,19 @@ HAL_StatusTypeDef MidiParser_Init(MidiParser_t *parser)
  */
 HAL_StatusTypeDef MidiParser_LoadEmbeddedData(MidiParser_t *parser)
 {
-  if (parser == NULL)
+  return MidiParser_LoadData(parser, twinkle_midi_data, sizeof(twinkle_midi_data));
+}
+
+/**
+ * @brief Load MIDI data from a buffer holding a complete MIDI file
+ * @param parser Pointer to MIDI parser structure
+ * @param data Pointer to MIDI file data
+ * @param size Size of MIDI file data in bytes
+ * @return HAL status
+ */
+HAL_StatusTypeDef MidiParser_LoadData(MidiParser_t *parser, const uint8_t *data, uint32_t size)
+{
+  if (parser == NULL || data == NULL)
   {
     return HAL_ERROR;
   }
@@ -79,15 +91,15 @@ HAL_StatusTypeDef MidiParser_LoadEmbeddedData(MidiParser_t *parser)
   // Clean up previous data if loaded
   MidiParser_Cleanup(parser);
 
-  // Use embedded MIDI data directly
-  const uint32_t file_size = sizeof(twinkle_midi_data);
+  // Work on a copy of the file data
+  const uint32_t file_size = size;
   uint8_t *file_data = malloc(file_size);
   if (file_data == NULL)
   {
     return HAL_ERROR;
   }
 
-  memcpy(file_data, twinkle_midi_data, file_size);
+  memcpy(file_data, data, file_size);
 
   // Parse MIDI header
   uint32_t offset = 0;
@@ -127,7 +139,7 @@ HAL_StatusTypeDef MidiParser_LoadEmbeddedData(MidiParser_t *parser)
   // Parse tracks (find the track with note events)
   for (uint16_t i = 0; i < num_tracks; i++) // Parse all tracks to find note events
   {
-    if (offset >= file_size)
+    if (offset + 8 > file_size) // Room for "MTrk" and the track length
     {
       break;
     }
@@ -142,6 +154,10 @@ HAL_StatusTypeDef MidiParser_LoadEmbeddedData(MidiParser_t *parser)
 
     // Read track length
     uint32_t track_length = MidiParser_Read32Bit(file_data, &offset);
+    if (track_length > file_size - offset)
+    {
+      break; // Truncated file
+    }
 
     // Parse track data
     HAL_StatusTypeDef status = MidiParser_ParseTrack(parser, &file_data[offset], track_length);
@@ -518,6 +534,24 @@ uint32_t MidiParser_TicksToMilliseconds(MidiParser_t *parser, uint32_t ticks)
   return (uint32_t)result;
 }
 
+/**
+ * @brief Convert MIDI ticks to microseconds
+ * @param parser Pointer to MIDI parser structure
+ * @param ticks Number of MIDI ticks
+ * @return Microseconds
+ */
+uint32_t MidiParser_TicksToMicroseconds(MidiParser_t *parser, uint32_t ticks)
+{
+  if (parser == NULL || parser->time_division == 0)
+  {
+    return 0;
+  }
+
+  // Formula: microseconds = (ticks * tempo) / time_division
+  uint64_t result = ((uint64_t)ticks * parser->tempo) / parser->time_division;
+  return (uint32_t)result;
+}
+
 /**
  * @brief Get global MIDI parser instance
  * @return Pointer to global MIDI parser instance
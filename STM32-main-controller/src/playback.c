@@ -0,0 +1,97 @@
+#include "playback.h"
+#include "bus_dispatch.h"
+#include "timebase.h"
+
+// Playback state
+static MidiParser_t *g_parser = NULL;
+static uint32_t event_time = 0; // Master time at which the current event should sound
+static bool playback_started = false;
+
+/**
+ * @brief Initialize playback of a loaded MIDI file from its first event
+ * @param parser: Pointer to MIDI parser holding the song
+ */
+void Playback_Init(MidiParser_t *parser)
+{
+  g_parser = parser;
+  event_time = 0;
+  playback_started = false;
+}
+
+/**
+ * @brief Send every event that is due inside the playout window (call this in main loop)
+ */
+void Playback_Update(void)
+{
+  if (g_parser == NULL)
+  {
+    return;
+  }
+
+  if (g_parser->is_loaded && MidiParser_HasMoreEvents(g_parser))
+  {
+    // Get the next event without advancing the parser
+    MidiEvent_t *event = MidiParser_GetEvent(g_parser, MidiParser_GetCurrentEventIndex(g_parser));
+    uint32_t current_time = Timebase_Micros();
+
+    if (!playback_started && event != NULL)
+    {
+      // Start playback one playout delay from now
+      event_time = current_time + BUS_PLAYOUT_DELAY_US + MidiParser_TicksToMicroseconds(g_parser, event->delta_time);
+      playback_started = true;
+    }
+
+    // Send every event that falls inside the playout window, stamped with
+    // the time it should sound rather than the time it happens to go out
+    while (event != NULL && (int32_t)(event_time - current_time) <= BUS_PLAYOUT_DELAY_US)
+    {
+      // Process the event for player piano control
+      HAL_StatusTypeDef status;
+      if (event->is_sustain_event)
+      {
+        // Handle sustain pedal event
+        status = BusDispatch_Pedal(event->is_sustain_on, event_time);
+      }
+      else if (event->is_note_on)
+      {
+        status = BusDispatch_NoteOn(event->note_number, event->velocity, event_time);
+      }
+      else
+      {
+        status = BusDispatch_NoteOff(event->note_number, event_time);
+      }
+
+      // Driver queue full - keep this event and retry it on the next pass
+      if (status == HAL_BUSY)
+      {
+        break;
+      }
+
+      // Advance to next event and update timing
+      MidiParser_GetNextEvent(g_parser);
+      event = MidiParser_GetEvent(g_parser, MidiParser_GetCurrentEventIndex(g_parser));
+      if (event != NULL)
+      {
+        event_time += MidiParser_TicksToMicroseconds(g_parser, event->delta_time);
+      }
+    }
+  }
+  else if (playback_started && TIMEBASE_REACHED(Timebase_Micros(), event_time))
+  {
+    // End of song, once the last timed event has played -
+    // make sure nothing is left held on any board
+    if (BusDispatch_AllNotesOff() != HAL_BUSY)
+    {
+      playback_started = false;
+    }
+  }
+}
+
+/**
+ * @brief Check whether the song has been played to the end
+ * @return true once every event has been sent and played
+ */
+bool Playback_IsFinished(void)
+{
+  return g_parser == NULL || (!MidiParser_HasMoreEvents(g_parser) && !playback_started);
+}
@@ -1,5 +1,6 @@
 #include "rs485.h"
 #include "stm32f1xx_hal.h"
+#include <stdbool.h>
 
 // Global UART handle
 UART_HandleTypeDef huart3;
@@ -44,6 +45,94 @@ HAL_StatusTypeDef RS485_SendString(const char *str)
   return status;
 }
 
+/**
+ * @brief Send an addressed frame via RS485
+ * @param address: Destination address byte (unicast, group or broadcast)
+ * @param payload: Null-terminated command text, without newline
+ * @return HAL status
+ */
+HAL_StatusTypeDef RS485_SendFrame(uint8_t address, const char *payload)
+{
+  char frame[RS485_MAX_FRAME_SIZE];
+  uint16_t length = 0;
+
+  // Address byte, command text and terminating newline go out in one transfer
+  frame[length++] = (char)address;
+  while (*payload != '\0' && length < RS485_MAX_FRAME_SIZE - 1)
+  {
+    frame[length++] = *payload++;
+  }
+  frame[length++] = '\n';
+
+  HAL_StatusTypeDef status = HAL_UART_Transmit(&huart3, (uint8_t *)frame, length, RS485_TIMEOUT);
+
+  // Wait for transmission to complete
+  while (__HAL_UART_GET_FLAG(&huart3, UART_FLAG_TC) == RESET)
+  {
+    // Wait for transmission complete flag
+  }
+
+  return status;
+}
+
+/**
+ * @brief Wait for an addressed frame on the bus (blocking)
+ *
+ * Used right after a query, so reception starts with the reply. Anything
+ * left in the receiver from our own transmission is discarded first.
+ * @param address: Receives the frame's address byte
+ * @param payload: Buffer for the frame text, null-terminated, without newline
+ * @param size: Size of payload buffer
+ * @param timeout_ms: Maximum time to wait for a complete frame
+ * @return HAL_OK if a frame was received, HAL_TIMEOUT otherwise
+ */
+HAL_StatusTypeDef RS485_ReceiveFrame(uint8_t *address, char *payload, uint16_t size, uint32_t timeout_ms)
+{
+  if (address == NULL || payload == NULL || size == 0)
+  {
+    return HAL_ERROR;
+  }
+
+  uint32_t start_time = HAL_GetTick();
+  uint16_t length = 0;
+  bool in_frame = false;
+
+  // Drop stale data and clear any overrun from the echo of our own frame
+  __HAL_UART_CLEAR_OREFLAG(&huart3);
+
+  while ((HAL_GetTick() - start_time) < timeout_ms)
+  {
+    uint8_t byte;
+    if (HAL_UART_Receive(&huart3, &byte, 1, 1) != HAL_OK)
+    {
+      continue;
+    }
+
+    if (byte & 0x80)
+    {
+      // Address byte always starts a new frame
+      *address = byte;
+      length = 0;
+      in_frame = true;
+    }
+    else if (!in_frame)
+    {
+      continue;
+    }
+    else if (byte == '\n' || byte == '\r')
+    {
+      payload[length] = '\0';
+      return HAL_OK;
+    }
+    else if (length < size - 1)
+    {
+      payload[length++] = (char)byte;
+    }
+  }
+
+  return HAL_TIMEOUT;
+}
+
 /**
  * @brief Initialize UART for RS485 communication
  */
@@ -0,0 +1,76 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include "stm32f1xx_hal.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// Simulation configuration
+typedef struct
+{
+  uint32_t tx_gap_ns;       // Idle time left between bytes fed by the CPU (blocking and IT transmit)
+  uint32_t isr_latency_ns;  // Delay from the end of a stop bit to the receive interrupt
+  uint32_t loop_period_ns;  // Duration of one pass of the driver main loop
+  int32_t driver_drift_ppm; // Driver crystal error relative to the main controller
+  uint32_t driver_offset_us; // Driver clock value when the simulation starts
+} SimConfig_t;
+
+// Wire statistics
+typedef struct
+{
+  uint32_t frames_to_driver; // Frames sent by the main controller
+  uint32_t frames_to_master; // Frames sent by the driver
+  uint32_t bytes_to_driver;
+  uint32_t bytes_to_master;
+  uint64_t busy_ns;          // Time the bus carried data
+  uint32_t collisions;       // Transmissions started while the other side was sending
+  uint32_t driver_overruns;  // Bytes lost because the driver had not read the previous one
+  uint32_t master_overruns;  // Bytes lost because the main controller was not receiving
+} SimWireStats_t;
+
+// Trace event kinds
+typedef enum
+{
+  SIM_TRACE_PRESS = 0,
+  SIM_TRACE_RELEASE,
+  SIM_TRACE_PEDAL_PRESS,
+  SIM_TRACE_PEDAL_RELEASE
+} SimTraceKind_t;
+
+extern SimConfig_t g_sim_config;
+
+// Virtual time and wire (sim_hal.c)
+void Sim_Init(void);
+uint64_t Sim_Now(void);
+void Sim_AdvanceTo(uint64_t time_ns);
+uint32_t Sim_MasterMicros(void);
+uint32_t Sim_MasterTick(void);
+uint32_t Sim_DriverMicros(void);
+uint32_t Sim_BaudRate(void);
+uint32_t Sim_BitsPerByte(void);
+uint64_t Sim_ByteTimeNs(void);
+void Sim_GetLastMasterFrame(uint64_t *start_ns, uint64_t *end_ns, uint16_t *bytes);
+const SimWireStats_t *Sim_GetWireStats(void);
+
+// Main controller firmware (sim_master.c)
+HAL_StatusTypeDef SimMaster_Init(const uint8_t *midi_data, uint32_t midi_size);
+void SimMaster_Poll(void);
+bool SimMaster_IsFinished(void);
+void SimMaster_Report(FILE *out);
+extern UART_HandleTypeDef sim_master_huart3;
+extern USART_TypeDef sim_master_usart3;
+
+// Driver firmware (sim_driver.c)
+void SimDriver_Init(void);
+void SimDriver_Poll(void);
+void SimDriver_Report(FILE *out);
+extern UART_HandleTypeDef huart3;
+void USART3_IRQHandler(void);
+void DMA1_Channel3_IRQHandler(void);
+
+// Note tracing and report (sim_trace.c)
+void SimTrace_Sent(SimTraceKind_t kind, uint8_t note, uint8_t channel, uint32_t execute_at);
+void SimTrace_Applied(SimTraceKind_t kind, uint8_t channel);
+void SimTrace_Report(FILE *out);
+
+#endif // SIM_H
@@ -0,0 +1,275 @@
+#ifndef STM32F1XX_HAL_H
+#define STM32F1XX_HAL_H
+
+// Host stand-in for the STM32F1 HAL
+// Covers what the firmware modules built into the simulator use. Peripheral
+// registers are plain structs; the UART and DMA behaviour behind them is
+// modelled in virtual time by sim_hal.c.
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum
+{
+  HAL_OK = 0x00U,
+  HAL_ERROR = 0x01U,
+  HAL_BUSY = 0x02U,
+  HAL_TIMEOUT = 0x03U
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+  RESET = 0,
+  SET = !RESET
+} FlagStatus;
+
+typedef enum
+{
+  TIM1_UP_IRQn = 25,
+  TIM1_CC_IRQn = 27,
+  USART3_IRQn = 39,
+  DMA1_Channel2_IRQn = 12,
+  DMA1_Channel3_IRQn = 13
+} IRQn_Type;
+
+// GPIO
+typedef struct
+{
+  volatile uint32_t CRL, CRH, IDR, ODR, BSRR, BRR, LCKR;
+} GPIO_TypeDef;
+
+typedef struct
+{
+  uint32_t Pin;
+  uint32_t Mode;
+  uint32_t Pull;
+  uint32_t Speed;
+} GPIO_InitTypeDef;
+
+extern GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+#define GPIOA (&sim_gpioa)
+#define GPIOB (&sim_gpiob)
+#define GPIOC (&sim_gpioc)
+
+#define GPIO_PIN_0 0x0001U
+#define GPIO_PIN_1 0x0002U
+#define GPIO_PIN_2 0x0004U
+#define GPIO_PIN_3 0x0008U
+#define GPIO_PIN_4 0x0010U
+#define GPIO_PIN_5 0x0020U
+#define GPIO_PIN_6 0x0040U
+#define GPIO_PIN_7 0x0080U
+#define GPIO_PIN_8 0x0100U
+#define GPIO_PIN_9 0x0200U
+#define GPIO_PIN_10 0x0400U
+#define GPIO_PIN_11 0x0800U
+#define GPIO_PIN_12 0x1000U
+#define GPIO_PIN_13 0x2000U
+#define GPIO_PIN_14 0x4000U
+#define GPIO_PIN_15 0x8000U
+
+#define GPIO_MODE_INPUT 0x00U
+#define GPIO_MODE_OUTPUT_PP 0x01U
+#define GPIO_MODE_AF_PP 0x02U
+#define GPIO_MODE_AF_INPUT GPIO_MODE_INPUT
+#define GPIO_NOPULL 0x00U
+#define GPIO_PULLUP 0x01U
+#define GPIO_SPEED_FREQ_LOW 0x02U
+#define GPIO_SPEED_FREQ_HIGH 0x03U
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init);
+
+// Clocks
+#define __HAL_RCC_GPIOA_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_GPIOB_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_GPIOC_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_USART3_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_DMA1_CLK_ENABLE() ((void)0)
+#define __HAL_RCC_TIM1_CLK_ENABLE() ((void)0)
+
+extern uint32_t SystemCoreClock;
+
+// NVIC
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority);
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn);
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn);
+#define __disable_irq() ((void)0)
+#define __enable_irq() ((void)0)
+#define __get_PRIMASK() 0U
+#define __set_PRIMASK(primask) ((void)(primask))
+#define __DMB() __sync_synchronize()
+
+// DWT cycle counter (interrupts take no virtual time, so it stays at zero)
+typedef struct
+{
+  volatile uint32_t CTRL, CYCCNT;
+} DWT_Type;
+
+typedef struct
+{
+  volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type sim_dwt;
+extern CoreDebug_Type sim_core_debug;
+#define DWT (&sim_dwt)
+#define CoreDebug (&sim_core_debug)
+#define DWT_CTRL_CYCCNTENA_Msk 0x00000001U
+#define CoreDebug_DEMCR_TRCENA_Msk 0x01000000U
+
+// Timers (the firmware timebase is replaced by the simulator; TIM1 only
+// holds the key timer's compare setup)
+typedef struct
+{
+  volatile uint32_t CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RCR, CCR1, CCR2, CCR3, CCR4;
+} TIM_TypeDef;
+
+extern TIM_TypeDef sim_tim1;
+#define TIM1 (&sim_tim1)
+#define TIM_SR_CC1IF 0x0002U
+#define TIM_DIER_CC1IE 0x0002U
+#define TIM_EGR_CC1G 0x0002U
+
+typedef struct
+{
+  TIM_TypeDef *Instance;
+} TIM_HandleTypeDef;
+
+#define TIM_CHANNEL_1 0x00U
+#define TIM_CHANNEL_2 0x04U
+#define TIM_CHANNEL_3 0x08U
+#define TIM_CHANNEL_4 0x0CU
+
+// DMA
+typedef struct
+{
+  volatile uint32_t CCR, CNDTR, CPAR, CMAR;
+} DMA_Channel_TypeDef;
+
+typedef struct
+{
+  uint32_t Direction;
+  uint32_t PeriphInc;
+  uint32_t MemInc;
+  uint32_t PeriphDataAlignment;
+  uint32_t MemDataAlignment;
+  uint32_t Mode;
+  uint32_t Priority;
+} DMA_InitTypeDef;
+
+typedef struct __DMA_HandleTypeDef
+{
+  DMA_Channel_TypeDef *Instance;
+  DMA_InitTypeDef Init;
+  void *Parent;
+  void (*XferCpltCallback)(struct __DMA_HandleTypeDef *hdma);
+  void (*XferHalfCpltCallback)(struct __DMA_HandleTypeDef *hdma);
+} DMA_HandleTypeDef;
+
+extern DMA_Channel_TypeDef sim_dma1_channel2, sim_dma1_channel3;
+#define DMA1_Channel2 (&sim_dma1_channel2)
+#define DMA1_Channel3 (&sim_dma1_channel3)
+
+#define DMA_PERIPH_TO_MEMORY 0x00000000U
+#define DMA_MEMORY_TO_PERIPH 0x00000010U
+#define DMA_PINC_DISABLE 0x00000000U
+#define DMA_MINC_ENABLE 0x00000080U
+#define DMA_PDATAALIGN_BYTE 0x00000000U
+#define DMA_MDATAALIGN_BYTE 0x00000000U
+#define DMA_NORMAL 0x00000000U
+#define DMA_CIRCULAR 0x00000020U
+#define DMA_PRIORITY_LOW 0x00000000U
+#define DMA_PRIORITY_HIGH 0x00002000U
+#define DMA_PRIORITY_VERY_HIGH 0x00003000U
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma);
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma);
+#define __HAL_DMA_GET_COUNTER(h) ((h)->Instance->CNDTR)
+#define __HAL_LINKDMA(h, field, dma) \
+  do                                  \
+  {                                   \
+    (h)->field = &(dma);              \
+    (dma).Parent = (h);               \
+  } while (0)
+
+// UART
+typedef struct
+{
+  volatile uint32_t SR, DR, BRR, CR1, CR2, CR3, GTPR;
+} USART_TypeDef;
+
+extern USART_TypeDef sim_usart3;
+#define USART3 (&sim_usart3)
+
+typedef struct
+{
+  uint32_t BaudRate;
+  uint32_t WordLength;
+  uint32_t StopBits;
+  uint32_t Parity;
+  uint32_t Mode;
+  uint32_t HwFlowCtl;
+  uint32_t OverSampling;
+} UART_InitTypeDef;
+
+typedef struct __UART_HandleTypeDef
+{
+  USART_TypeDef *Instance;
+  UART_InitTypeDef Init;
+  DMA_HandleTypeDef *hdmatx;
+  DMA_HandleTypeDef *hdmarx;
+  volatile uint32_t ErrorCode;
+} UART_HandleTypeDef;
+
+#define UART_WORDLENGTH_8B 0x00000000U
+#define UART_STOPBITS_1 0x00000000U
+#define UART_STOPBITS_2 0x00002000U
+#define UART_PARITY_NONE 0x00000000U
+#define UART_MODE_RX 0x00000004U
+#define UART_MODE_TX 0x00000008U
+#define UART_MODE_TX_RX 0x0000000CU
+#define UART_HWCONTROL_NONE 0x00000000U
+#define UART_OVERSAMPLING_16 0x00000000U
+
+#define UART_FLAG_ORE 0x00000008U
+#define UART_FLAG_IDLE 0x00000010U
+#define UART_FLAG_RXNE 0x00000020U
+#define UART_FLAG_TC 0x00000040U
+#define UART_FLAG_TXE 0x00000080U
+
+#define UART_IT_IDLE 0x00000010U
+#define UART_IT_RXNE 0x00000020U
+#define UART_IT_TC 0x00000040U
+#define UART_IT_TXE 0x00000080U
+
+#define HAL_UART_ERROR_NONE 0x00000000U
+#define HAL_UART_ERROR_ORE 0x00000008U
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart);
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart);
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+
+// Reading SR then DR clears IDLE and ORE on the F1; the simulator does the same
+void SimUart_ClearStatus(UART_HandleTypeDef *huart, uint32_t flags);
+#define __HAL_UART_GET_FLAG(h, f) (((h)->Instance->SR & (f)) == (f))
+#define __HAL_UART_CLEAR_IDLEFLAG(h) SimUart_ClearStatus((h), UART_FLAG_IDLE)
+#define __HAL_UART_CLEAR_OREFLAG(h) SimUart_ClearStatus((h), UART_FLAG_ORE | UART_FLAG_RXNE)
+#define __HAL_UART_ENABLE_IT(h, i) ((h)->Instance->CR1 |= (i))
+#define __HAL_UART_DISABLE_IT(h, i) ((h)->Instance->CR1 &= ~(i))
+#define __HAL_UART_GET_IT_SOURCE(h, i) (((h)->Instance->CR1 & (i)) == (i))
+
+// System
+HAL_StatusTypeDef HAL_Init(void);
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+
+#endif // STM32F1XX_HAL_H
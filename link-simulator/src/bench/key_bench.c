@@ -0,0 +1,221 @@
+// Key envelope micro-benchmark
+//
+// Runs the key driver and its compare-interrupt timer on a virtual clock,
+// reports the cost of a ramp tick, then checks envelopes that earlier ramp
+// code got wrong. Host cycles are TSC ticks where available.
+//
+// Usage: pio run -e key_bench && .pio/build/key_bench/program [iterations]
+
+#include "stm32f1xx_hal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#else
+#define BENCH_HAVE_TSC 0
+#endif
+
+#include "key_driver.h"
+#include "timebase.h"
+
+// Virtual clock and the peripherals the key timer touches
+static uint32_t g_bench_now;
+uint32_t Timebase_Micros(void) { return g_bench_now; }
+TIM_TypeDef sim_tim1;
+DWT_Type sim_dwt;
+uint32_t SystemCoreClock = 72000000;
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+  (void)IRQn; (void)PreemptPriority; (void)SubPriority;
+}
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) { (void)IRQn; }
+
+// Channel outputs: the last duty written and the highest since the last reset
+static uint16_t g_bench_duty[NUM_KEYS];
+static uint16_t g_bench_peak[NUM_KEYS];
+void Channel_SetDuty(uint8_t channel, uint16_t duty)
+{
+  g_bench_duty[channel] = duty;
+  if (duty > g_bench_peak[channel])
+  {
+    g_bench_peak[channel] = duty;
+  }
+}
+void Channel_Commit(void) {}
+
+#include "../../../player-piano-driver/src/key_timer.c"
+#include "../../../player-piano-driver/src/key_driver.c"
+
+static uint64_t Bench_Ticks(void)
+{
+#if BENCH_HAVE_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Advance the virtual clock, firing the key timer interrupt on the way
+ * @return Ticks spent in the interrupt handler
+ */
+static uint64_t Bench_RunTo(uint32_t until)
+{
+  uint64_t ticks = 0;
+
+  for (; TIMEBASE_REACHED(until, g_bench_now); g_bench_now += 10)
+  {
+    if (sim_tim1.DIER & TIM_DIER_CC1IE)
+    {
+      sim_tim1.SR |= TIM_SR_CC1IF;
+      uint64_t start = Bench_Ticks();
+      TIM1_CC_IRQHandler();
+      ticks += Bench_Ticks() - start;
+    }
+  }
+  return ticks;
+}
+
+static uint32_t g_failures = 0;
+
+static void Bench_Check(const char *name, uint8_t ok)
+{
+  printf("  %-36s %s\n", name, ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+/**
+ * @brief Run a two-segment envelope whose second segment ramps down to 0
+ *
+ * The output may never rise above the strike duty on the way down, and
+ * has to end at 0.
+ */
+static void Bench_RampToZero(const char *name, uint8_t ramp, uint16_t duration_ms)
+{
+  const uint8_t key = 2;
+  KeySegment_t segments[2] = {{80, KEY_RAMP_STEP, 5}, {0, ramp, duration_ms}};
+
+  KeyDriver_PressEnvelope(&g_key_driver, key, segments, 2);
+  Bench_RunTo(g_bench_now + 4000);
+  g_bench_peak[key] = 0;
+  Bench_RunTo(g_bench_now + 1000 + (uint32_t)duration_ms * 1000 + 1000);
+
+  Bench_Check(name, g_bench_peak[key] <= PWM_PERCENT_TO_DUTY(80) && g_bench_duty[key] == 0 &&
+                        g_key_driver.keys[key].duty_q16 == 0);
+  KeyDriver_ReleaseKey(&g_key_driver, key);
+  Bench_RunTo(g_bench_now + 1000);
+}
+
+/**
+ * @brief Run a ramp down to 0 on release
+ */
+static void Bench_ReleaseToZero(const char *name, uint8_t ramp, uint16_t duration_ms)
+{
+  const uint8_t key = 3;
+
+  KeyDriver_SetRelease(&g_key_driver, key, ramp, duration_ms);
+  KeyDriver_PressKey(&g_key_driver, key, 80, 5, 0, 0, 37);
+  Bench_RunTo(g_bench_now + 10000);
+  g_bench_peak[key] = 0;
+  KeyDriver_ReleaseKey(&g_key_driver, key);
+  Bench_RunTo(g_bench_now + (uint32_t)duration_ms * 1000 + 1000);
+
+  Bench_Check(name, g_bench_peak[key] <= PWM_PERCENT_TO_DUTY(37) && g_bench_duty[key] == 0 &&
+                        g_key_driver.keys[key].state == KEY_STATE_IDLE);
+  KeyDriver_SetRelease(&g_key_driver, key, KEY_RAMP_STEP, 0);
+}
+
+/**
+ * @brief Release part way up a slow ramp, with a long linear release
+ *
+ * The release starts from an odd duty, so its per-tick step is rounded; the
+ * rounding must not carry the output below 0 before the ramp ends.
+ */
+static void Bench_ReleaseFromLowDuty(const char *name, uint16_t duration_ms)
+{
+  const uint8_t key = 4;
+  KeySegment_t swell = {1, KEY_RAMP_LINEAR, 50};
+
+  KeyDriver_SetRelease(&g_key_driver, key, KEY_RAMP_LINEAR, duration_ms);
+  KeyDriver_PressEnvelope(&g_key_driver, key, &swell, 1);
+  Bench_RunTo(g_bench_now + 1600);
+  uint16_t start_duty = g_bench_duty[key];
+  g_bench_peak[key] = 0;
+  KeyDriver_ReleaseKey(&g_key_driver, key);
+  Bench_RunTo(g_bench_now + (uint32_t)duration_ms * 1000 + 1000);
+
+  Bench_Check(name, g_bench_peak[key] <= start_duty && g_bench_duty[key] == 0 &&
+                        g_key_driver.keys[key].state == KEY_STATE_IDLE);
+  KeyDriver_SetRelease(&g_key_driver, key, KEY_RAMP_STEP, 0);
+}
+
+/**
+ * @brief Release a held key under a thermal cap below its hold duty
+ *
+ * The ramp has to start from the capped output, so it is already falling
+ * one ramp tick after the release.
+ */
+static void Bench_ReleaseFromCap(const char *name, uint16_t duration_ms)
+{
+  const uint8_t key = 5;
+  const uint16_t cap = PWM_PERCENT_TO_DUTY(20);
+
+  KeyDriver_SetRelease(&g_key_driver, key, KEY_RAMP_LINEAR, duration_ms);
+  KeyDriver_PressKey(&g_key_driver, key, 80, 5, 0, 0, 60);
+  Bench_RunTo(g_bench_now + 10000);
+  KeyDriver_SetThermalLimit(&g_key_driver, key, cap, 256);
+  g_bench_peak[key] = 0;
+  KeyDriver_ReleaseKey(&g_key_driver, key);
+  Bench_RunTo(g_bench_now + 2 * KEY_RAMP_TICK_US);
+  uint16_t falling = g_bench_duty[key];
+  Bench_RunTo(g_bench_now + (uint32_t)duration_ms * 1000 + 1000);
+
+  Bench_Check(name, g_bench_peak[key] <= cap && falling < cap && g_bench_duty[key] == 0 &&
+                        g_key_driver.keys[key].state == KEY_STATE_IDLE);
+  KeyDriver_SetThermalLimit(&g_key_driver, key, PWM_DUTY_MAX, 256);
+  KeyDriver_SetRelease(&g_key_driver, key, KEY_RAMP_STEP, 0);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t iterations = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 10000;
+  if (iterations == 0)
+  {
+    iterations = 1;
+  }
+
+  KeyDriver_Init(&g_key_driver);
+
+  // Every key ramping at once, the worst case for the compare interrupt
+  KeySegment_t swell[2] = {{30, KEY_RAMP_STEP, 1}, {90, KEY_RAMP_LINEAR, 60000}};
+  for (uint8_t key = 0; key < NUM_KEYS; key++)
+  {
+    KeyDriver_PressEnvelope(&g_key_driver, key, swell, 2);
+  }
+  Bench_RunTo(g_bench_now + 2000);
+
+  uint32_t ramp_ticks = iterations * NUM_KEYS;
+  uint64_t ticks = Bench_RunTo(g_bench_now + iterations * KEY_RAMP_TICK_US);
+  printf("Key envelopes, %lu ramp ticks on %u keys (%s)\n\n", (unsigned long)ramp_ticks, NUM_KEYS,
+         BENCH_HAVE_TSC ? "TSC cycles" : "ns");
+  printf("  Compare interrupt per ramp tick: %.1f\n\n", (double)ticks / ramp_ticks);
+  KeyDriver_ReleaseAll(&g_key_driver);
+  Bench_RunTo(g_bench_now + 1000);
+
+  printf("Checks\n");
+  Bench_RampToZero("linear ramp to 0", KEY_RAMP_LINEAR, 7);
+  Bench_RampToZero("linear ramp to 0, one tick", KEY_RAMP_LINEAR, 1);
+  Bench_RampToZero("exponential ramp to 0", KEY_RAMP_EXPONENTIAL, 13);
+  Bench_ReleaseToZero("linear release to 0", KEY_RAMP_LINEAR, 3);
+  Bench_ReleaseToZero("exponential release to 0", KEY_RAMP_EXPONENTIAL, 9);
+  Bench_ReleaseFromLowDuty("slow release from a low duty", 1000);
+  Bench_ReleaseFromCap("release from a thermal cap", 20);
+
+  printf("\n%s\n", g_failures == 0 ? "All checks passed" : "CHECKS FAILED");
+  return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,654 @@
+// Command parser micro-benchmark
+//
+// Parses a representative mix of bus traffic in a loop and reports the cost
+// per command, then checks a few frames that earlier parsers got wrong. The
+// RS485 receive path runs on a hand-driven DMA buffer for its own checks and
+// interrupt timings.
+// Host cycles are TSC ticks where available; the absolute numbers differ
+// from a Cortex-M3 but the ratios between frame kinds carry over.
+//
+// Usage: pio run -e parser_bench && .pio/build/parser_bench/program [iterations]
+
+#include "stm32f1xx_hal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#else
+#define BENCH_HAVE_TSC 0
+#endif
+
+#include "../../../player-piano-driver/src/spsc_ring.c"
+#include "../../../player-piano-driver/src/command_parser.c"
+#include "../../../player-piano-driver/src/rs485.c"
+#include "../../../player-piano-driver/src/envelope_profile.c"
+
+// Dependencies of the command parser, reduced to what parsing needs
+StepperMotor_t g_stepper_motor;
+KeyDriverModule_t g_key_driver;
+static BoardConfig_t g_bench_board_config;
+
+void StepperMotor_MoveToPedalPressed(StepperMotor_t *motor) { (void)motor; }
+void StepperMotor_MoveToPedalReleased(StepperMotor_t *motor) { (void)motor; }
+uint8_t StepperMotor_IsMoving(StepperMotor_t *motor) { (void)motor; return 0; }
+
+// Last thing done to each key and when, for the queue checks
+static uint32_t g_bench_now;
+static char g_bench_key_action[NUM_KEYS];
+static uint32_t g_bench_key_time[NUM_KEYS];
+
+static void Bench_KeyAction(uint8_t key, char action)
+{
+  if (key < NUM_KEYS)
+  {
+    g_bench_key_action[key] = action;
+    g_bench_key_time[key] = g_bench_now;
+  }
+}
+
+void KeyDriver_ReleaseAll(KeyDriverModule_t *key_driver)
+{
+  (void)key_driver;
+  for (uint8_t key = 0; key < NUM_KEYS; key++)
+  {
+    Bench_KeyAction(key, 'R');
+  }
+}
+void KeyDriver_ReleaseKey(KeyDriverModule_t *key_driver, uint8_t key) { (void)key_driver; Bench_KeyAction(key, 'R'); }
+void KeyDriver_SetRelease(KeyDriverModule_t *key_driver, uint8_t key, uint8_t ramp, uint16_t duration_ms)
+{
+  (void)key_driver; (void)key; (void)ramp; (void)duration_ms;
+}
+void KeyDriver_PressEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments,
+                             uint8_t segment_count)
+{
+  (void)key_driver; (void)segments; (void)segment_count;
+  Bench_KeyAction(key, 'P');
+}
+void KeyDriver_RestrikeEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments,
+                                uint8_t segment_count)
+{
+  (void)key_driver; (void)segments; (void)segment_count;
+  Bench_KeyAction(key, 'S');
+}
+uint8_t KeyDriver_BuildSegments(KeySegment_t *segments, uint8_t duty_cycle, uint16_t initial_strike_time,
+                                uint8_t followup_duty_cycle, uint16_t followup_time, uint8_t hold_duty_cycle)
+{
+  (void)followup_duty_cycle; (void)followup_time;
+  segments[0] = (KeySegment_t){duty_cycle, KEY_RAMP_STEP, initial_strike_time};
+  segments[1] = (KeySegment_t){(hold_duty_cycle > 0) ? hold_duty_cycle : HOLD_DUTY_CYCLE, KEY_RAMP_STEP, 0};
+  return 2;
+}
+HAL_StatusTypeDef FlashStorage_Load(uint32_t page_address, uint16_t tag, void *data, uint16_t length)
+{
+  (void)page_address; (void)tag; (void)data; (void)length;
+  return HAL_ERROR;
+}
+static uint32_t g_bench_saves;
+HAL_StatusTypeDef FlashStorage_Save(uint32_t page_address, uint16_t tag, const void *data, uint16_t length)
+{
+  (void)page_address; (void)tag; (void)data; (void)length;
+  g_bench_saves++;
+  return HAL_OK;
+}
+static KeyCalibration_t g_bench_calibration[NUM_KEYS];
+const KeyCalibration_t *KeyCalibration_Get(uint8_t key) { return &g_bench_calibration[key]; }
+uint8_t KeyCalibration_StrikeDuty(uint8_t key, uint8_t velocity) { (void)key; return 65 + (velocity * 15) / 127; }
+HAL_StatusTypeDef KeyCalibration_SetPoint(uint8_t key, uint8_t point, uint8_t duty)
+{
+  (void)key; (void)point; (void)duty;
+  return HAL_OK;
+}
+HAL_StatusTypeDef KeyCalibration_SetLimits(uint8_t key, uint8_t min_strike_duty, uint8_t hold_duty, uint16_t latency_us)
+{
+  (void)key; (void)min_strike_duty; (void)hold_duty; (void)latency_us;
+  return HAL_OK;
+}
+HAL_StatusTypeDef KeyCalibration_Save(void) { return HAL_OK; }
+void Channel_Commit(void) {}
+uint16_t ThermalModel_GetMaxTemperature(void) { return THERMAL_AMBIENT_C; }
+void ClockSync_OnBeacon(uint32_t master_time, uint32_t local_time) { (void)master_time; (void)local_time; }
+uint8_t ClockSync_IsSynced(uint32_t now) { (void)now; return 1; }
+HAL_StatusTypeDef ClockSync_MasterToLocal(uint32_t master_time, uint32_t *local_time)
+{
+  *local_time = master_time;
+  return HAL_OK;
+}
+const BoardConfig_t *BoardConfig_Get(void) { return &g_bench_board_config; }
+uint32_t Timebase_Micros(void) { return g_bench_now; }
+DWT_Type sim_dwt;
+
+// UART and DMA for the receive path; bytes are put into the DMA buffer by
+// Bench_RxByte below, the rest of the HAL does nothing
+USART_TypeDef sim_usart3;
+DMA_Channel_TypeDef sim_dma1_channel3;
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init) { (void)GPIOx; (void)GPIO_Init; }
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+  (void)IRQn; (void)PreemptPriority; (void)SubPriority;
+}
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) { (void)IRQn; }
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart) { (void)huart; return HAL_OK; }
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma) { (void)hdma; return HAL_OK; }
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma) { (void)hdma; }
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  (void)pData;
+  huart->hdmarx->Instance->CNDTR = Size;
+  return HAL_OK;
+}
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart) { (void)huart; return HAL_OK; }
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+  (void)huart; (void)pData; (void)Size;
+  HAL_UART_TxCpltCallback(&huart3);
+  return HAL_OK;
+}
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart) { (void)huart; }
+void SimUart_ClearStatus(UART_HandleTypeDef *huart, uint32_t flags) { huart->Instance->SR &= ~flags; }
+
+// Traffic as the main controller sends it: mostly compact note frames,
+// periodic keyframes and beacons, the odd pedal or credit query
+typedef struct
+{
+  const char *kind;
+  const char *text;
+  uint32_t weight; // Occurrences per round
+} BenchFrame_t;
+
+static const BenchFrame_t g_traffic[] = {
+    {"keyframe press", "P:7:85@12345678", 4},
+    {"keyframe release", "R:7:0@12395678", 4},
+    {"compact press", "7+3@850", 12},
+    {"compact release", "7:0@1250", 12},
+    {"full press, all params", "P:11:100:40:60:120:30@12345678", 2},
+    {"clock sync", "S:12345678", 2},
+    {"pedal", "P:P@12345678", 1},
+    {"credit query", "C:?", 1},
+};
+
+#define BENCH_NUM_KINDS (sizeof(g_traffic) / sizeof(g_traffic[0]))
+
+static uint64_t Bench_Ticks(void)
+{
+#if BENCH_HAVE_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static double Bench_Seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Keeps the compiler from discarding parse results
+static volatile uint32_t g_bench_sink;
+
+/**
+ * @brief Parse one frame kind repeatedly
+ * @return Ticks per parse
+ */
+static double Bench_Kind(const char *text, uint32_t iterations)
+{
+  uint16_t length = (uint16_t)strlen(text);
+  ParsedCommand_t command;
+
+  uint64_t start = Bench_Ticks();
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    g_bench_sink += CommandParser_ParseMessage(text, length, &command) + command.duty_cycle;
+  }
+  return (double)(Bench_Ticks() - start) / iterations;
+}
+
+static uint32_t g_failures = 0;
+
+static void Bench_Expect(const char *text, HAL_StatusTypeDef expected_status, CommandType_t type, uint8_t channel,
+                         uint8_t duty, uint16_t strike, uint8_t followup_duty)
+{
+  ParsedCommand_t command;
+  HAL_StatusTypeDef status = CommandParser_ParseMessage(text, (uint16_t)strlen(text), &command);
+  uint8_t ok = (status == expected_status);
+  if (ok && status == HAL_OK)
+  {
+    ok = command.type == type && command.channel == channel && command.duty_cycle == duty &&
+         command.initial_strike_time == strike && command.followup_duty_cycle == followup_duty;
+  }
+  printf("  %-28s %s\n", text, ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+/**
+ * @brief Check that a frame fed in pieces parses the same as in one go
+ */
+static void Bench_ExpectPieces(const char *text, uint16_t piece)
+{
+  ParsedCommand_t whole;
+  ParsedCommand_t split;
+  uint16_t length = (uint16_t)strlen(text);
+
+  // Compared bytewise, so padding must match too
+  memset(&whole, 0, sizeof(whole));
+  memset(&split, 0, sizeof(split));
+  HAL_StatusTypeDef whole_status = CommandParser_ParseMessage(text, length, &whole);
+
+  CommandTokenizer_t tokenizer;
+  CommandTokenizer_Reset(&tokenizer);
+  for (uint16_t i = 0; i < length; i += piece)
+  {
+    CommandTokenizer_Feed(&tokenizer, &text[i], (length - i < piece) ? length - i : piece);
+  }
+  HAL_StatusTypeDef split_status = CommandParser_ParseTokens(&tokenizer, &split);
+
+  uint8_t ok = whole_status == split_status &&
+               (whole_status != HAL_OK || memcmp(&whole, &split, sizeof(whole)) == 0);
+  printf("  %-28s in %u-byte pieces %s\n", text, piece, ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+/**
+ * @brief Store one received byte as the circular DMA would
+ */
+static void Bench_RxByte(uint8_t data)
+{
+  uint16_t remaining = (uint16_t)sim_dma1_channel3.CNDTR;
+  rx_dma_buffer[RS485_RX_DMA_BUFFER_SIZE - remaining] = data;
+  sim_dma1_channel3.CNDTR = (remaining == 1) ? RS485_RX_DMA_BUFFER_SIZE : remaining - 1U;
+
+  if (remaining - 1U == RS485_RX_DMA_BUFFER_SIZE / 2)
+  {
+    HAL_UART_RxHalfCpltCallback(&huart3);
+  }
+  else if (remaining == 1)
+  {
+    HAL_UART_RxCpltCallback(&huart3);
+  }
+}
+
+/**
+ * @brief Raise the line idle interrupt after a frame
+ */
+static void Bench_RxIdle(void)
+{
+  sim_usart3.SR |= UART_FLAG_IDLE;
+  USART3_IRQHandler();
+}
+
+/**
+ * @brief Put a numbered frame for unit 0 on the wire
+ *
+ * The number is sent twice, so a frame pieced together from two others
+ * shows up as a mismatch.
+ */
+static void Bench_RxFrame(uint32_t number, uint8_t idle)
+{
+  char text[24];
+  int length = snprintf(text, sizeof(text), "F:%04lu:%04lu\n", (unsigned long)number, (unsigned long)number);
+
+  Bench_RxByte(RS485_ADDR_UNICAST(0));
+  for (int i = 0; i < length; i++)
+  {
+    Bench_RxByte((uint8_t)text[i]);
+  }
+  if (idle)
+  {
+    Bench_RxIdle();
+  }
+}
+
+static uint32_t g_rx_frames;
+static uint32_t g_rx_last;
+static uint32_t g_rx_bad;
+
+static void Bench_RxCallback(const char *message, uint16_t length)
+{
+  unsigned long first = 0;
+  unsigned long second = 0;
+  if (length != 11 || sscanf(message, "F:%4lu:%4lu", &first, &second) != 2 || first != second ||
+      (g_rx_frames > 0 && first <= g_rx_last))
+  {
+    g_rx_bad++;
+  }
+  g_rx_last = (uint32_t)first;
+  g_rx_frames++;
+}
+
+static void Bench_RxDrain(void)
+{
+  for (uint32_t i = 0; i < 1000 && rx_event_read != rx_event_write; i++)
+  {
+    RS485_Update();
+  }
+}
+
+/**
+ * @brief Receive path checks: the DMA laps a scanner that fell behind
+ *
+ * Frames keep arriving with the main loop stalled until the DMA has wrapped
+ * round over the first ones and stopped inside a frame. The scanner has to
+ * notice from where the DMA is, not from the oldest queued event, which
+ * still looks in range.
+ */
+static void Bench_RxChecks(void)
+{
+  RS485_SetMessageCallback(Bench_RxCallback);
+  RS485_StartReceive();
+  g_rx_frames = 0;
+  g_rx_bad = 0;
+  uint32_t overflows = rx_stats.overflows;
+
+  // Runs normally first
+  uint32_t number = 0;
+  for (; number < 8; number++)
+  {
+    Bench_RxFrame(number, 1);
+  }
+  Bench_RxDrain();
+  uint8_t ok = g_rx_frames == 8 && g_rx_bad == 0 && rx_stats.overflows == overflows;
+  printf("  %-28s %s\n", "frames in order", ok ? "ok" : "FAILED");
+  g_failures += !ok;
+
+  // Stalled for a bit more than one buffer, ending halfway through a frame
+  uint32_t stalled_bytes = 0;
+  while (stalled_bytes < RS485_RX_DMA_BUFFER_SIZE)
+  {
+    Bench_RxFrame(number++, 1);
+    stalled_bytes += 13;
+  }
+  Bench_RxByte(RS485_ADDR_UNICAST(0));
+  Bench_RxByte('F');
+  Bench_RxDrain();
+
+  // Delivery picks up again with the next whole frame
+  uint32_t before = g_rx_frames;
+  Bench_RxByte(':');
+  Bench_RxIdle();
+  Bench_RxFrame(number, 1);
+  Bench_RxDrain();
+  ok = g_rx_bad == 0 && rx_stats.overflows == overflows + 1 && g_rx_frames > before && g_rx_last == number;
+  printf("  %-28s %s\n", "DMA laps the scanner", ok ? "ok" : "FAILED");
+  g_failures += !ok;
+
+  RS485_SetMessageCallback(CommandParser_RS485Callback);
+}
+
+/**
+ * @brief Time the receive interrupt and the main loop's share per frame
+ */
+static void Bench_RxTimings(uint32_t iterations)
+{
+  RS485_SetMessageCallback(Bench_RxCallback);
+  RS485_StartReceive();
+
+  uint64_t isr_ticks = 0;
+  uint64_t update_ticks = 0;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    Bench_RxFrame(i % 10000, 0);
+
+    uint64_t start = Bench_Ticks();
+    Bench_RxIdle();
+    isr_ticks += Bench_Ticks() - start;
+
+    start = Bench_Ticks();
+    RS485_Update();
+    update_ticks += Bench_Ticks() - start;
+  }
+
+  printf("  %-24s %10.1f\n", "idle line interrupt", (double)isr_ticks / iterations);
+  printf("  %-24s %10.1f\n", "scan and deliver", (double)update_ticks / iterations);
+  RS485_SetMessageCallback(CommandParser_RS485Callback);
+}
+
+/**
+ * @brief Queue a key command with a local execute-at time, as the bus callback does
+ */
+static void Bench_Queue(CommandType_t type, uint8_t channel, uint8_t is_timed, uint32_t execute_at)
+{
+  ParsedCommand_t command;
+  memset(&command, 0, sizeof(command));
+  command.type = type;
+  command.channel = channel;
+  command.duty_cycle = 80;
+  command.profile = COMMAND_NO_PROFILE;
+  command.is_timed = is_timed;
+  command.execute_at = execute_at;
+  CommandParser_Submit(&command);
+}
+
+/**
+ * @brief Run the queue at a given local time
+ */
+static void Bench_RunQueue(uint32_t now)
+{
+  g_bench_now = now;
+  CommandParser_ProcessQueue(CommandParser_GetQueue(), &g_key_driver, g_bench_now + 0x7FFFFFFFUL);
+}
+
+static void Bench_ExpectKey(const char *name, uint8_t key, char action, uint32_t time)
+{
+  uint8_t ok = g_bench_key_action[key] == action && g_bench_key_time[key] == time;
+  printf("  %-28s %s\n", name, ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+/**
+ * @brief Queue checks: commands that must not wait behind a held one
+ */
+static void Bench_QueueChecks(void)
+{
+  memset(g_bench_key_action, 0, sizeof(g_bench_key_action));
+
+  // An untimed release runs on arrival, not when the press ahead of it is due
+  Bench_Queue(COMMAND_PRESS, 1, 1, 5000);
+  Bench_Queue(COMMAND_RELEASE, 2, 0, 0);
+  Bench_RunQueue(100);
+  Bench_ExpectKey("untimed behind held", 2, 'R', 100);
+
+  // "R:A" runs on arrival too, and the press sent before it never runs
+  Bench_Queue(COMMAND_RELEASE_ALL, 0, 0, 0);
+  Bench_RunQueue(200);
+  Bench_RunQueue(6000);
+  Bench_ExpectKey("R:A behind held", 1, 'R', 200);
+
+  // Strikes brought forward by two different key latencies, through the bus
+  // callback: the slow key's press is sent second but due first
+  g_bench_calibration[3].latency_us = 0;
+  g_bench_calibration[4].latency_us = 8000;
+  CommandParser_RS485Callback("P:3:80@10000", 12);
+  CommandParser_RS485Callback("P:4:80@12000", 12);
+  Bench_RunQueue(4000);
+  Bench_ExpectKey("latency, slow key first", 4, 'P', 4000);
+  Bench_RunQueue(10000);
+  Bench_ExpectKey("latency, fast key on time", 3, 'P', 10000);
+
+  // A re-press brought forward past its own release re-strikes the key and
+  // the release never runs
+  g_bench_calibration[5].latency_us = 8000;
+  CommandParser_RS485Callback("P:5:80@20000", 12);
+  CommandParser_RS485Callback("R:5:0@30000", 11);
+  CommandParser_RS485Callback("P:5:80@32000", 12);
+  Bench_RunQueue(12000);
+  Bench_RunQueue(24000);
+  Bench_ExpectKey("latency, re-press first", 5, 'S', 24000);
+  Bench_RunQueue(30000);
+  Bench_ExpectKey("latency, release dropped", 5, 'S', 24000);
+
+  uint8_t ok = CommandQueue_IsEmpty(CommandParser_GetQueue()) && CommandParser_GetQueue()->run_ahead == 0;
+  printf("  %-28s %s\n", "queue drained", ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+/**
+ * @brief Check a profile's first and last duty cycles, or that it is unusable
+ */
+static void Bench_ExpectProfile(const char *name, uint8_t id, uint8_t strike_duty, uint8_t hold_duty)
+{
+  const EnvelopeProfile_t *profile = EnvelopeProfile_Get(id);
+  uint8_t ok = (strike_duty == 0) ? (profile == NULL)
+                                  : (profile != NULL && profile->segments[0].duty_cycle == strike_duty &&
+                                     profile->segments[profile->segment_count - 1].duty_cycle == hold_duty);
+  printf("  %-28s %s\n", name, ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+/**
+ * @brief Profile checks: a press never sees a profile that is half uploaded
+ */
+static void Bench_ProfileChecks(void)
+{
+  // Upload frames in send order, each with the profile a press sees after it
+  static const struct
+  {
+    const char *name;
+    const char *text;
+    uint8_t id;
+    uint8_t strike_duty; // 0 = no usable profile
+    uint8_t hold_duty;
+  } steps[] = {
+      {"E upload", "E:1:80:30:0:0:20", 1, 80, 20},
+      {"G re-upload, first segment", "G:1:0:90:0:40", 1, 80, 20},
+      {"G re-upload, no hold yet", "G:1:1:60:1:20", 1, 80, 20},
+      {"G re-upload, hold", "G:1:2:25:0:0", 1, 90, 25},
+      {"G partial upload", "G:2:0:90:0:40", 2, 0, 0},
+      {"G hold over limit", "G:2:1:90:0:0", 2, 0, 0},
+      {"E hold over limit", "E:3:80:30:0:0:90", 3, 0, 0},
+  };
+
+  for (uint32_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+  {
+    CommandParser_RS485Callback(steps[i].text, (uint16_t)strlen(steps[i].text));
+    Bench_ExpectProfile(steps[i].name, steps[i].id, steps[i].strike_duty, steps[i].hold_duty);
+  }
+  Bench_Expect("N:0:2", HAL_OK, COMMAND_PRESS, 0, 66, 0, 0); // Plain press at the curve's duty
+}
+
+/**
+ * @brief Save checks: the flash erase never runs while a key is playing
+ */
+static void Bench_SaveChecks(void)
+{
+  uint32_t saves = g_bench_saves;
+
+  g_key_driver.active[0] = 1;
+  CommandParser_RS485Callback("E:W", 3);
+  CommandParser_ProcessSaves(&g_key_driver);
+  uint8_t ok = g_bench_saves == saves && CommandParser_GetDeferredSaves() == 1;
+  printf("  %-28s %s\n", "save held while playing", ok ? "ok" : "FAILED");
+  g_failures += !ok;
+
+  g_key_driver.active[0] = 0;
+  CommandParser_ProcessSaves(&g_key_driver);
+  CommandParser_ProcessSaves(&g_key_driver);
+  ok = g_bench_saves == saves + 1;
+  printf("  %-28s %s\n", "save once idle", ok ? "ok" : "FAILED");
+  g_failures += !ok;
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t iterations = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 10) : 1000000;
+  if (iterations == 0)
+  {
+    iterations = 1;
+  }
+
+  CommandParser_Init(&g_key_driver);
+  EnvelopeProfile_Init();
+  RS485_SetAddressFilter(0, 0);
+  RS485_Init();
+
+  // Warm up and give compact frames a reference
+  ParsedCommand_t command;
+  for (uint32_t k = 0; k < BENCH_NUM_KINDS; k++)
+  {
+    CommandParser_ParseMessage(g_traffic[k].text, (uint16_t)strlen(g_traffic[k].text), &command);
+  }
+  CommandParser_ParseMessage("P:7:85", 6, &command);
+
+  printf("Command parser, %lu iterations per kind (%s)\n\n", (unsigned long)iterations,
+         BENCH_HAVE_TSC ? "TSC cycles" : "ns");
+  printf("  %-24s %-32s %10s\n", "kind", "frame", "per parse");
+
+  double weighted = 0.0;
+  uint32_t total_weight = 0;
+  for (uint32_t k = 0; k < BENCH_NUM_KINDS; k++)
+  {
+    // Running status must be a press for the compact kinds
+    CommandParser_ParseMessage("P:7:85", 6, &command);
+    double ticks = Bench_Kind(g_traffic[k].text, iterations);
+    printf("  %-24s %-32s %10.1f\n", g_traffic[k].kind, g_traffic[k].text, ticks);
+    weighted += ticks * g_traffic[k].weight;
+    total_weight += g_traffic[k].weight;
+  }
+
+  // Whole mix in send order, as one stream
+  uint32_t rounds = iterations / total_weight + 1;
+  uint32_t parsed = 0;
+  double start_s = Bench_Seconds();
+  uint64_t start = Bench_Ticks();
+  for (uint32_t r = 0; r < rounds; r++)
+  {
+    CommandParser_ParseMessage("P:7:85", 6, &command);
+    for (uint32_t k = 0; k < BENCH_NUM_KINDS; k++)
+    {
+      for (uint32_t w = 0; w < g_traffic[k].weight; w++)
+      {
+        const char *text = g_traffic[k].text;
+        g_bench_sink += CommandParser_ParseMessage(text, (uint16_t)strlen(text), &command);
+        parsed++;
+      }
+    }
+  }
+  double mix_ticks = (double)(Bench_Ticks() - start) / (parsed + rounds);
+  double mix_ns = (Bench_Seconds() - start_s) * 1e9 / (parsed + rounds);
+
+  printf("\n  Weighted by traffic share: %.1f per command\n", weighted / total_weight);
+  printf("  Mixed stream:              %.1f per command (%.1f ns)\n\n", mix_ticks, mix_ns);
+
+  printf("Receive path, per 13-byte frame\n");
+  Bench_RxTimings(iterations);
+  printf("\n");
+
+  printf("Checks\n");
+  CommandParser_ParseMessage("P:7:85", 6, &command);
+  Bench_Expect("P:0:100:0:80", HAL_OK, COMMAND_PRESS, 0, 100, 0, 80);
+  Bench_Expect("P:0:100:50:80:100:30", HAL_OK, COMMAND_PRESS, 0, 100, 50, 80);
+  Bench_Expect("P:11:100", HAL_OK, COMMAND_PRESS, 11, 100, 0, 0);
+  Bench_Expect("P:12:100", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("R:3:0", HAL_OK, COMMAND_RELEASE, 3, 0, 0, 0);
+  Bench_Expect("R:3:0:5", HAL_ERROR, COMMAND_RELEASE, 0, 0, 0, 0);
+  Bench_Expect("P:3:101", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("P:3:80:1:2:3:4:5", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("P:3:4294967296", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("P:3:80@", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("R:A", HAL_OK, COMMAND_RELEASE_ALL, 0, 0, 0, 0);
+  Bench_Expect("P:A", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("P:P@100", HAL_OK, COMMAND_PEDAL_PRESS, 0, 0, 0, 0);
+  CommandParser_ParseMessage("P:0:100:50:80", 13, &command);
+  Bench_Expect("0+0:", HAL_OK, COMMAND_PRESS, 0, 100, 50, 80);
+  Bench_Expect("0-100", HAL_OK, COMMAND_RELEASE, 0, 0, 50, 80);
+  CommandParser_ParseMessage("R:3:0", 5, &command); // Press keyframe after this one lost
+  Bench_Expect("0", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("0+5", HAL_ERROR, COMMAND_PRESS, 0, 0, 0, 0);
+  Bench_Expect("0:0", HAL_OK, COMMAND_RELEASE, 0, 0, 0, 0);
+  Bench_ExpectPieces("P:11:100:40:60:120:30@12345678", 1);
+  Bench_ExpectPieces("P:11:100:40:60:120:30@12345678", 7);
+  Bench_ExpectPieces("S:12345678", 3);
+  Bench_RxChecks();
+  Bench_QueueChecks();
+  Bench_ProfileChecks();
+  Bench_SaveChecks();
+
+  printf("\n%s\n", g_failures == 0 ? "All checks passed" : "CHECKS FAILED");
+  return g_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+// Driver firmware, built for the host
+//
+// The receive path (UART interrupt, address filter, command parser, clock
+// sync and queue) and the key driver are compiled unchanged. The hardware
+// behind them - PWM timers, stepper, flash and the TIM1 timebase - is
+// replaced here. The key timer's compare interrupt is taken once per main
+// loop pass, so phase changes land at loop granularity rather than to the
+// microsecond.
+
+#include "sim.h"
+
+// Pull in the driver's versions of headers both firmwares share a name with
+#include "../../player-piano-driver/include/rs485.h"
+#include "../../player-piano-driver/include/timebase.h"
+
+#include "../../player-piano-driver/src/rs485.c"
+#include "../../player-piano-driver/src/spsc_ring.c"
+#include "../../player-piano-driver/src/clock_sync.c"
+#include "../../player-piano-driver/src/key_timer.c"
+#include "../../player-piano-driver/src/key_driver.c"
+#include "../../player-piano-driver/src/scheduler.c"
+#include "../../player-piano-driver/src/envelope_profile.c"
+#include "../../player-piano-driver/src/thermal_model.c"
+#include "../../player-piano-driver/src/key_calibration.c"
+
+// Record the moment the command parser applies each key command
+static void SimDriver_TracePressEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments,
+                                        uint8_t segment_count)
+{
+  SimTrace_Applied(SIM_TRACE_PRESS, key);
+  KeyDriver_PressEnvelope(key_driver, key, segments, segment_count);
+}
+
+static void SimDriver_TraceRestrikeEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments,
+                                           uint8_t segment_count)
+{
+  SimTrace_Applied(SIM_TRACE_PRESS, key);
+  KeyDriver_RestrikeEnvelope(key_driver, key, segments, segment_count);
+}
+
+static void SimDriver_TraceReleaseKey(KeyDriverModule_t *key_driver, uint8_t key)
+{
+  SimTrace_Applied(SIM_TRACE_RELEASE, key);
+  KeyDriver_ReleaseKey(key_driver, key);
+}
+
+#define KeyDriver_PressEnvelope SimDriver_TracePressEnvelope
+#define KeyDriver_RestrikeEnvelope SimDriver_TraceRestrikeEnvelope
+#define KeyDriver_ReleaseKey SimDriver_TraceReleaseKey
+#include "../../player-piano-driver/src/command_parser.c"
+#undef KeyDriver_PressEnvelope
+#undef KeyDriver_RestrikeEnvelope
+#undef KeyDriver_ReleaseKey
+
+// Stepper motor: pedal commands are traced, the motor itself is not modelled
+StepperMotor_t g_stepper_motor;
+
+void StepperMotor_MoveToPedalPressed(StepperMotor_t *motor)
+{
+  (void)motor;
+  SimTrace_Applied(SIM_TRACE_PEDAL_PRESS, 0);
+}
+
+void StepperMotor_MoveToPedalReleased(StepperMotor_t *motor)
+{
+  (void)motor;
+  SimTrace_Applied(SIM_TRACE_PEDAL_RELEASE, 0);
+}
+
+uint8_t StepperMotor_IsMoving(StepperMotor_t *motor)
+{
+  (void)motor;
+  return 0;
+}
+
+// Output channels: only the number of staged writes and commits is kept
+static uint32_t g_channel_writes;
+static uint32_t g_channel_commits;
+static uint32_t g_channel_committed_writes;
+
+void Channel_SetDuty(uint8_t key, uint16_t duty)
+{
+  (void)key;
+  (void)duty;
+  g_channel_writes++;
+}
+
+// Like the firmware, a commit with nothing staged does nothing
+void Channel_Commit(void)
+{
+  if (g_channel_writes != g_channel_committed_writes)
+  {
+    g_channel_committed_writes = g_channel_writes;
+    g_channel_commits++;
+  }
+}
+
+// Flash: nothing is stored between runs, uploads stay in RAM
+HAL_StatusTypeDef FlashStorage_Load(uint32_t page_address, uint16_t tag, void *data, uint16_t length)
+{
+  (void)page_address;
+  (void)tag;
+  (void)data;
+  (void)length;
+  return HAL_ERROR;
+}
+
+HAL_StatusTypeDef FlashStorage_Save(uint32_t page_address, uint16_t tag, const void *data, uint16_t length)
+{
+  (void)page_address;
+  (void)tag;
+  (void)data;
+  (void)length;
+  return HAL_OK;
+}
+
+// Board configuration as BoardConfig_Init would load it from flash
+static BoardConfig_t g_sim_board_config = {
+    .unit_address = 0,
+    .group_mask = RS485_GROUP_BIT(RS485_GROUP_PEDAL),
+};
+
+const BoardConfig_t *BoardConfig_Get(void)
+{
+  return &g_sim_board_config;
+}
+
+// Timebase on the simulator's driver clock (offset and drift applied)
+void Timebase_Init(void)
+{
+}
+
+uint32_t Timebase_Micros(void)
+{
+  return Sim_DriverMicros();
+}
+
+// TIM1 registers, for the key timer's compare channel
+TIM_TypeDef sim_tim1;
+
+// Main loop stages, as in main.c; the stepper stage is not modelled
+#define MAIN_BUS_BUDGET_US 20
+#define MAIN_COMMAND_BUDGET_US 20
+#define MAIN_THERMAL_BUDGET_US 20
+
+static SchedulerResult_t Main_BusStage(uint32_t deadline)
+{
+  (void)deadline;
+  RS485_Update();
+  return SCHEDULER_DONE;
+}
+
+static SchedulerResult_t Main_CommandStage(uint32_t deadline)
+{
+  uint8_t more = CommandParser_ProcessQueue(CommandParser_GetQueue(), &g_key_driver, deadline);
+  return more ? SCHEDULER_MORE : SCHEDULER_DONE;
+}
+
+static SchedulerResult_t Main_ThermalStage(uint32_t deadline)
+{
+  (void)deadline;
+  ThermalModel_Sample();
+  Channel_Commit();
+  return SCHEDULER_DONE;
+}
+
+/**
+ * @brief Start the driver as main.c does
+ */
+void SimDriver_Init(void)
+{
+  ClockSync_Init();
+  EnvelopeProfile_Init();
+  KeyCalibration_Init();
+  RS485_SetAddressFilter(BoardConfig_Get()->unit_address, BoardConfig_Get()->group_mask);
+  RS485_Init();
+  KeyDriver_Init(&g_key_driver);
+  ThermalModel_Init(&g_key_driver);
+  CommandParser_Init(&g_key_driver);
+
+  Scheduler_Init(NULL);
+  Scheduler_AddStage(Main_BusStage, 0, MAIN_BUS_BUDGET_US);
+  Scheduler_AddStage(Main_CommandStage, 0, MAIN_COMMAND_BUDGET_US);
+  Scheduler_AddStage(Main_ThermalStage, THERMAL_SAMPLE_US, MAIN_THERMAL_BUDGET_US);
+}
+
+/**
+ * @brief One pass of the driver's main loop
+ */
+void SimDriver_Poll(void)
+{
+  // The handler itself only acts on deadlines already reached
+  if (sim_tim1.DIER & TIM_DIER_CC1IE)
+  {
+    sim_tim1.SR |= TIM_SR_CC1IF;
+    TIM1_CC_IRQHandler();
+  }
+
+  Scheduler_RunPass();
+}
+
+/**
+ * @brief Print the driver's own counters
+ * @param out: Output stream
+ */
+void SimDriver_Report(FILE *out)
+{
+  const ClockSync_t *sync = ClockSync_Get();
+
+  const RS485_RxStats_t *rx = RS485_GetRxStats();
+
+  fprintf(out, "  frames %lu, overruns %lu, DMA overflows %lu, DMA restarts %lu, event overflows %lu\n",
+          (unsigned long)rx->frames, (unsigned long)rx->overruns, (unsigned long)rx->overflows,
+          (unsigned long)rx->restarts, (unsigned long)rx->event_overflows);
+  fprintf(out, "  coalesced %lu key / %lu pedal, channel writes %lu, commits %lu\n",
+          (unsigned long)CommandParser_GetQueue()->coalesced,
+          (unsigned long)CommandParser_GetPedalQueue()->coalesced, (unsigned long)g_channel_writes,
+          (unsigned long)g_channel_commits);
+  fprintf(out, "  queue drops %lu, clock sync: beacons %lu, resyncs %lu, last error %ld us, drift %.1f ppm\n",
+          (unsigned long)(CommandParser_GetQueue()->dropped + CommandParser_GetPedalQueue()->dropped),
+          (unsigned long)sync->beacons,
+          (unsigned long)sync->resyncs, (long)sync->last_error,
+          (double)sync->drift * 1e6 / (double)(1UL << CLOCK_SYNC_DRIFT_SHIFT));
+
+  const KeyTimerStats_t *keys = KeyTimer_GetStats();
+  fprintf(out, "  key phase changes %lu, latest %lu us after its deadline\n", (unsigned long)keys->fired,
+          (unsigned long)keys->max_late_us);
+  fprintf(out, "  strikes staggered by the power budget %lu, longest %lu us\n",
+          (unsigned long)g_key_driver.staggered_strikes, (unsigned long)g_key_driver.max_stagger_us);
+}
@@ -0,0 +1,715 @@
+#include "sim.h"
+#include <string.h>
+
+// Byte queue on the wire, in order of completion
+#define SIM_WIRE_QUEUE_SIZE 1024
+
+typedef struct
+{
+  uint8_t data;
+  uint64_t done_ns; // Time at which the stop bit ends
+} SimByte_t;
+
+typedef struct
+{
+  SimByte_t bytes[SIM_WIRE_QUEUE_SIZE];
+  uint16_t head;
+  uint16_t tail;
+} SimByteQueue_t;
+
+// Receive and transmit state of the driver's UART
+typedef struct
+{
+  uint8_t *it_buffer; // HAL_UART_Receive_IT destination
+  uint16_t it_remaining;
+  uint8_t *dma_buffer; // HAL_UART_Receive_DMA destination
+  uint16_t dma_size;
+  uint8_t dma_active;
+  uint8_t dma_flags;   // Pending DMA half/full transfer events
+  uint64_t idle_at_ns; // Time the line goes idle after the last byte, 0 if not pending
+  uint64_t tx_done_ns; // End of the interrupt-driven transmission, 0 if none
+  uint8_t tx_complete; // Transmission finished, TxCplt not yet delivered
+} SimDriverUart_t;
+
+#define SIM_DMA_FLAG_HT 0x01
+#define SIM_DMA_FLAG_TC 0x02
+
+// Peripheral register blocks
+GPIO_TypeDef sim_gpioa, sim_gpiob, sim_gpioc;
+USART_TypeDef sim_usart3;        // Driver UART
+USART_TypeDef sim_master_usart3; // Main controller UART
+DMA_Channel_TypeDef sim_dma1_channel2, sim_dma1_channel3;
+DWT_Type sim_dwt;
+CoreDebug_Type sim_core_debug;
+uint32_t SystemCoreClock = 8000000;
+
+SimConfig_t g_sim_config = {
+    .tx_gap_ns = 0,
+    .isr_latency_ns = 0,
+    .loop_period_ns = 10000,
+    .driver_drift_ppm = 0,
+    .driver_offset_us = 0,
+};
+
+// Simulation state
+static uint64_t now_ns = 0;
+static uint64_t next_loop_ns = 0;
+static SimByteQueue_t to_driver;
+static SimByteQueue_t to_master;
+static uint64_t bus_free_ns = 0;
+static uint8_t bus_owner_is_master = 1;
+static uint32_t wire_bits_per_byte = 10;
+static uint32_t wire_baudrate = 9600;
+static uint64_t last_master_frame_start = 0;
+static uint64_t last_master_frame_end = 0;
+static uint16_t last_master_frame_bytes = 0;
+static SimDriverUart_t driver_uart;
+static SimWireStats_t wire_stats;
+
+/**
+ * @brief Reset virtual time, the wire and both UARTs
+ */
+void Sim_Init(void)
+{
+  now_ns = 0;
+  next_loop_ns = 0;
+  memset(&to_driver, 0, sizeof(to_driver));
+  memset(&to_master, 0, sizeof(to_master));
+  bus_free_ns = 0;
+  memset(&driver_uart, 0, sizeof(driver_uart));
+  memset(&wire_stats, 0, sizeof(wire_stats));
+  memset(&sim_usart3, 0, sizeof(sim_usart3));
+  memset(&sim_master_usart3, 0, sizeof(sim_master_usart3));
+  memset(&sim_dma1_channel3, 0, sizeof(sim_dma1_channel3));
+}
+
+/**
+ * @brief Get the current virtual time
+ * @return Time since the start of the simulation in ns
+ */
+uint64_t Sim_Now(void)
+{
+  return now_ns;
+}
+
+/**
+ * @brief Get the main controller's microsecond clock (the reference clock)
+ * @return Master time in us
+ */
+uint32_t Sim_MasterMicros(void)
+{
+  return (uint32_t)(now_ns / 1000);
+}
+
+/**
+ * @brief Get the main controller's millisecond tick
+ * @return Master tick in ms
+ */
+uint32_t Sim_MasterTick(void)
+{
+  return (uint32_t)(now_ns / 1000000);
+}
+
+/**
+ * @brief Get the driver's microsecond clock, including offset and drift
+ * @return Driver local time in us
+ */
+uint32_t Sim_DriverMicros(void)
+{
+  double local_us = (double)now_ns / 1000.0 * (1.0 + g_sim_config.driver_drift_ppm * 1e-6);
+  return (uint32_t)((uint64_t)local_us + g_sim_config.driver_offset_us);
+}
+
+/**
+ * @brief Get the baud rate the firmware configured the UART with
+ * @return Baud rate
+ */
+uint32_t Sim_BaudRate(void)
+{
+  return wire_baudrate;
+}
+
+/**
+ * @brief Get the number of bits one character takes (start, data and stop bits)
+ * @return Bits per character
+ */
+uint32_t Sim_BitsPerByte(void)
+{
+  return wire_bits_per_byte;
+}
+
+/**
+ * @brief Get the time one character takes on the wire (start, data and stop bits)
+ * @return Byte time in ns
+ */
+uint64_t Sim_ByteTimeNs(void)
+{
+  return ((uint64_t)wire_bits_per_byte * 1000000000ULL) / wire_baudrate;
+}
+
+/**
+ * @brief Get timing of the last frame the main controller put on the wire
+ */
+void Sim_GetLastMasterFrame(uint64_t *start_ns, uint64_t *end_ns, uint16_t *bytes)
+{
+  *start_ns = last_master_frame_start;
+  *end_ns = last_master_frame_end;
+  *bytes = last_master_frame_bytes;
+}
+
+/**
+ * @brief Get wire statistics
+ * @return Pointer to wire statistics
+ */
+const SimWireStats_t *Sim_GetWireStats(void)
+{
+  return &wire_stats;
+}
+
+// Queue helpers
+static uint8_t SimQueue_IsEmpty(const SimByteQueue_t *queue)
+{
+  return queue->head == queue->tail;
+}
+
+static void SimQueue_Push(SimByteQueue_t *queue, uint8_t data, uint64_t done_ns)
+{
+  uint16_t next = (queue->tail + 1) % SIM_WIRE_QUEUE_SIZE;
+  if (next == queue->head)
+  {
+    return; // Only reachable if one side transmits far ahead of virtual time
+  }
+  queue->bytes[queue->tail].data = data;
+  queue->bytes[queue->tail].done_ns = done_ns;
+  queue->tail = next;
+}
+
+/**
+ * @brief Put bytes on the wire, back to back after anything already sending
+ * @param from_master: 1 if the main controller transmits, 0 for the driver
+ * @param data: Bytes to send
+ * @param size: Number of bytes
+ * @param gap_ns: Idle time between consecutive bytes
+ * @return Time at which the last stop bit ends
+ */
+static uint64_t SimWire_Send(uint8_t from_master, const uint8_t *data, uint16_t size, uint32_t gap_ns)
+{
+  uint64_t start = now_ns;
+  if (bus_free_ns > start)
+  {
+    if (bus_owner_is_master != from_master)
+    {
+      wire_stats.collisions++;
+    }
+    start = bus_free_ns;
+  }
+
+  uint64_t byte_ns = Sim_ByteTimeNs();
+  uint64_t done = start;
+  for (uint16_t i = 0; i < size; i++)
+  {
+    done += byte_ns;
+    SimQueue_Push(from_master ? &to_driver : &to_master, data[i], done);
+    if (i + 1 < size)
+    {
+      done += gap_ns;
+    }
+  }
+
+  wire_stats.busy_ns += (uint64_t)size * byte_ns;
+  bus_free_ns = done;
+  bus_owner_is_master = from_master;
+
+  if (from_master)
+  {
+    wire_stats.frames_to_driver++;
+    wire_stats.bytes_to_driver += size;
+    last_master_frame_start = start;
+    last_master_frame_end = done;
+    last_master_frame_bytes = size;
+  }
+  else
+  {
+    wire_stats.frames_to_master++;
+    wire_stats.bytes_to_master += size;
+  }
+
+  return done;
+}
+
+/**
+ * @brief Deliver a byte to the driver's UART, by DMA or as a receive interrupt
+ * @param data: Received byte
+ * @param done_ns: Time at which its stop bit ended
+ */
+static void SimDriver_ReceiveByte(uint8_t data, uint64_t done_ns)
+{
+  uint64_t byte_ns = Sim_ByteTimeNs();
+
+  if (driver_uart.dma_active)
+  {
+    // DMA moves the byte straight from DR to memory, no CPU involved
+    uint16_t remaining = (uint16_t)sim_dma1_channel3.CNDTR;
+    driver_uart.dma_buffer[driver_uart.dma_size - remaining] = data;
+    remaining--;
+
+    if (remaining == driver_uart.dma_size / 2)
+    {
+      driver_uart.dma_flags |= SIM_DMA_FLAG_HT;
+    }
+    if (remaining == 0)
+    {
+      driver_uart.dma_flags |= SIM_DMA_FLAG_TC;
+      if (huart3.hdmarx != NULL && huart3.hdmarx->Init.Mode == DMA_CIRCULAR)
+      {
+        remaining = driver_uart.dma_size;
+      }
+      else
+      {
+        driver_uart.dma_active = 0;
+      }
+    }
+    sim_dma1_channel3.CNDTR = remaining;
+
+    if (driver_uart.dma_flags != 0)
+    {
+      DMA1_Channel3_IRQHandler();
+    }
+  }
+  else
+  {
+    if (sim_usart3.SR & UART_FLAG_RXNE)
+    {
+      // Previous byte not read yet - this one is lost
+      sim_usart3.SR |= UART_FLAG_ORE;
+      wire_stats.driver_overruns++;
+    }
+    else
+    {
+      sim_usart3.DR = data;
+      sim_usart3.SR |= UART_FLAG_RXNE;
+    }
+
+    if (sim_usart3.CR1 & UART_IT_RXNE)
+    {
+      USART3_IRQHandler();
+    }
+  }
+
+  // The line counts as idle once a whole character time passes without a start bit
+  driver_uart.idle_at_ns = done_ns + byte_ns;
+}
+
+/**
+ * @brief Deliver a byte to the main controller's receive register
+ */
+static void SimMaster_ReceiveByte(uint8_t data)
+{
+  if (sim_master_usart3.SR & UART_FLAG_RXNE)
+  {
+    sim_master_usart3.SR |= UART_FLAG_ORE;
+    wire_stats.master_overruns++;
+    return;
+  }
+
+  sim_master_usart3.DR = data;
+  sim_master_usart3.SR |= UART_FLAG_RXNE;
+}
+
+/**
+ * @brief Time at which the next byte reaches the driver's software or DMA
+ */
+static uint64_t SimDriver_NextByteTime(void)
+{
+  uint64_t done = to_driver.bytes[to_driver.head].done_ns;
+  return driver_uart.dma_active ? done : done + g_sim_config.isr_latency_ns;
+}
+
+/**
+ * @brief Run both boards up to a point in virtual time
+ *
+ * Interrupts fire at their exact times; the driver main loop runs once per
+ * loop period in between.
+ * @param time_ns: Virtual time to advance to
+ */
+void Sim_AdvanceTo(uint64_t time_ns)
+{
+  while (1)
+  {
+    uint64_t next = next_loop_ns;
+    int event = 0; // 0 = main loop, 1 = byte to driver, 2 = byte to master, 3 = idle line, 4 = driver TX done
+
+    if (!SimQueue_IsEmpty(&to_driver) && SimDriver_NextByteTime() < next)
+    {
+      next = SimDriver_NextByteTime();
+      event = 1;
+    }
+    if (!SimQueue_IsEmpty(&to_master) && to_master.bytes[to_master.head].done_ns < next)
+    {
+      next = to_master.bytes[to_master.head].done_ns;
+      event = 2;
+    }
+    if (driver_uart.idle_at_ns != 0 && driver_uart.idle_at_ns < next)
+    {
+      next = driver_uart.idle_at_ns;
+      event = 3;
+    }
+    if (driver_uart.tx_done_ns != 0 && driver_uart.tx_done_ns < next)
+    {
+      next = driver_uart.tx_done_ns;
+      event = 4;
+    }
+
+    if (next > time_ns)
+    {
+      break;
+    }
+
+    if (next > now_ns)
+    {
+      now_ns = next;
+    }
+
+    switch (event)
+    {
+    case 1:
+    {
+      SimByte_t byte = to_driver.bytes[to_driver.head];
+      to_driver.head = (to_driver.head + 1) % SIM_WIRE_QUEUE_SIZE;
+      SimDriver_ReceiveByte(byte.data, byte.done_ns);
+      break;
+    }
+    case 2:
+    {
+      uint8_t data = to_master.bytes[to_master.head].data;
+      to_master.head = (to_master.head + 1) % SIM_WIRE_QUEUE_SIZE;
+      SimMaster_ReceiveByte(data);
+      break;
+    }
+    case 3:
+      driver_uart.idle_at_ns = 0;
+      sim_usart3.SR |= UART_FLAG_IDLE;
+      if (sim_usart3.CR1 & UART_IT_IDLE)
+      {
+        USART3_IRQHandler();
+      }
+      break;
+    case 4:
+      driver_uart.tx_done_ns = 0;
+      driver_uart.tx_complete = 1;
+      sim_usart3.SR |= UART_FLAG_TC;
+      USART3_IRQHandler();
+      break;
+    default:
+      SimDriver_Poll();
+      next_loop_ns += g_sim_config.loop_period_ns;
+      break;
+    }
+  }
+
+  if (time_ns > now_ns)
+  {
+    now_ns = time_ns;
+  }
+}
+
+// ============================================================================
+// HAL
+// ============================================================================
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+  return HAL_OK;
+}
+
+// Driver side tick; the main controller's is renamed to Sim_MasterTick
+uint32_t HAL_GetTick(void)
+{
+  return Sim_DriverMicros() / 1000;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+  Sim_AdvanceTo(now_ns + (uint64_t)Delay * 1000000ULL);
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+  (void)GPIOx;
+  (void)GPIO_Init;
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+  (void)IRQn;
+  (void)PreemptPriority;
+  (void)SubPriority;
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+  (void)IRQn;
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+  (void)IRQn;
+}
+
+/**
+ * @brief Take the wire format from the firmware's own UART configuration
+ */
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+  if (huart == NULL || huart->Init.BaudRate == 0)
+  {
+    return HAL_ERROR;
+  }
+
+  wire_baudrate = huart->Init.BaudRate;
+  wire_bits_per_byte = 1 + 8 + ((huart->Init.StopBits == UART_STOPBITS_2) ? 2 : 1);
+  huart->Instance->SR = UART_FLAG_TC | UART_FLAG_TXE;
+  return HAL_OK;
+}
+
+/**
+ * @brief Blocking transmit: the CPU feeds every byte and waits for the last one
+ */
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+  (void)Timeout;
+  if (huart == NULL || pData == NULL || Size == 0)
+  {
+    return HAL_ERROR;
+  }
+
+  uint8_t from_master = (huart->Instance == &sim_master_usart3);
+  uint64_t done = SimWire_Send(from_master, pData, Size, g_sim_config.tx_gap_ns);
+
+  // Returns once the last byte has left the data register; TC follows with its stop bit
+  Sim_AdvanceTo(done);
+  huart->Instance->SR |= UART_FLAG_TC | UART_FLAG_TXE;
+  return HAL_OK;
+}
+
+/**
+ * @brief Blocking receive (used by the main controller for replies)
+ */
+HAL_StatusTypeDef HAL_UART_Receive(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+  if (huart == NULL || pData == NULL || Size == 0)
+  {
+    return HAL_ERROR;
+  }
+
+  uint64_t deadline = now_ns + (uint64_t)Timeout * 1000000ULL;
+  SimByteQueue_t *queue = (huart->Instance == &sim_master_usart3) ? &to_master : &to_driver;
+
+  for (uint16_t i = 0; i < Size; i++)
+  {
+    while (!(huart->Instance->SR & UART_FLAG_RXNE))
+    {
+      if (now_ns >= deadline)
+      {
+        return HAL_TIMEOUT;
+      }
+
+      if (!SimQueue_IsEmpty(queue) && queue->bytes[queue->head].done_ns <= deadline)
+      {
+        Sim_AdvanceTo(queue->bytes[queue->head].done_ns);
+      }
+      else
+      {
+        // Nothing on the wire yet; poll in short steps so a reply the other
+        // side starts meanwhile is picked up byte by byte, as RXNE polling does
+        uint64_t step = Sim_ByteTimeNs() / 2;
+        Sim_AdvanceTo((deadline - now_ns < step) ? deadline : now_ns + step);
+      }
+    }
+
+    pData[i] = (uint8_t)huart->Instance->DR;
+    huart->Instance->SR &= ~UART_FLAG_RXNE;
+  }
+
+  return HAL_OK;
+}
+
+/**
+ * @brief Interrupt-driven transmit (used by the driver for replies)
+ */
+HAL_StatusTypeDef HAL_UART_Transmit_IT(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+  if (huart == NULL || pData == NULL || Size == 0)
+  {
+    return HAL_ERROR;
+  }
+
+  if (driver_uart.tx_done_ns != 0 || driver_uart.tx_complete)
+  {
+    return HAL_BUSY;
+  }
+
+  huart->Instance->SR &= ~UART_FLAG_TC;
+  huart->Instance->CR1 |= UART_IT_TC;
+  driver_uart.tx_done_ns = SimWire_Send(huart->Instance == &sim_master_usart3, pData, Size, g_sim_config.tx_gap_ns);
+  return HAL_OK;
+}
+
+/**
+ * @brief Interrupt-driven receive of a fixed number of bytes
+ */
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  if (huart == NULL || pData == NULL || Size == 0)
+  {
+    return HAL_ERROR;
+  }
+
+  if (driver_uart.it_remaining != 0)
+  {
+    return HAL_BUSY;
+  }
+
+  driver_uart.it_buffer = pData;
+  driver_uart.it_remaining = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->Instance->CR1 |= UART_IT_RXNE;
+  return HAL_OK;
+}
+
+// DMA transfer callbacks wired up by HAL_UART_Receive_DMA, as in the HAL
+static void SimUart_DmaRxHalfCplt(DMA_HandleTypeDef *hdma)
+{
+  HAL_UART_RxHalfCpltCallback((UART_HandleTypeDef *)hdma->Parent);
+}
+
+static void SimUart_DmaRxCplt(DMA_HandleTypeDef *hdma)
+{
+  HAL_UART_RxCpltCallback((UART_HandleTypeDef *)hdma->Parent);
+}
+
+/**
+ * @brief DMA receive into a buffer (circular if the DMA handle says so)
+ */
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  if (huart == NULL || pData == NULL || Size == 0 || huart->hdmarx == NULL)
+  {
+    return HAL_ERROR;
+  }
+
+  driver_uart.dma_buffer = pData;
+  driver_uart.dma_size = Size;
+  driver_uart.dma_active = 1;
+  driver_uart.dma_flags = 0;
+  huart->hdmarx->XferHalfCpltCallback = SimUart_DmaRxHalfCplt;
+  huart->hdmarx->XferCpltCallback = SimUart_DmaRxCplt;
+  huart->hdmarx->Instance->CNDTR = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef *huart)
+{
+  (void)huart;
+  driver_uart.dma_active = 0;
+  driver_uart.dma_flags = 0;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+  return (hdma == NULL) ? HAL_ERROR : HAL_OK;
+}
+
+/**
+ * @brief Deliver pending DMA half/full transfer events to their callbacks
+ */
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+  if (hdma == NULL)
+  {
+    return;
+  }
+
+  if ((driver_uart.dma_flags & SIM_DMA_FLAG_HT) && hdma->XferHalfCpltCallback != NULL)
+  {
+    driver_uart.dma_flags &= ~SIM_DMA_FLAG_HT;
+    hdma->XferHalfCpltCallback(hdma);
+  }
+  if ((driver_uart.dma_flags & SIM_DMA_FLAG_TC) && hdma->XferCpltCallback != NULL)
+  {
+    driver_uart.dma_flags &= ~SIM_DMA_FLAG_TC;
+    hdma->XferCpltCallback(hdma);
+  }
+  driver_uart.dma_flags = 0;
+}
+
+/**
+ * @brief UART interrupt service, following the F1 HAL's handling of RXNE, ORE and TC
+ */
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+  USART_TypeDef *uart = huart->Instance;
+
+  if ((uart->SR & UART_FLAG_ORE) && (uart->CR1 & UART_IT_RXNE))
+  {
+    // The HAL treats overrun as a blocking error and ends the reception
+    huart->ErrorCode |= HAL_UART_ERROR_ORE;
+    uart->SR &= ~(UART_FLAG_ORE | UART_FLAG_RXNE);
+    uart->CR1 &= ~UART_IT_RXNE;
+    driver_uart.it_remaining = 0;
+    HAL_UART_ErrorCallback(huart);
+  }
+  else if ((uart->SR & UART_FLAG_RXNE) && (uart->CR1 & UART_IT_RXNE) && driver_uart.it_remaining != 0)
+  {
+    *driver_uart.it_buffer++ = (uint8_t)uart->DR;
+    uart->SR &= ~UART_FLAG_RXNE;
+    if (--driver_uart.it_remaining == 0)
+    {
+      uart->CR1 &= ~UART_IT_RXNE;
+      HAL_UART_RxCpltCallback(huart);
+    }
+  }
+
+  if (driver_uart.tx_complete && (uart->CR1 & UART_IT_TC))
+  {
+    driver_uart.tx_complete = 0;
+    uart->CR1 &= ~UART_IT_TC;
+    HAL_UART_TxCpltCallback(huart);
+  }
+}
+
+/**
+ * @brief Clear status flags the way the SR-then-DR read sequence does
+ */
+void SimUart_ClearStatus(UART_HandleTypeDef *huart, uint32_t flags)
+{
+  huart->Instance->SR &= ~flags;
+}
+
+// Weak defaults, as in the HAL and the startup file
+__attribute__((weak)) void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  (void)huart;
+}
+
+__attribute__((weak)) void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  (void)huart;
+}
+
+__attribute__((weak)) void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  (void)huart;
+}
+
+__attribute__((weak)) void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  (void)huart;
+}
+
+__attribute__((weak)) void DMA1_Channel3_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(huart3.hdmarx);
+}
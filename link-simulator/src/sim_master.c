@@ -0,0 +1,143 @@
+// Main controller firmware, built for the host
+//
+// The firmware sources are compiled unchanged. Names that also exist in the
+// driver firmware are renamed here, the UART gets its own register block and
+// the timebase runs on the simulator's master clock.
+
+#include "sim.h"
+
+#define huart3 sim_master_huart3
+#define RS485_Init SimMaster_RS485_Init
+#define RS485_UART_Init SimMaster_RS485_UART_Init
+#define RS485_SendString SimMaster_RS485_SendString
+#define RS485_SendFrame SimMaster_RS485_SendFrame
+#define RS485_ReceiveFrame SimMaster_RS485_ReceiveFrame
+#define Timebase_Init SimMaster_Timebase_Init
+#define Timebase_Micros SimMaster_Timebase_Micros
+#define HAL_GetTick Sim_MasterTick
+
+#undef USART3
+#define USART3 (&sim_master_usart3)
+
+// Pull in the main controller's versions of headers both firmwares share a name with
+#include "../../STM32-main-controller/include/rs485.h"
+#include "../../STM32-main-controller/include/timebase.h"
+
+#include "../../STM32-main-controller/src/rs485.c"
+#include "../../STM32-main-controller/src/bus_dispatch.c"
+#include "../../STM32-main-controller/src/midi_parser.c"
+
+// Record every key and pedal command that playback gets onto the wire
+static HAL_StatusTypeDef SimMaster_TraceNoteOn(uint8_t note, uint8_t velocity, uint32_t execute_at)
+{
+  HAL_StatusTypeDef status = BusDispatch_NoteOn(note, velocity, execute_at);
+  uint8_t unit;
+  uint8_t channel;
+  if (status == HAL_OK && BusDispatch_MapNote(note, &unit, &channel) == HAL_OK)
+  {
+    SimTrace_Sent(SIM_TRACE_PRESS, note, channel, execute_at);
+  }
+  return status;
+}
+
+static HAL_StatusTypeDef SimMaster_TraceNoteOff(uint8_t note, uint32_t execute_at)
+{
+  HAL_StatusTypeDef status = BusDispatch_NoteOff(note, execute_at);
+  uint8_t unit;
+  uint8_t channel;
+  if (status == HAL_OK && BusDispatch_MapNote(note, &unit, &channel) == HAL_OK)
+  {
+    SimTrace_Sent(SIM_TRACE_RELEASE, note, channel, execute_at);
+  }
+  return status;
+}
+
+static HAL_StatusTypeDef SimMaster_TracePedal(bool pressed, uint32_t execute_at)
+{
+  HAL_StatusTypeDef status = BusDispatch_Pedal(pressed, execute_at);
+  if (status == HAL_OK)
+  {
+    SimTrace_Sent(pressed ? SIM_TRACE_PEDAL_PRESS : SIM_TRACE_PEDAL_RELEASE, 0, 0, execute_at);
+  }
+  return status;
+}
+
+#define BusDispatch_NoteOn SimMaster_TraceNoteOn
+#define BusDispatch_NoteOff SimMaster_TraceNoteOff
+#define BusDispatch_Pedal SimMaster_TracePedal
+#include "../../STM32-main-controller/src/playback.c"
+#undef BusDispatch_NoteOn
+#undef BusDispatch_NoteOff
+#undef BusDispatch_Pedal
+
+// Timebase on the simulator's master clock
+void Timebase_Init(void)
+{
+}
+
+uint32_t Timebase_Micros(void)
+{
+  return Sim_MasterMicros();
+}
+
+/**
+ * @brief Start the main controller as main.c does and load the song
+ * @param midi_data: MIDI file contents, or NULL for the embedded song
+ * @param midi_size: Size of MIDI file contents
+ * @return HAL status
+ */
+HAL_StatusTypeDef SimMaster_Init(const uint8_t *midi_data, uint32_t midi_size)
+{
+  RS485_Init();
+  BusDispatch_Init();
+
+  MidiParser_t *parser = MidiParser_GetInstance();
+  MidiParser_Init(parser);
+
+  HAL_StatusTypeDef status = (midi_data != NULL) ? MidiParser_LoadData(parser, midi_data, midi_size)
+                                                 : MidiParser_LoadEmbeddedData(parser);
+  if (status != HAL_OK)
+  {
+    return status;
+  }
+
+  MidiParser_ResetToBeginning(parser);
+  Playback_Init(parser);
+  return HAL_OK;
+}
+
+/**
+ * @brief One pass of the main controller's main loop, including its 1 ms delay
+ */
+void SimMaster_Poll(void)
+{
+  BusDispatch_Update();
+  Playback_Update();
+  HAL_Delay(1);
+}
+
+/**
+ * @brief Check whether the song has finished playing
+ */
+bool SimMaster_IsFinished(void)
+{
+  return Playback_IsFinished();
+}
+
+/**
+ * @brief Print the main controller's view of each board
+ * @param out: Output stream
+ */
+void SimMaster_Report(FILE *out)
+{
+  for (uint8_t unit = 0; unit < BUS_NUM_BOARDS; unit++)
+  {
+    const BusBoardStatus_t *board = BusDispatch_GetBoardStatus(unit);
+    fprintf(out, "  unit %u: keyframes %lu (re-strikes %lu), compact %lu, polls %lu (timeouts %lu), stalls %lu, "
+                 "driver drops %lu, unacknowledged %lu, profile re-sends %lu, hottest coil %u C\n",
+            unit, (unsigned long)board->keyframes, (unsigned long)board->restrikes, (unsigned long)board->compact_frames,
+            (unsigned long)board->polls, (unsigned long)board->poll_timeouts, (unsigned long)board->stalls,
+            (unsigned long)board->driver_drops, (unsigned long)board->unacknowledged,
+            (unsigned long)board->profile_resends, board->coil_temperature);
+  }
+}
@@ -0,0 +1,148 @@
+#include "sim.h"
+
+// Trace capacity (note on + note off for every parsed MIDI event, plus pedal)
+#define SIM_TRACE_MAX 4096
+
+// One command from send to apply
+typedef struct
+{
+  SimTraceKind_t kind;
+  uint8_t note;
+  uint8_t channel;
+  uint16_t bytes;      // Frame length on the wire
+  uint32_t execute_at; // Requested master time in us
+  uint64_t send_ns;    // Start bit of the address byte
+  uint64_t wire_end_ns; // Stop bit of the newline
+  uint64_t apply_ns;   // Driver executed the command
+  bool applied;
+} SimTraceEntry_t;
+
+static SimTraceEntry_t g_trace[SIM_TRACE_MAX];
+static uint32_t g_trace_count = 0;
+static uint32_t g_trace_first_pending = 0;
+
+static const char *const g_kind_names[] = {"on", "off", "ped+", "ped-"};
+
+/**
+ * @brief Record a command the main controller has just put on the wire
+ * @param kind: Command kind
+ * @param note: MIDI note (0 for pedal)
+ * @param channel: Driver channel the note maps to
+ * @param execute_at: Requested master time in us
+ */
+void SimTrace_Sent(SimTraceKind_t kind, uint8_t note, uint8_t channel, uint32_t execute_at)
+{
+  if (g_trace_count >= SIM_TRACE_MAX)
+  {
+    return;
+  }
+
+  SimTraceEntry_t *entry = &g_trace[g_trace_count++];
+  entry->kind = kind;
+  entry->note = note;
+  entry->channel = channel;
+  entry->execute_at = execute_at;
+  entry->applied = false;
+  Sim_GetLastMasterFrame(&entry->send_ns, &entry->wire_end_ns, &entry->bytes);
+}
+
+/**
+ * @brief Match a command applied by the driver to the oldest matching send
+ *
+ * The driver executes commands in arrival order, so the first pending entry
+ * of the same kind and channel is the one being applied.
+ * @param kind: Command kind
+ * @param channel: Driver channel (0 for pedal)
+ */
+void SimTrace_Applied(SimTraceKind_t kind, uint8_t channel)
+{
+  for (uint32_t i = g_trace_first_pending; i < g_trace_count; i++)
+  {
+    SimTraceEntry_t *entry = &g_trace[i];
+    if (!entry->applied && entry->kind == kind && entry->channel == channel)
+    {
+      entry->applied = true;
+      entry->apply_ns = Sim_Now();
+      break;
+    }
+  }
+
+  while (g_trace_first_pending < g_trace_count && g_trace[g_trace_first_pending].applied)
+  {
+    g_trace_first_pending++;
+  }
+}
+
+/**
+ * @brief Print every traced command and a summary
+ * @param out: Output stream
+ */
+void SimTrace_Report(FILE *out)
+{
+  uint32_t applied = 0;
+  uint32_t total_bytes = 0;
+  double max_latency_us = 0.0;
+  double sum_latency_us = 0.0;
+  double max_early_us = 0.0;
+  double max_late_us = 0.0;
+
+  fprintf(out, "    #   due (ms)  cmd  note bytes  wire (us)  send->apply (us)  vs due (us)\n");
+
+  for (uint32_t i = 0; i < g_trace_count; i++)
+  {
+    const SimTraceEntry_t *entry = &g_trace[i];
+    double wire_us = (double)(entry->wire_end_ns - entry->send_ns) / 1000.0;
+    total_bytes += entry->bytes;
+
+    if (!entry->applied)
+    {
+      fprintf(out, "%5lu %10.3f %-4s %4u %5u %10.1f  %16s  %11s\n", (unsigned long)i,
+              entry->execute_at / 1000.0, g_kind_names[entry->kind], entry->note, entry->bytes,
+              wire_us, "never applied", "-");
+      continue;
+    }
+
+    double latency_us = (double)(entry->apply_ns - entry->send_ns) / 1000.0;
+    double error_us = (double)entry->apply_ns / 1000.0 - (double)entry->execute_at;
+    applied++;
+    sum_latency_us += latency_us;
+    if (latency_us > max_latency_us)
+    {
+      max_latency_us = latency_us;
+    }
+    if (error_us > max_late_us)
+    {
+      max_late_us = error_us;
+    }
+    if (-error_us > max_early_us)
+    {
+      max_early_us = -error_us;
+    }
+
+    fprintf(out, "%5lu %10.3f %-4s %4u %5u %10.1f  %16.1f  %+11.1f\n", (unsigned long)i,
+            entry->execute_at / 1000.0, g_kind_names[entry->kind], entry->note, entry->bytes,
+            wire_us, latency_us, error_us);
+  }
+
+  const SimWireStats_t *wire = Sim_GetWireStats();
+  double elapsed_ns = (double)Sim_Now();
+
+  fprintf(out, "\nCommands: %lu sent, %lu applied, %lu lost\n", (unsigned long)g_trace_count,
+          (unsigned long)applied, (unsigned long)(g_trace_count - applied));
+  if (g_trace_count > 0)
+  {
+    fprintf(out, "Bytes per command: %.2f\n", (double)total_bytes / g_trace_count);
+  }
+  if (applied > 0)
+  {
+    fprintf(out, "Send to apply: mean %.1f us, max %.1f us\n", sum_latency_us / applied, max_latency_us);
+    fprintf(out, "Against due time: up to %.1f us early, up to %.1f us late\n", max_early_us, max_late_us);
+  }
+  fprintf(out, "Wire: %lu frames / %lu bytes to driver, %lu frames / %lu bytes to master, %.1f%% busy\n",
+          (unsigned long)wire->frames_to_driver, (unsigned long)wire->bytes_to_driver,
+          (unsigned long)wire->frames_to_master, (unsigned long)wire->bytes_to_master,
+          elapsed_ns > 0 ? 100.0 * (double)wire->busy_ns / elapsed_ns : 0.0);
+  fprintf(out, "Faults: %lu collisions, %lu driver overruns, %lu master overruns\n",
+          (unsigned long)wire->collisions, (unsigned long)wire->driver_overruns,
+          (unsigned long)wire->master_overruns);
+}
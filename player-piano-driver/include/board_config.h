@@ -0,0 +1,42 @@
+#ifndef BOARD_CONFIG_H
+#define BOARD_CONFIG_H
+
+#include "stm32f1xx_hal.h"
+#include "rs485.h"
+
+// Build-time defaults, used when the flash page holds no valid record.
+// Override per board with e.g. -DBOARD_UNIT_ADDRESS=3 in build_flags.
+#ifndef BOARD_UNIT_ADDRESS
+#define BOARD_UNIT_ADDRESS 0
+#endif
+
+#ifndef BOARD_GROUP_MASK
+#define BOARD_GROUP_MASK RS485_GROUP_BIT(RS485_GROUP_PEDAL)
+#endif
+
+// Command input: the RS485 bus from the main controller, or raw MIDI bytes
+// straight from a MIDI source (see midi_input.h)
+#define BOARD_INPUT_RS485 0
+#define BOARD_INPUT_MIDI 1
+
+#ifndef BOARD_INPUT_MODE
+#define BOARD_INPUT_MODE BOARD_INPUT_RS485
+#endif
+
+// Record tag for the board configuration page (bump when the layout changes)
+#define BOARD_CONFIG_TAG 0xB001
+
+// Persistent per-board configuration
+typedef struct
+{
+  uint8_t unit_address; // Unicast unit number on the RS485 bus (0-110)
+  uint8_t input_mode;   // BOARD_INPUT_RS485 or BOARD_INPUT_MIDI (0 in records from older firmware)
+  uint16_t group_mask; // Bit n set = member of group n (0-14)
+} BoardConfig_t;
+
+// Function prototypes
+void BoardConfig_Init(void);
+HAL_StatusTypeDef BoardConfig_Save(const BoardConfig_t *config);
+const BoardConfig_t *BoardConfig_Get(void);
+
+#endif // BOARD_CONFIG_H
@@ -0,0 +1,41 @@
+#ifndef CHANNEL_BACKEND_H
+#define CHANNEL_BACKEND_H
+
+#include "stm32f1xx_hal.h"
+#include "pwm_output_config.h"
+
+// Key count
+// Keys on this board, fixed at build time (-DNUM_KEYS=...). The first
+// PWM_NUM_CHANNELS keys are driven by the timer outputs and the rest, only
+// with PWM_EXPANDER_ENABLE, by the PWM expander chain (see pwm_expander.h).
+// The main controller's BUS_CHANNELS_PER_BOARD must match.
+#ifndef NUM_KEYS
+#define NUM_KEYS 12
+#endif
+#define CHANNEL_EXPANDER_KEYS ((NUM_KEYS > PWM_NUM_CHANNELS) ? (NUM_KEYS - PWM_NUM_CHANNELS) : 0)
+
+// Channel backends
+// The key driver writes duties through Channel_SetDuty and Channel_Commit,
+// which hand each key to whichever backend drives it. A backend stages
+// duties in Set and sends everything staged in Commit; Commit must be safe
+// from both the main loop and interrupts, and cheap when nothing changed.
+// Duties staged from the main loop form a batch that only its own next
+// Channel_Commit closes; a backend defers a commit made from an interrupt
+// while Channel_BatchOpen() says one is open, so no batch goes out in part.
+typedef struct
+{
+  void (*init)(void);
+  void (*start)(void);
+  void (*set_duty)(uint8_t channel, uint16_t duty); // duty: PWM_DUTY_MAX = full
+  void (*commit)(void);
+  uint8_t channel_count;
+} ChannelBackend_t;
+
+// Function prototypes
+void Channel_Init(void);
+void Channel_Start(void);
+void Channel_SetDuty(uint8_t key, uint16_t duty);
+void Channel_Commit(void);
+uint8_t Channel_BatchOpen(void);
+
+#endif // CHANNEL_BACKEND_H
@@ -0,0 +1,34 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include "stm32f1xx_hal.h"
+
+// Clock sync configuration
+#define CLOCK_SYNC_TIMEOUT_US 2000000     // Lose sync after 2 s without a beacon
+#define CLOCK_SYNC_MAX_ERROR_US 5000      // Larger beacon errors restart the estimate
+#define CLOCK_SYNC_DRIFT_SHIFT 20         // Drift is stored as a fraction * 2^20
+#define CLOCK_SYNC_DRIFT_SMOOTHING 2      // Drift IIR filter: new = old + (measured - old) / 4
+#define CLOCK_SYNC_MAX_PLAYOUT_US 1000000 // Execute-at times further ahead are treated as bogus
+
+// Clock sync state
+// Maps the main controller's microsecond clock (master) onto the local
+// timebase: master = ref_master + (local - ref_local) * (1 + drift / 2^20)
+typedef struct
+{
+  uint32_t ref_local;   // Local time of the last accepted beacon
+  uint32_t ref_master;  // Master time of the last accepted beacon
+  int32_t drift;        // Master rate relative to local, fraction * 2^20
+  int32_t last_error;   // Prediction error of the last beacon in us
+  uint32_t beacons;     // Number of beacons accepted since the last reset
+  uint32_t resyncs;     // Number of times the estimate was restarted
+  uint8_t synced;       // 1 once at least one beacon has been accepted
+} ClockSync_t;
+
+// Function prototypes
+void ClockSync_Init(void);
+void ClockSync_OnBeacon(uint32_t master_time, uint32_t local_time);
+uint8_t ClockSync_IsSynced(uint32_t local_now);
+HAL_StatusTypeDef ClockSync_MasterToLocal(uint32_t master_time, uint32_t *local_time);
+const ClockSync_t *ClockSync_Get(void);
+
+#endif // CLOCK_SYNC_H
@@ -3,9 +3,32 @@
 
 #include "stm32f1xx_hal.h"
 #include "key_driver.h"
+#include "spsc_ring.h"
+#include "envelope_profile.h"
 
 // Command queue configuration
-#define COMMAND_QUEUE_SIZE 32
+#define COMMAND_QUEUE_SIZE 32      // Power of two, at most 32 (one run-ahead bit per slot)
+#define COMMAND_PEDAL_QUEUE_SIZE 8 // Pedal lane, power of two, at most COMMAND_QUEUE_SIZE
+#define COMMAND_BATCH_SIZE 8       // Due key commands coalesced and run between budget checks
+
+// Compact (running status) frames
+// A frame starting with a digit repeats the last full P/R command's opcode.
+// Parameters are absolute (":n"), deltas (+n / -n) or omitted (unchanged)
+// relative to the channel's last full press, and "@n" is relative to the
+// start of the frame in units of COMMAND_COMPACT_TIME_UNIT_US. A release is
+// always "<channel>:0" (or resolves to duty 0), so a press cannot be taken
+// for one when the press keyframe before it was lost.
+#define COMMAND_COMPACT_TIME_UNIT_US 100
+#define COMMAND_NUM_PARAMS 5 // duty, strike time, follow-up duty, follow-up time, hold duty
+#define COMMAND_MAX_FIELDS (1 + COMMAND_NUM_PARAMS) // channel, then the parameters
+#define COMMAND_NO_PROFILE 0xFF // Press by parameters rather than by envelope profile
+
+// Flash saves
+// "E:W" and "K:W" only mark the profile or calibration table for saving. The
+// main loop stores it (CommandParser_ProcessSaves) once nothing is playing,
+// since the page erase stalls the whole CPU (see flash_storage.h); saves
+// that arrive mid-performance wait, and are counted
+// (CommandParser_GetDeferredSaves).
 
 // Command types
 typedef enum
@@ -13,42 +36,124 @@ typedef enum
   COMMAND_PRESS = 0,
   COMMAND_RELEASE,
   COMMAND_PEDAL_PRESS,
-  COMMAND_PEDAL_RELEASE
+  COMMAND_PEDAL_RELEASE,
+  COMMAND_RELEASE_ALL,
+  COMMAND_CLOCK_SYNC,
+  COMMAND_CREDIT_QUERY,
+  COMMAND_PROFILE_SET, // Envelope profile upload, profile ID in channel
+  COMMAND_PROFILE_SEGMENT, // Envelope profile segment upload, profile ID in channel
+  COMMAND_PROFILE_SAVE,
+  COMMAND_RESTRIKE, // Press by profile, partly releasing a key that is still down first
+  COMMAND_RELEASE_SET, // Release ramp for a channel, in ramp and initial_strike_time (ms)
+  COMMAND_CALIBRATION_POINT, // Velocity curve point for a channel, point in segment, duty in duty_cycle
+  COMMAND_CALIBRATION_LIMITS, // Minimum strike in duty_cycle, hold in hold_duty_cycle, latency (us) in initial_strike_time
+  COMMAND_CALIBRATION_SAVE
 } CommandType_t;
 
 // Parsed command structure
 typedef struct
 {
   CommandType_t type;
-  uint8_t channel;              // Direct channel (0-11 for 12 channels)
+  uint8_t channel;              // Direct channel (0 to NUM_KEYS - 1)
   uint8_t duty_cycle;           // Initial duty cycle (0-100)
   uint16_t initial_strike_time; // Initial strike time in ms (0 = use default)
   uint8_t followup_duty_cycle;  // Follow-up duty cycle (0-100, 0 = no follow-up)
   uint16_t followup_time;       // Follow-up time in ms (0 = no follow-up)
   uint8_t hold_duty_cycle;      // Hold duty cycle (0-100, 0 = use default)
+  uint8_t profile;              // Envelope profile ID, or COMMAND_NO_PROFILE; a profile press
+                                // runs the profile with its first segment at duty_cycle
+  uint8_t segment;              // Segment index (COMMAND_PROFILE_SEGMENT)
+  uint8_t ramp;                 // Segment ramp, KeyRamp_t (COMMAND_PROFILE_SEGMENT, COMMAND_RELEASE_SET)
+  uint8_t is_timed;             // 1 if the command carries an execute-at time
+  uint8_t is_relative;          // 1 if execute_at is an offset in us from the frame start (compact frames)
+  uint32_t execute_at;          // Execute-at time in us (master clock when parsed, local once queued;
+                                // beacon time for COMMAND_CLOCK_SYNC)
 } ParsedCommand_t;
 
+// Tokenizer states
+typedef enum
+{
+  TOKEN_STATE_START = 0,   // Expecting an opcode or, for a compact frame, a digit
+  TOKEN_STATE_OPCODE,      // Opcode read, expecting ':'
+  TOKEN_STATE_FIRST_FIELD, // After "X:", expecting a number or P/A/W/?
+  TOKEN_STATE_FIELD,       // After a separator, expecting a number, separator or '@'
+  TOKEN_STATE_NUMBER,      // Inside a number
+  TOKEN_STATE_SPECIAL,     // After P/A/?, only '@' may follow
+  TOKEN_STATE_TIME,        // After '@', expecting the first digit
+  TOKEN_STATE_TIME_DIGITS, // Inside the execute-at time
+  TOKEN_STATE_ERROR        // Malformed, rest of the frame ignored
+} TokenState_t;
+
+// Incremental frame tokenizer: fed one or more pieces of a frame, it splits
+// the fields in a single pass and converts numbers as they arrive
+typedef struct
+{
+  TokenState_t state;
+  char opcode;                          // 'P', 'R', 'N', 'T', 'V', 'U', 'S', 'C', 'E', 'G', 'D', 'K', or 0 for a compact frame
+  char special;                         // 'P', 'A', 'W' or '?' in "P:P", "R:P", "R:A", "E:W", "K:W", "C:?"
+  uint8_t field_count;                  // Fields completed
+  uint8_t present_mask;                 // Bit n set = field n had digits
+  uint8_t digits;                       // Digits in the number being read
+  char separators[COMMAND_MAX_FIELDS];  // Character before each field (0 for a compact channel)
+  uint32_t values[COMMAND_MAX_FIELDS];  // Field values by position
+  uint32_t value;                       // Number being read; the execute-at time once past '@'
+  uint8_t is_timed;                     // 1 once "@<time>" has started
+} CommandTokenizer_t;
+
+// Per-channel reference for compact frames, taken from the last full press
+typedef struct
+{
+  uint8_t valid;                      // 1 once a full press has been received for the channel
+  uint8_t profile;                    // Profile of that press, or COMMAND_NO_PROFILE
+  uint16_t params[COMMAND_NUM_PARAMS]; // Parameters of that press, in full-format order
+} ChannelReference_t;
+
+// Running status, updated only by full-format (keyframe) commands so a lost
+// compact frame never affects the frames after it
+typedef struct
+{
+  CommandType_t opcode; // Opcode repeated by compact frames
+  uint8_t opcode_valid; // 1 once a full P/R command has been received
+  ChannelReference_t channels[NUM_KEYS];
+} RunningStatus_t;
+
 // Command queue structure
+// Single producer (frame parser) and single consumer (ProcessQueue), safe
+// whichever of them runs in interrupt context. Key commands and pedal
+// commands each have their own queue, so a burst of keys never holds up the
+// pedal.
 typedef struct
 {
   ParsedCommand_t commands[COMMAND_QUEUE_SIZE];
-  uint8_t head;
-  uint8_t tail;
-  uint8_t count;
+  SpscRing_t ring;
+  volatile uint32_t dropped; // Commands rejected because the queue was full
+  uint32_t coalesced;        // Due commands skipped because a later one for the same channel replaced them
+  uint32_t run_ahead;        // Bit n set = slot n was run ahead of a held command (consumer only)
 } CommandQueue_t;
 
 // Function prototypes
+void CommandTokenizer_Reset(CommandTokenizer_t *tokenizer);
+void CommandTokenizer_Feed(CommandTokenizer_t *tokenizer, const char *data, uint16_t length);
+HAL_StatusTypeDef CommandParser_ParseTokens(CommandTokenizer_t *tokenizer, ParsedCommand_t *command);
 HAL_StatusTypeDef CommandParser_ParseMessage(const char *message, uint16_t length, ParsedCommand_t *command);
+void CommandParser_VelocityPress(ParsedCommand_t *command, uint8_t velocity);
 void CommandParser_ExecuteCommand(const ParsedCommand_t *command, KeyDriverModule_t *key_driver);
 void CommandParser_Init(KeyDriverModule_t *key_driver);
+HAL_StatusTypeDef CommandParser_Submit(const ParsedCommand_t *command);
 
 // Queue management functions
-HAL_StatusTypeDef CommandQueue_Init(CommandQueue_t *queue);
+HAL_StatusTypeDef CommandQueue_Init(CommandQueue_t *queue, uint32_t capacity);
 HAL_StatusTypeDef CommandQueue_Enqueue(CommandQueue_t *queue, const ParsedCommand_t *command);
 HAL_StatusTypeDef CommandQueue_Dequeue(CommandQueue_t *queue, ParsedCommand_t *command);
+uint8_t CommandQueue_DequeueBatch(CommandQueue_t *queue, ParsedCommand_t *commands, uint8_t max_count);
+ParsedCommand_t *CommandQueue_Peek(CommandQueue_t *queue);
 uint8_t CommandQueue_IsEmpty(const CommandQueue_t *queue);
 uint8_t CommandQueue_IsFull(const CommandQueue_t *queue);
-void CommandParser_ProcessQueue(CommandQueue_t *queue, KeyDriverModule_t *key_driver);
+uint8_t CommandQueue_GetFreeSlots(const CommandQueue_t *queue);
+uint8_t CommandParser_ProcessQueue(CommandQueue_t *queue, KeyDriverModule_t *key_driver, uint32_t deadline);
+void CommandParser_ProcessSaves(KeyDriverModule_t *key_driver);
+uint32_t CommandParser_GetDeferredSaves(void);
 CommandQueue_t *CommandParser_GetQueue(void);
+CommandQueue_t *CommandParser_GetPedalQueue(void);
 
 #endif // COMMAND_PARSER_H
@@ -0,0 +1,51 @@
+#ifndef ENVELOPE_PROFILE_H
+#define ENVELOPE_PROFILE_H
+
+#include "stm32f1xx_hal.h"
+#include "key_driver.h"
+
+// Strike envelope profiles
+// The main controller uploads a table of envelopes once and then presses
+// keys by profile ID ("N:ch:id"), so a fully shaped strike costs no more wire
+// bytes than a bare duty cycle. A profile is either a full-format envelope
+// ("E:id:duty:strike:fduty:ftime:hold", stored as step segments) or built
+// segment by segment ("G:id:n:duty:ramp:ms", segment 0 first). Segment
+// frames are staged aside and the profile goes live when its hold segment
+// (ms = 0) arrives, so a press during an upload still gets the previous
+// version. Every profile has to end in a hold at or below
+// ENVELOPE_PROFILE_MAX_HOLD_DUTY; a key never stays at its strike duty. "E:W"
+// keeps the current table in flash; it is loaded again at power-up. Presses
+// by a profile this board does not hold fall back to a plain press, and each
+// credit reply carries a mask of the valid profiles so the main controller
+// can re-send the missing ones.
+#define ENVELOPE_PROFILE_COUNT 32
+#define ENVELOPE_PROFILE_TAG 0xE002 // Flash record tag (bump when the layout changes)
+
+#if ENVELOPE_PROFILE_COUNT > 32
+#error "ENVELOPE_PROFILE_COUNT must fit the 32-bit valid mask"
+#endif
+#ifndef ENVELOPE_PROFILE_MAX_HOLD_DUTY
+#define ENVELOPE_PROFILE_MAX_HOLD_DUTY 50 // Highest hold duty a profile may end in (0-100)
+#endif
+
+#if ENVELOPE_PROFILE_MAX_HOLD_DUTY < HOLD_DUTY_CYCLE
+#error "ENVELOPE_PROFILE_MAX_HOLD_DUTY must allow the default hold duty"
+#endif
+
+// Envelope profile
+typedef struct
+{
+  uint8_t valid;         // 1 once uploaded or loaded from flash
+  uint8_t segment_count; // Segments in use (1 to KEY_MAX_SEGMENTS)
+  KeySegment_t segments[KEY_MAX_SEGMENTS];
+} EnvelopeProfile_t;
+
+// Function prototypes
+void EnvelopeProfile_Init(void);
+HAL_StatusTypeDef EnvelopeProfile_Set(uint8_t id, const EnvelopeProfile_t *profile);
+HAL_StatusTypeDef EnvelopeProfile_SetSegment(uint8_t id, uint8_t index, const KeySegment_t *segment);
+const EnvelopeProfile_t *EnvelopeProfile_Get(uint8_t id);
+uint32_t EnvelopeProfile_GetValidMask(void);
+HAL_StatusTypeDef EnvelopeProfile_Save(void);
+
+#endif // ENVELOPE_PROFILE_H
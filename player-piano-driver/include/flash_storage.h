@@ -0,0 +1,36 @@
+#ifndef FLASH_STORAGE_H
+#define FLASH_STORAGE_H
+
+#include "stm32f1xx_hal.h"
+
+// Flash layout (STM32F103C8, 64 KB, 1 KB pages)
+// The last pages of flash are reserved for persistent records; the build
+// ends the application below them (board_upload.maximum_size in
+// platformio.ini, checked again at link time by flash_storage.ld)
+#define FLASH_STORAGE_PAGE_SIZE 0x400
+#define FLASH_STORAGE_KEY_CALIBRATION_PAGE 0x0800F400  // Page 61: per-key calibration
+#define FLASH_STORAGE_ENVELOPE_PROFILE_PAGE 0x0800F800 // Page 62: strike envelope profiles
+#define FLASH_STORAGE_BOARD_CONFIG_PAGE 0x0800FC00      // Page 63: board address/groups
+
+// Record header stored at the start of each page
+typedef struct
+{
+  uint16_t tag;      // Record identifier (distinguishes record types and versions)
+  uint16_t length;   // Payload length in bytes
+  uint32_t checksum; // FNV-1a checksum of the payload
+} FlashStorageHeader_t;
+
+// Maximum payload that fits in a single page
+#define FLASH_STORAGE_MAX_PAYLOAD (FLASH_STORAGE_PAGE_SIZE - sizeof(FlashStorageHeader_t))
+
+// Saving
+// FlashStorage_Save erases the whole page first, and on the F103 every code
+// fetch from flash stalls until the erase is done, interrupts included: 20
+// to 40 ms with no stepper steps, key timer deadlines or bus replies, though
+// reception continues by DMA. Only call it while nothing is playing.
+
+// Function prototypes
+HAL_StatusTypeDef FlashStorage_Load(uint32_t page_address, uint16_t tag, void *data, uint16_t length);
+HAL_StatusTypeDef FlashStorage_Save(uint32_t page_address, uint16_t tag, const void *data, uint16_t length);
+
+#endif // FLASH_STORAGE_H
@@ -0,0 +1,47 @@
+#ifndef KEY_CALIBRATION_H
+#define KEY_CALIBRATION_H
+
+#include "stm32f1xx_hal.h"
+#include "key_driver.h"
+
+// Per-key calibration
+// Every key needs a different force for the same loudness, so each key has
+// its own velocity curve: strike duty at KEY_CALIBRATION_POINTS MIDI
+// velocities spread evenly over 0-127, a minimum strike duty the curve never
+// goes below, a hold duty (0 = the envelope's own) and a strike latency, the
+// time from switching the coil on to the hammer reaching the string. Timed
+// presses are started that much early, so all keys sound together.
+//
+// The table is kept in flash and loaded at power-up; the curves are expanded
+// into a RAM lookup of KEY_CALIBRATION_LUT_SIZE duties per key (one per four
+// velocities), so a press by velocity ("V:<channel>:<velocity>") costs one
+// load. Updates over the bus take effect at once:
+//   "K:<channel>:<point>:<duty>" - one curve point
+//   "K:<channel>:<min strike>:<hold>:<latency us>" - the key's limits
+//   "K:W" - store the table in flash
+// Keys without a stored record follow the main controller's old linear
+// mapping, 65-80% duty.
+#define KEY_CALIBRATION_POINTS 8
+#define KEY_CALIBRATION_LUT_SIZE 32        // Velocities 4n to 4n+3 share entry n
+#define KEY_CALIBRATION_MAX_LATENCY_US 20000
+#define KEY_CALIBRATION_TAG 0xCA01         // Flash record tag (bump when the layout changes)
+#define KEY_CALIBRATION_MAX_KEYS 84        // Records that fit in one flash page
+
+// Calibration of one key, as stored in flash
+typedef struct
+{
+  uint8_t curve[KEY_CALIBRATION_POINTS]; // Strike duty (0-100) at velocity 127 * n / (KEY_CALIBRATION_POINTS - 1)
+  uint8_t min_strike_duty;               // Lowest strike duty for any velocity above 0
+  uint8_t hold_duty;                     // Hold duty (0-100, 0 = the envelope's own)
+  uint16_t latency_us;                   // Strike latency, up to KEY_CALIBRATION_MAX_LATENCY_US
+} KeyCalibration_t;
+
+// Function prototypes
+void KeyCalibration_Init(void);
+HAL_StatusTypeDef KeyCalibration_SetPoint(uint8_t key, uint8_t point, uint8_t duty);
+HAL_StatusTypeDef KeyCalibration_SetLimits(uint8_t key, uint8_t min_strike_duty, uint8_t hold_duty, uint16_t latency_us);
+const KeyCalibration_t *KeyCalibration_Get(uint8_t key);
+uint8_t KeyCalibration_StrikeDuty(uint8_t key, uint8_t velocity);
+HAL_StatusTypeDef KeyCalibration_Save(void);
+
+#endif // KEY_CALIBRATION_H
@@ -2,49 +2,137 @@
 #define KEY_DRIVER_H
 
 #include "stm32f1xx_hal.h"
-#include "pwm_output_config.h"
+#include "channel_backend.h"
 
-// Key driver configuration
-#define NUM_KEYS 12
+// Key driver configuration (NUM_KEYS is set in channel_backend.h)
 #define INITIAL_STRIKE_TIME_MS 50
 #define HOLD_DUTY_CYCLE 20
 #define MAX_VELOCITY 127
 #define MIN_VELOCITY 0
 
+// Envelope segments
+// Every press runs an envelope of up to KEY_MAX_SEGMENTS segments, each
+// moving the duty cycle to its target over its duration: at once (step), in
+// equal steps (linear) or closing a fixed fraction of the remaining distance
+// on every tick (exponential, ~95% of the way by the end). Ramps advance every
+// KEY_RAMP_TICK_US from the key timer interrupt using only adds and
+// multiplies; the per-segment rates are worked out when the key is pressed.
+// The output stays at the last segment's target until release.
+#define KEY_MAX_SEGMENTS 4
+#define KEY_RAMP_TICK_US 500
+#define KEY_DUTY_SHIFT 16 // Duty cycle fraction bits while ramping (Q16 percent)
+
+// Thermal limits
+// The coil thermal model can scale a held key's duty down and cap every
+// output of a key, whatever its envelope asks for (see thermal_model.h).
+#define KEY_HOLD_SCALE_FULL 256 // Hold scale of an unlimited key, 256ths
+
+// Power budget
+// Supply current is taken as proportional to the sum of the keys' duty
+// cycles. Each sounding key counts at its output duty, or at the target of
+// the segment it is ramping towards if that is higher, so holds and ramps are
+// always accounted for. A strike that would take the board over
+// KEY_POWER_BUDGET_PERCENT (of one coil fully on) waits and is retried every
+// KEY_POWER_STAGGER_US, louder strikes first, and starts regardless once it
+// has waited KEY_POWER_MAX_DELAY_US, which bounds the added latency.
+#ifndef KEY_POWER_BUDGET_PERCENT
+#define KEY_POWER_BUDGET_PERCENT 300
+#endif
+#define KEY_POWER_STAGGER_US 250
+#define KEY_POWER_MAX_DELAY_US 2000
+
+// Fast repetition
+// A re-strike of a key that is still down drops it to KEY_RESTRIKE_DUTY for
+// KEY_RESTRIKE_RESET_MS, just long enough for the action's repetition lever
+// to reset, and then strikes again without the key travelling all the way
+// back up. A key that is already up is simply pressed.
+#define KEY_RESTRIKE_DUTY 8
+#define KEY_RESTRIKE_RESET_MS 12
+
+// Release envelopes
+// Each key can have a release ramp (linear or exponential, down to 0 over
+// its duration) so it is let back up under control instead of slamming up
+// and bouncing. The ramp runs from the key timer interrupt like any other
+// segment. Ramps are set per key over the bus with "D:<channel>:<ramp>:<ms>";
+// keys start with no ramp (duration 0), which cuts the output at once.
+
+// Key bitmaps
+// Keys that are not idle, and keys whose strike is waiting on the power
+// budget, are also kept as bitmaps of KEY_MASK_WORDS words. Scans over the
+// keys (power budget, thermal model) walk these instead of every key, taking
+// the lowest set bit with one count-trailing-zeros (RBIT + CLZ on the
+// Cortex-M3), so they cost nothing while the board is idle and grow with the
+// keys playing rather than NUM_KEYS.
+#define KEY_MASK_WORDS ((NUM_KEYS + 31) / 32)
+#define KEY_MASK_LOWEST(bits) ((uint8_t)__builtin_ctz(bits)) // Lowest set bit of a non-zero word
+
+// Segment ramp shapes
+typedef enum
+{
+  KEY_RAMP_STEP = 0,
+  KEY_RAMP_LINEAR,
+  KEY_RAMP_EXPONENTIAL
+} KeyRamp_t;
+
+// Envelope segment, as stored in profiles
+typedef struct
+{
+  uint8_t duty_cycle;   // Target duty cycle (0-100)
+  uint8_t ramp;         // KeyRamp_t
+  uint16_t duration_ms; // Segment length (0 = reach the target at once and hold it)
+} KeySegment_t;
+
 // Key state enumeration
 typedef enum
 {
   KEY_STATE_IDLE = 0,
-  KEY_STATE_INITIAL_STRIKE,
-  KEY_STATE_FOLLOWUP,
-  KEY_STATE_HOLD
+  KEY_STATE_RESET,    // Partly released before a re-strike
+  KEY_STATE_WAITING,  // Pressed, strike held back by the power budget
+  KEY_STATE_ENVELOPE, // Running a segment with a deadline
+  KEY_STATE_HOLD,     // Past the last segment, held until release
+  KEY_STATE_RELEASING // Running the release ramp
 } KeyState_t;
 
 // Key driver structure for each key
 typedef struct
 {
   KeyState_t state;
-  uint32_t initial_strike_start_time;
-  uint32_t followup_start_time;
-  uint8_t initial_duty_cycle;
-  uint8_t followup_duty_cycle;
-  uint8_t hold_duty_cycle;
-  uint16_t initial_strike_time_ms;
-  uint16_t followup_time_ms;
+  uint8_t segment;                   // Segment running
+  uint8_t segment_count;
+  KeySegment_t segments[KEY_MAX_SEGMENTS];
+  uint32_t rates[KEY_MAX_SEGMENTS];  // Q16 fraction per ramp tick, 0 for a step
+  int32_t duty_q16;                  // Current duty cycle, Q16
+  int32_t step_q16;                  // Linear ramp step per tick
+  uint32_t segment_end_us;           // Timebase time the running segment ends
+  uint32_t admit_by_us;              // Time a waiting strike starts regardless of the budget
+  uint16_t strike_duty;              // Duty the first segment asks for, for the power budget
+  KeySegment_t release;              // Release ramp (duty_cycle unused, duration 0 = cut at once)
+  uint16_t output_duty;              // Duty last written to the key's channel (PWM_DUTY_MAX = full)
+  uint16_t duty_cap;                 // Thermal ceiling on the output (PWM_DUTY_MAX = none)
+  uint16_t hold_scale;               // Thermal scale on held duty, 256ths
 } KeyDriver_t;
 
 // Key driver module structure
 typedef struct
 {
   KeyDriver_t keys[NUM_KEYS];
+  uint32_t active[KEY_MASK_WORDS];  // Bit n set = key n not idle
+  uint32_t waiting[KEY_MASK_WORDS]; // Bit n set = key n in KEY_STATE_WAITING
   uint8_t hold_duty_cycle;
+  uint32_t staggered_strikes; // Strikes held back by the power budget
+  uint32_t max_stagger_us;    // Longest a strike was held back
 } KeyDriverModule_t;
 
 // Function declarations
 void KeyDriver_Init(KeyDriverModule_t *key_driver);
 void KeyDriver_PressKey(KeyDriverModule_t *key_driver, uint8_t key, uint8_t duty_cycle, uint16_t initial_strike_time, uint8_t followup_duty_cycle, uint16_t followup_time, uint8_t hold_duty_cycle);
+uint8_t KeyDriver_BuildSegments(KeySegment_t *segments, uint8_t duty_cycle, uint16_t initial_strike_time, uint8_t followup_duty_cycle, uint16_t followup_time, uint8_t hold_duty_cycle);
+void KeyDriver_PressEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments, uint8_t segment_count);
+void KeyDriver_RestrikeEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments, uint8_t segment_count);
 void KeyDriver_ReleaseKey(KeyDriverModule_t *key_driver, uint8_t key);
-void KeyDriver_Update(KeyDriverModule_t *key_driver);
+void KeyDriver_ReleaseAll(KeyDriverModule_t *key_driver);
+void KeyDriver_SetRelease(KeyDriverModule_t *key_driver, uint8_t key, uint8_t ramp, uint16_t duration_ms);
+void KeyDriver_SetThermalLimit(KeyDriverModule_t *key_driver, uint8_t key, uint16_t duty_cap, uint16_t hold_scale);
 
 // External key driver instance
 extern KeyDriverModule_t g_key_driver;
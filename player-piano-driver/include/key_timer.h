@@ -0,0 +1,32 @@
+#ifndef KEY_TIMER_H
+#define KEY_TIMER_H
+
+#include "stm32f1xx_hal.h"
+#include "key_driver.h"
+
+// Key phase deadlines on the TIM1 timebase
+// Each key has at most one pending deadline (the end of its current strike
+// or follow-up phase). Deadlines are kept sorted and the earliest one is
+// programmed into TIM1 compare channel 1, so the phase change runs from the
+// compare interrupt at the exact microsecond instead of on a main loop tick.
+// Deadlines further out than KEY_TIMER_MAX_ARM_US are approached in steps,
+// since the 16-bit compare only reaches one counter period ahead.
+#define KEY_TIMER_MAX_ARM_US 0x8000
+
+// Called from the compare interrupt when a key's deadline is reached
+typedef void (*KeyTimer_Callback_t)(uint8_t key, uint32_t deadline);
+
+// Timing statistics
+typedef struct
+{
+  uint32_t fired;       // Deadlines handed to the callback
+  uint32_t max_late_us; // Latest callback after its deadline
+} KeyTimerStats_t;
+
+// Function prototypes
+void KeyTimer_Init(KeyTimer_Callback_t callback);
+void KeyTimer_Schedule(uint8_t key, uint32_t deadline);
+void KeyTimer_Cancel(uint8_t key);
+const KeyTimerStats_t *KeyTimer_GetStats(void);
+
+#endif // KEY_TIMER_H
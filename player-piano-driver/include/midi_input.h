@@ -0,0 +1,62 @@
+#ifndef MIDI_INPUT_H
+#define MIDI_INPUT_H
+
+#include "stm32f1xx_hal.h"
+
+// Raw MIDI input
+// With BOARD_INPUT_MIDI the UART takes standard MIDI bytes straight from a
+// MIDI source instead of RS485 frames from the main controller. Channel
+// messages are decoded with running status; notes in this board's range
+// become key presses and releases, with the velocity mapped to a strike
+// envelope through the key's calibration (see key_calibration.h) rather than
+// on the main controller.
+#ifndef MIDI_INPUT_BAUDRATE
+#define MIDI_INPUT_BAUDRATE 31250 // Standard MIDI; faster links (e.g. USB-serial bridges) also work
+#endif
+
+#define MIDI_INPUT_OMNI 0xFF // Respond to every channel
+#ifndef MIDI_INPUT_CHANNEL
+#define MIDI_INPUT_CHANNEL MIDI_INPUT_OMNI // MIDI channel 0-15 to respond to
+#endif
+
+// Keys are assigned as on the main controller (BusDispatch_MapNote): the
+// keyboard is cut into blocks of NUM_KEYS notes from MIDI_INPUT_LOWEST_NOTE,
+// block b goes to unit b % MIDI_INPUT_NUM_BOARDS, and a note plays the key
+// at its place in the block. With fewer boards than blocks the keyboard
+// folds, so a unit plays several notes on each key. A unit with no notes on
+// the keyboard and no pedal has nothing to do on MIDI and stays on RS485.
+#ifndef MIDI_INPUT_LOWEST_NOTE
+#define MIDI_INPUT_LOWEST_NOTE 21 // A0
+#endif
+#ifndef MIDI_INPUT_NUM_NOTES
+#define MIDI_INPUT_NUM_NOTES 88 // Keys on the piano
+#endif
+#ifndef MIDI_INPUT_NUM_BOARDS
+#define MIDI_INPUT_NUM_BOARDS 1 // Must match BUS_NUM_BOARDS on the main controller
+#endif
+
+#if MIDI_INPUT_LOWEST_NOTE + MIDI_INPUT_NUM_NOTES > 128
+#error "The keyboard must end at MIDI note 127"
+#endif
+#if MIDI_INPUT_NUM_BOARDS < 1
+#error "MIDI_INPUT_NUM_BOARDS must be at least 1"
+#endif
+
+// Controllers
+#define MIDI_CC_SUSTAIN 64
+#define MIDI_CC_ALL_NOTES_OFF 123
+
+// Receive statistics
+typedef struct
+{
+  uint32_t messages; // Channel messages decoded
+  uint32_t notes;    // Note on/off messages for this board
+  uint32_t dropped;  // Commands lost because the queue was full
+} MidiInputStats_t;
+
+// Function prototypes
+HAL_StatusTypeDef MidiInput_Init(uint8_t channel, uint8_t unit, uint8_t pedal);
+void MidiInput_ProcessByte(uint8_t byte, uint32_t time);
+const MidiInputStats_t *MidiInput_GetStats(void);
+
+#endif // MIDI_INPUT_H
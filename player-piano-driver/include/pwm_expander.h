@@ -0,0 +1,66 @@
+#ifndef PWM_EXPANDER_H
+#define PWM_EXPANDER_H
+
+#include "stm32f1xx_hal.h"
+#include "channel_backend.h"
+
+// PWM expander chain (opt-in, not at parity with the timer outputs)
+// Build with -DPWM_EXPANDER_ENABLE=1 to have keys beyond the 12 timer
+// outputs driven by daisy-chained TLC5947s (24
+// channels of 12-bit PWM each) on SPI2. The I2C peripherals share their pins
+// with USART3 and TIM4, so SPI2 is the free bus. A commit packs every staged
+// duty into one frame and DMA shifts it out (36 bytes per chip, the far end
+// of the chain first); XLAT then latches all channels at once from the
+// completion interrupt. Commits made while a frame is going out are sent
+// together straight after it, so the chain is written at most once per
+// frame time (about 32 us per chip at 9 MHz). BLANK holds every expander
+// output off until the first frame has been latched.
+//
+// Expander outputs are not like the timer outputs:
+// - Frequency: the TLC5947 clocks its PWM from its own ~4 MHz oscillator
+//   over 4096 steps, so expander keys switch at about 1 kHz. The timer
+//   outputs run at PWM_FREQUENCY_HZ (20 kHz) centre-aligned. 1 kHz is
+//   audible in the coils, and its current ripple heats a coil more at the
+//   same duty (see THERMAL_EXPANDER_RIPPLE_HEATING in thermal_model.h).
+// - Resolution: duties are cut from 16 to 12 bits (duty >> 4).
+// - Drive: each output is a constant-current sink of at most 30 mA, set by
+//   the chip's IREF resistor. It cannot drive a coil or a power MOSFET gate
+//   directly. Every expander key needs an external gate driver, and the sink
+//   is active (pulling low) for the on part of the period, so the driver
+//   must switch the coil on while its input is pulled low, e.g. a pull-up
+//   into an inverting gate driver. The firmware does not invert duties.
+// Hold duties mean the same average coil current as on the timer outputs,
+// so the envelope and calibration tables need no change.
+//
+// So an expander key is louder, coarser and derated sooner than a timer key,
+// which is why the chain is off by default. A part clocked from the MCU (a
+// TLC5940 with GSCLK and BLANK from a timer) could keep a 20 kHz carrier, but
+// the F103C8's four timers are all taken by the timebase and the 12 outputs.
+// To play more keys without the loss, add driver boards of 12 instead: the
+// main controller folds the keyboard over BUS_NUM_BOARDS units.
+#ifndef PWM_EXPANDER_ENABLE
+#define PWM_EXPANDER_ENABLE 0
+#endif
+#define PWM_EXPANDER_CHANNELS_PER_CHIP 24
+#define PWM_EXPANDER_BYTES_PER_CHIP 36
+#define PWM_EXPANDER_MAX_CHIPS 4
+#if PWM_EXPANDER_ENABLE
+#define PWM_EXPANDER_CHIPS ((CHANNEL_EXPANDER_KEYS + PWM_EXPANDER_CHANNELS_PER_CHIP - 1) / PWM_EXPANDER_CHANNELS_PER_CHIP)
+#else
+#define PWM_EXPANDER_CHIPS 0
+#endif
+#define PWM_EXPANDER_CHANNELS (PWM_EXPANDER_CHIPS * PWM_EXPANDER_CHANNELS_PER_CHIP)
+
+// Pins: SCK PB13 and MOSI PB15 (SPI2), XLAT PB12, BLANK PB14
+#define PWM_EXPANDER_XLAT_PORT GPIOB
+#define PWM_EXPANDER_XLAT_PIN GPIO_PIN_12
+#define PWM_EXPANDER_BLANK_PORT GPIOB
+#define PWM_EXPANDER_BLANK_PIN GPIO_PIN_14
+
+// Function prototypes
+void PwmExpander_Init(void);
+void PwmExpander_Start(void);
+void PwmExpander_SetDuty(uint8_t channel, uint16_t duty);
+void PwmExpander_Commit(void);
+
+#endif // PWM_EXPANDER_H
@@ -10,10 +10,18 @@ typedef struct
   TIM_HandleTypeDef *htim; // Pointer to timer handle
   uint32_t channel;        // Timer channel
   uint32_t frequency;      // PWM frequency in Hz
-  uint32_t resolution;     // PWM resolution (period)
   uint32_t duty_cycle;     // Duty cycle percentage (0-100)
 } PWM_Config_t;
 
+// Duty resolution
+// The timers run unprescaled and centre-aligned, counting up and down once
+// per period, so ARR is SystemCoreClock / (2 * frequency) (1800 at 72 MHz and
+// 20 kHz). Duty is given as a 16-bit fraction of the period, PWM_DUTY_MAX
+// being fully on (to within one count), and scaled to ARR.
+#define PWM_FREQUENCY_HZ 20000
+#define PWM_DUTY_MAX 0xFFFFU
+#define PWM_PERCENT_TO_DUTY(percent) ((uint16_t)(((uint32_t)(percent) * PWM_DUTY_MAX + 50) / 100))
+
 // PWM Channel definitions for 12 outputs
 // TIM2 channels (PA0, PA1, PA2, PA3)
 #define PWM_PA0_CHANNEL TIM_CHANNEL_1
@@ -33,9 +41,31 @@ typedef struct
 #define PWM_PB8_CHANNEL TIM_CHANNEL_3
 #define PWM_PB9_CHANNEL TIM_CHANNEL_4
 
+// Synchronised duty updates
+// PWM_SetDuty only stages a channel's new pulse. PWM_Commit snapshots all
+// twelve staged pulses, and each timer's DMA transfer-complete interrupt
+// copies its four into the buffer a circular DMA reads, just after a burst.
+// The DMA writes each timer's four CCR preload registers in one burst on
+// every update event, so a commit goes out on the next one at a fixed CPU
+// cost however many keys changed. TIM2 starts TIM3 and TIM4 through its
+// trigger output, so the three timers count in step and a commit reaches
+// every channel within one PWM period, with no timer sending part of it.
+
+// Phase interleaving
+// So that a chord does not switch every coil on at the same instant, pulses
+// are spread over six evenly spaced phases: within a timer, channels 1 and 3
+// pulse around the counter's low point (PWM mode 1) and channels 2 and 4
+// around its high point (PWM mode 2, half a period later), and TIM3 and TIM4
+// start a sixth and a third of a period ahead of TIM2.
+#define PWM_NUM_TIMERS 3
+#define PWM_CHANNELS_PER_TIMER 4
+#define PWM_NUM_CHANNELS (PWM_NUM_TIMERS * PWM_CHANNELS_PER_TIMER)
+
 // Function declarations
 void PWM_Init(void);
+void PWM_SetDuty(uint8_t channel_index, uint16_t duty);
 void PWM_SetDutyCycle(uint8_t channel_index, uint32_t duty_cycle); // channel_index: 0-11 (0=PA0, 1=PA1, 2=PA2, 3=PA3, 4=PA6, 5=PA7, 6=PB0, 7=PB1, 8=PB6, 9=PB7, 10=PB8, 11=PB9)
+void PWM_Commit(void);
 void PWM_Start(void);
 void PWM_Stop(void);
 
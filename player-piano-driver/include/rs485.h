@@ -5,17 +5,68 @@
 
 // RS485 Configuration
 #define RS485_UART_INSTANCE USART3
+#ifndef RS485_BAUDRATE
 #define RS485_BAUDRATE 9600
+#endif
 #define RS485_TIMEOUT 1000
-#define RS485_RX_BUFFER_SIZE 256
+#define RS485_RX_BUFFER_SIZE 256     // Longest frame text accepted, including terminator
+#define RS485_RX_DMA_BUFFER_SIZE 512 // Circular DMA buffer, power of two, more than one frame
+#define RS485_RX_EVENT_QUEUE_SIZE 16 // Receive events (idle line, half/full buffer), power of two
+#define RS485_TX_BUFFER_SIZE 48
+#define RS485_UPDATE_MAX_BYTES 64    // Bytes scanned per RS485_Update call
+#define RS485_UPDATE_MAX_FRAMES 2    // Frames parsed per RS485_Update call
+#define RS485_BYTE_TIME_US ((10UL * 1000000UL) / RS485_BAUDRATE) // 8N1: start + 8 data + stop bits
+#define RS485_BYTE_TIME_NS ((uint32_t)(10000000000ULL / RS485_BAUDRATE))
+
+// Frame addressing
+// Every frame starts with one address byte followed by the ASCII command and
+// a newline. Address bytes have bit 7 set, so they can never be confused with
+// command text and always mark the start of a new frame:
+//   0x80-0xEE  unicast to unit 0-110
+//   0xEF       main controller (replies from driver boards)
+//   0xF0-0xFE  group 0-14
+//   0xFF       broadcast to every board
+#define RS485_ADDR_UNICAST_BASE 0x80
+#define RS485_ADDR_MASTER 0xEF
+#define RS485_ADDR_GROUP_BASE 0xF0
+#define RS485_ADDR_BROADCAST 0xFF
+#define RS485_UNIT_ADDRESS_MAX (RS485_ADDR_MASTER - RS485_ADDR_UNICAST_BASE - 1)
+#define RS485_ADDR_UNICAST(unit) (RS485_ADDR_UNICAST_BASE + (unit))
+#define RS485_ADDR_GROUP(group) (RS485_ADDR_GROUP_BASE + (group))
+#define RS485_GROUP_BIT(group) (1u << (group))
+
+// Well-known groups
+#define RS485_GROUP_PEDAL 0 // Boards driving the sustain pedal stepper
+
+// Receive statistics
+typedef struct
+{
+  uint32_t frames;           // Frames delivered to the message callback
+  uint32_t overruns;         // Bytes lost in the UART, damaged frame dropped
+  uint32_t overflows;        // Main loop fell a whole DMA buffer behind
+  uint32_t restarts;         // DMA reception restarted after a receive error
+  uint32_t event_overflows;  // Receive events merged because the main loop fell behind
+  uint32_t isr_max_cycles;   // Longest UART or DMA receive interrupt
+  uint32_t frame_max_cycles; // Longest parse and queue of one frame in the main loop
+} RS485_RxStats_t;
+
+// Callback function type for received messages
+typedef void (*RS485_MessageCallback_t)(const char *message, uint16_t length);
+
+// Callback function type for raw mode, called for every byte with the local
+// time in us at which its stop bit ended
+typedef void (*RS485_ByteCallback_t)(uint8_t byte, uint32_t time);
 
 // Function prototypes
 HAL_StatusTypeDef RS485_Init(void);
+HAL_StatusTypeDef RS485_InitRaw(uint32_t baudrate, RS485_ByteCallback_t callback);
 HAL_StatusTypeDef RS485_StartReceive(void);
 void RS485_UART_Init(void);
-
-// Callback function type for received messages
-typedef void (*RS485_MessageCallback_t)(const char *message, uint16_t length);
+void RS485_Update(void);
+void RS485_SetAddressFilter(uint8_t unit_address, uint16_t group_mask);
+uint32_t RS485_GetFrameStartTime(void);
+HAL_StatusTypeDef RS485_SendFrame(uint8_t address, const char *payload);
+const RS485_RxStats_t *RS485_GetRxStats(void);
 
 // Set callback function for received messages
 void RS485_SetMessageCallback(RS485_MessageCallback_t callback);
@@ -0,0 +1,58 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "stm32f1xx_hal.h"
+
+// Cooperative main loop scheduler
+// One realtime stage (the stepper) runs before every other stage, so the
+// time between two of its runs is bounded by the longest single stage. The
+// other stages run in table order when due, each against a cycle budget
+// measured with the DWT counter; a stage that runs out of budget returns
+// SCHEDULER_MORE and is resumed on the next pass instead of holding up the
+// stepper.
+#define SCHEDULER_MAX_STAGES 4
+#define SCHEDULER_REALTIME_MAX_GAP_US 50 // Longer gaps between realtime runs are deadline misses
+
+// Convert microseconds to DWT cycles at the current core clock
+#define SCHEDULER_US_TO_CYCLES(us) ((uint32_t)(us) * (SystemCoreClock / 1000000UL))
+
+// Stage result
+typedef enum
+{
+  SCHEDULER_DONE = 0, // Nothing left until the stage is due again
+  SCHEDULER_MORE      // Budget ran out with work left, resume next pass
+} SchedulerResult_t;
+
+// Stage function: do work until finished or until the DWT counter reaches deadline
+typedef SchedulerResult_t (*SchedulerStageFunc_t)(uint32_t deadline);
+
+// Stage timing statistics
+typedef struct
+{
+  uint32_t runs;            // Times the stage was run
+  uint32_t carry_overs;     // Runs that ended with work left for the next pass
+  uint32_t overruns;        // Runs that took longer than the budget
+  uint32_t deadline_misses; // Periodic stage started a whole period late, or realtime gap too long
+  uint32_t max_cycles;      // Longest single run
+  uint32_t max_late_us;     // Latest start after becoming due (max gap for the realtime stage)
+} SchedulerStats_t;
+
+// Stage descriptor
+typedef struct
+{
+  SchedulerStageFunc_t run;
+  uint32_t period_us;     // 0 = every pass
+  uint32_t budget_cycles; // Cycles the stage may use per run
+  uint32_t next_due_us;   // Start of the next period
+  uint8_t carry;          // 1 if the last run left work behind
+  SchedulerStats_t stats;
+} SchedulerStage_t;
+
+// Function prototypes
+void Scheduler_Init(SchedulerStageFunc_t realtime);
+HAL_StatusTypeDef Scheduler_AddStage(SchedulerStageFunc_t run, uint32_t period_us, uint32_t budget_us);
+void Scheduler_RunPass(void);
+const SchedulerStats_t *Scheduler_GetRealtimeStats(void);
+const SchedulerStats_t *Scheduler_GetStageStats(uint8_t index);
+
+#endif // SCHEDULER_H
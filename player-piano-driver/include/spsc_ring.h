@@ -0,0 +1,37 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include "stm32f1xx_hal.h"
+
+// Lock-free single-producer/single-consumer ring indices.
+// The ring only manages positions; the owner keeps a typed array of
+// capacity elements and indexes it with the slots returned here. One side
+// (e.g. an interrupt) only writes, the other (e.g. the main loop) only reads,
+// and neither ever masks interrupts: head is advanced by the producer alone,
+// tail by the consumer alone, and both count freely and wrap at 2^32, so
+// head - tail is always the fill level and a full ring needs no spare slot.
+
+// True if n is a non-zero power of two (required for ring capacities)
+#define SPSC_RING_IS_POWER_OF_TWO(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+
+typedef struct
+{
+  volatile uint32_t head; // Next position to write, advanced by the producer only
+  volatile uint32_t tail; // Next position to read, advanced by the consumer only
+  uint32_t mask;          // Capacity - 1
+} SpscRing_t;
+
+// Function prototypes
+HAL_StatusTypeDef SpscRing_Init(SpscRing_t *ring, uint32_t capacity);
+uint32_t SpscRing_Count(const SpscRing_t *ring);
+uint32_t SpscRing_Free(const SpscRing_t *ring);
+
+// Producer side
+HAL_StatusTypeDef SpscRing_WriteSlot(const SpscRing_t *ring, uint32_t *slot);
+void SpscRing_Publish(SpscRing_t *ring);
+
+// Consumer side
+HAL_StatusTypeDef SpscRing_ReadSlot(const SpscRing_t *ring, uint32_t offset, uint32_t *slot);
+void SpscRing_Release(SpscRing_t *ring, uint32_t count);
+
+#endif // SPSC_RING_H
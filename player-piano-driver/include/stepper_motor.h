@@ -2,6 +2,7 @@
 #define STEPPER_MOTOR_H
 
 #include "stm32f1xx_hal.h"
+#include "spsc_ring.h"
 
 // Stepper motor pin definitions
 #define STEPPER_STEP_PIN GPIO_PIN_14
@@ -31,7 +32,7 @@
 #define STEPPER_IDLE_TIMEOUT_MS 15000 // 15 seconds timeout for idle after pedal released
 
 // Queue definitions
-#define STEPPER_QUEUE_SIZE 8                // Maximum number of queued commands
+#define STEPPER_QUEUE_SIZE 8                // Maximum number of queued commands (power of two)
 #define STEPPER_MIN_COMMAND_INTERVAL_MS 150 // Minimum 150ms between command executions
 
 // Direction definitions
@@ -70,9 +71,7 @@ typedef struct
 typedef struct
 {
   StepperCommand_t commands[STEPPER_QUEUE_SIZE]; // Command buffer
-  uint8_t head;                                  // Index of next command to execute
-  uint8_t tail;                                  // Index of next free slot
-  uint8_t count;                                 // Number of commands in queue
+  SpscRing_t ring;                               // Positions of queued commands
   uint32_t last_command_time;                    // Timestamp of last executed command
 } StepperQueue_t;
 
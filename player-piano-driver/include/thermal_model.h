@@ -0,0 +1,57 @@
+#ifndef THERMAL_MODEL_H
+#define THERMAL_MODEL_H
+
+#include "stm32f1xx_hal.h"
+#include "key_driver.h"
+
+// Coil thermal model
+// Each coil is one thermal mass, heated in proportion to the square of its
+// duty cycle (I²R at a fixed supply voltage) and cooling towards ambient with
+// a single time constant. Output duty is sampled every THERMAL_SAMPLE_US and
+// its square summed; every 2^THERMAL_UPDATE_SHIFT samples the temperature rise
+// moves 1/2^THERMAL_TAU_SHIFT of the way to the rise that mean heating would
+// settle at, which is a first-order low-pass costing one multiply and two
+// shifts per key. The time constant is THERMAL_SAMPLE_US <<
+// (THERMAL_UPDATE_SHIFT + THERMAL_TAU_SHIFT), about 33 s.
+#define THERMAL_SAMPLE_US 1000
+#define THERMAL_UPDATE_SHIFT 6 // Samples per update, as a power of two (64 ms)
+#define THERMAL_TAU_SHIFT 9    // Time constant in updates, as a power of two
+#define THERMAL_RISE_SHIFT 16  // Fraction bits of the temperature rise
+#define THERMAL_AMBIENT_C 25   // Assumed ambient temperature
+#ifndef THERMAL_FULL_ON_RISE_C
+#define THERMAL_FULL_ON_RISE_C 400 // Rise a coil would settle at held at 100%, from its datasheet
+#endif
+
+// Expander keys switch at about 1 kHz (see pwm_expander.h). Unless the coil's
+// L/R time constant is well above a millisecond its current follows the PWM,
+// and the heating goes with the duty rather than its square: a 20% hold heats
+// five times as much as on a 20 kHz timer output. By default expander keys
+// are modelled that way, the worst case; set to 0 for slow coils.
+#ifndef THERMAL_EXPANDER_RIPPLE_HEATING
+#define THERMAL_EXPANDER_RIPPLE_HEATING 1
+#endif
+
+// Derating
+// From THERMAL_DERATE_START_C up to THERMAL_LIMIT_C a key's held duty is
+// scaled down and every output (strikes included) capped, both in proportion
+// to how far into that band the coil is, so sustained playing settles below
+// the limit with a softer hold instead of overheating the coil.
+#define THERMAL_DERATE_START_C 90
+#define THERMAL_LIMIT_C 130            // Class B coil insulation
+#define THERMAL_HOLD_MIN_SCALE 128     // Held duty at the limit, in 256ths (50%)
+#define THERMAL_STRIKE_MIN_CAP 60      // Duty cap at the limit, percent
+
+// Per-key thermal state
+typedef struct
+{
+  uint32_t heat;    // Squared duty summed since the last update (Q16 per sample)
+  int32_t rise_q16; // Temperature rise above ambient, Q16 degrees C
+} ThermalKey_t;
+
+// Function prototypes
+void ThermalModel_Init(KeyDriverModule_t *key_driver);
+void ThermalModel_Sample(void);
+uint16_t ThermalModel_GetTemperature(uint8_t key);
+uint16_t ThermalModel_GetMaxTemperature(void);
+
+#endif // THERMAL_MODEL_H
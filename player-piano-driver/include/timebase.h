@@ -0,0 +1,25 @@
+#ifndef TIMEBASE_H
+#define TIMEBASE_H
+
+#include "stm32f1xx_hal.h"
+
+// Free-running microsecond timebase on TIM1 (TIM2-4 are used for PWM).
+// The 16-bit counter ticks at 1 MHz and is extended to 32 bits in the
+// update interrupt, so timestamps wrap every ~71 minutes.
+#define TIMEBASE_TIM_INSTANCE TIM1
+#define TIMEBASE_TICK_HZ 1000000
+
+// Function prototypes
+void Timebase_Init(void);
+uint32_t Timebase_Micros(void);
+
+// CPU cycle counter (DWT), for profiling interrupt and main loop stages
+#define TIMEBASE_CYCLES() (DWT->CYCCNT)
+
+// Wrap-safe comparison: non-zero once time 'now' has reached 'deadline'
+#define TIMEBASE_REACHED(now, deadline) ((int32_t)((now) - (deadline)) >= 0)
+
+// External timer handle
+extern TIM_HandleTypeDef htim1;
+
+#endif // TIMEBASE_H
@@ -0,0 +1,68 @@
+#include "board_config.h"
+#include "flash_storage.h"
+#include <string.h>
+
+// Active board configuration
+static BoardConfig_t g_board_config;
+
+/**
+ * @brief Load board configuration from flash
+ *
+ * A blank or corrupt page is provisioned with the build-time defaults so the
+ * address survives later firmware updates built without per-board flags.
+ * Define BOARD_CONFIG_PROVISION to force the build-time values into flash;
+ * the page is only rewritten when the stored record differs from them, so
+ * booting such a build again does not wear the flash.
+ */
+void BoardConfig_Init(void)
+{
+  uint8_t loaded = FlashStorage_Load(FLASH_STORAGE_BOARD_CONFIG_PAGE, BOARD_CONFIG_TAG,
+                                     &g_board_config, sizeof(g_board_config)) == HAL_OK &&
+                   g_board_config.unit_address <= RS485_UNIT_ADDRESS_MAX &&
+                   g_board_config.input_mode <= BOARD_INPUT_MIDI;
+
+  BoardConfig_t defaults = {0};
+  defaults.unit_address = BOARD_UNIT_ADDRESS;
+  defaults.input_mode = BOARD_INPUT_MODE;
+  defaults.group_mask = BOARD_GROUP_MASK;
+
+#ifdef BOARD_CONFIG_PROVISION
+  if (loaded && memcmp(&g_board_config, &defaults, sizeof(defaults)) == 0)
+  {
+    return;
+  }
+#else
+  if (loaded)
+  {
+    return;
+  }
+#endif
+
+  BoardConfig_Save(&defaults);
+}
+
+/**
+ * @brief Store a new board configuration in flash and make it active
+ * @param config: Configuration to store
+ * @return HAL status
+ */
+HAL_StatusTypeDef BoardConfig_Save(const BoardConfig_t *config)
+{
+  if (config == NULL || config->unit_address > RS485_UNIT_ADDRESS_MAX || config->input_mode > BOARD_INPUT_MIDI)
+  {
+    return HAL_ERROR;
+  }
+
+  g_board_config = *config;
+  return FlashStorage_Save(FLASH_STORAGE_BOARD_CONFIG_PAGE, BOARD_CONFIG_TAG,
+                           &g_board_config, sizeof(g_board_config));
+}
+
+/**
+ * @brief Get the active board configuration
+ * @return Pointer to board configuration
+ */
+const BoardConfig_t *BoardConfig_Get(void)
+{
+  return &g_board_config;
+}
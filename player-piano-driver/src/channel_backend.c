@@ -0,0 +1,103 @@
+#include "channel_backend.h"
+#include "pwm_expander.h"
+
+#if NUM_KEYS > PWM_NUM_CHANNELS && !PWM_EXPANDER_ENABLE
+#error "NUM_KEYS is more than the timer outputs; add driver boards, or accept the expander's limits with PWM_EXPANDER_ENABLE (see pwm_expander.h)"
+#endif
+#if NUM_KEYS > PWM_NUM_CHANNELS + PWM_EXPANDER_MAX_CHIPS * PWM_EXPANDER_CHANNELS_PER_CHIP
+#error "NUM_KEYS is more than the timers and PWM_EXPANDER_MAX_CHIPS expanders can drive"
+#endif
+
+// Backends in key order: the timer outputs first, then the expander chain
+static const ChannelBackend_t g_backends[] = {
+    {.init = PWM_Init, .start = PWM_Start, .set_duty = PWM_SetDuty, .commit = PWM_Commit, .channel_count = PWM_NUM_CHANNELS},
+#if PWM_EXPANDER_CHIPS > 0
+    {.init = PwmExpander_Init, .start = PwmExpander_Start, .set_duty = PwmExpander_SetDuty, .commit = PwmExpander_Commit, .channel_count = PWM_EXPANDER_CHANNELS},
+#endif
+};
+
+#define CHANNEL_NUM_BACKENDS (sizeof(g_backends) / sizeof(g_backends[0]))
+
+// Set while the main loop has staged duties it has not committed yet
+static volatile uint8_t g_batch_open = 0;
+
+/**
+ * @brief Set up every backend's outputs, all off
+ */
+void Channel_Init(void)
+{
+  for (uint8_t i = 0; i < CHANNEL_NUM_BACKENDS; i++)
+  {
+    g_backends[i].init();
+  }
+}
+
+/**
+ * @brief Start every backend's outputs
+ */
+void Channel_Start(void)
+{
+  for (uint8_t i = 0; i < CHANNEL_NUM_BACKENDS; i++)
+  {
+    g_backends[i].start();
+  }
+}
+
+/**
+ * @brief Stage a key's output duty for the next commit
+ * @param key: Key index, 0 to NUM_KEYS - 1
+ * @param duty: Output duty, PWM_DUTY_MAX = full
+ */
+void Channel_SetDuty(uint8_t key, uint16_t duty)
+{
+  if (key >= NUM_KEYS)
+  {
+    return;
+  }
+
+  // Set before staging, so an interrupt's commit never sees half a batch
+  if (__get_IPSR() == 0)
+  {
+    g_batch_open = 1;
+  }
+
+  for (uint8_t i = 0; i < CHANNEL_NUM_BACKENDS; i++)
+  {
+    if (key < g_backends[i].channel_count)
+    {
+      g_backends[i].set_duty(key, duty);
+      return;
+    }
+    key -= g_backends[i].channel_count;
+  }
+}
+
+/**
+ * @brief Send every staged duty out; safe from the main loop and interrupts
+ *
+ * From the main loop this also closes its batch, so the commits interrupts
+ * have left waiting go out with it.
+ */
+void Channel_Commit(void)
+{
+  if (__get_IPSR() == 0)
+  {
+    g_batch_open = 0;
+  }
+
+  for (uint8_t i = 0; i < CHANNEL_NUM_BACKENDS; i++)
+  {
+    g_backends[i].commit();
+  }
+}
+
+/**
+ * @brief Whether the main loop is part way through staging a batch
+ *
+ * A backend must not take its snapshot of the staged duties meanwhile: the
+ * batch would reach the outputs half old and half new.
+ */
+uint8_t Channel_BatchOpen(void)
+{
+  return g_batch_open;
+}
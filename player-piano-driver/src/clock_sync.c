@@ -0,0 +1,110 @@
+#include "clock_sync.h"
+
+// Global clock sync state
+static ClockSync_t g_clock_sync;
+
+// Restart the estimate from a single beacon
+static void ClockSync_Reset(uint32_t master_time, uint32_t local_time)
+{
+  g_clock_sync.ref_local = local_time;
+  g_clock_sync.ref_master = master_time;
+  g_clock_sync.drift = 0;
+  g_clock_sync.last_error = 0;
+  g_clock_sync.beacons = 1;
+  g_clock_sync.synced = 1;
+}
+
+/**
+ * @brief Initialize clock sync (unsynchronised until the first beacon)
+ */
+void ClockSync_Init(void)
+{
+  g_clock_sync.ref_local = 0;
+  g_clock_sync.ref_master = 0;
+  g_clock_sync.drift = 0;
+  g_clock_sync.last_error = 0;
+  g_clock_sync.beacons = 0;
+  g_clock_sync.resyncs = 0;
+  g_clock_sync.synced = 0;
+}
+
+/**
+ * @brief Feed a sync beacon into the offset and drift estimate
+ * @param master_time: Master clock time carried by the beacon
+ * @param local_time: Local time at which the beacon started on the wire
+ */
+void ClockSync_OnBeacon(uint32_t master_time, uint32_t local_time)
+{
+  if (!ClockSync_IsSynced(local_time))
+  {
+    ClockSync_Reset(master_time, local_time);
+    return;
+  }
+
+  int32_t local_delta = (int32_t)(local_time - g_clock_sync.ref_local);
+  int32_t master_delta = (int32_t)(master_time - g_clock_sync.ref_master);
+
+  // Compare the beacon against where the current estimate puts the master clock
+  int32_t predicted = local_delta + (int32_t)(((int64_t)local_delta * g_clock_sync.drift) >> CLOCK_SYNC_DRIFT_SHIFT);
+  int32_t error = master_delta - predicted;
+
+  if (error > CLOCK_SYNC_MAX_ERROR_US || error < -CLOCK_SYNC_MAX_ERROR_US)
+  {
+    // Master restarted or a beacon was corrupted - start over
+    g_clock_sync.resyncs++;
+    ClockSync_Reset(master_time, local_time);
+    return;
+  }
+
+  // Drift measured over this beacon interval, smoothed to reject timestamp jitter
+  if (local_delta > 0)
+  {
+    int32_t measured = (int32_t)(((int64_t)(master_delta - local_delta) << CLOCK_SYNC_DRIFT_SHIFT) / local_delta);
+    g_clock_sync.drift += (measured - g_clock_sync.drift) >> CLOCK_SYNC_DRIFT_SMOOTHING;
+  }
+
+  // Re-anchor the offset on this beacon
+  g_clock_sync.ref_local = local_time;
+  g_clock_sync.ref_master = master_time;
+  g_clock_sync.last_error = error;
+  g_clock_sync.beacons++;
+}
+
+/**
+ * @brief Check whether the local clock is synchronised to the master
+ * @param local_now: Current local time
+ * @return 1 if a recent beacon has been accepted, 0 otherwise
+ */
+uint8_t ClockSync_IsSynced(uint32_t local_now)
+{
+  return g_clock_sync.synced && (local_now - g_clock_sync.ref_local) < CLOCK_SYNC_TIMEOUT_US;
+}
+
+/**
+ * @brief Convert a master clock time to the local timebase
+ * @param master_time: Time on the master clock
+ * @param local_time: Receives the corresponding local time
+ * @return HAL_OK on success, HAL_ERROR if not synchronised
+ */
+HAL_StatusTypeDef ClockSync_MasterToLocal(uint32_t master_time, uint32_t *local_time)
+{
+  if (!g_clock_sync.synced || local_time == NULL)
+  {
+    return HAL_ERROR;
+  }
+
+  int32_t master_delta = (int32_t)(master_time - g_clock_sync.ref_master);
+  int32_t correction = (int32_t)(((int64_t)master_delta * g_clock_sync.drift) >> CLOCK_SYNC_DRIFT_SHIFT);
+
+  *local_time = g_clock_sync.ref_local + master_delta - correction;
+  return HAL_OK;
+}
+
+/**
+ * @brief Get clock sync state (for diagnostics)
+ * @return Pointer to clock sync state
+ */
+const ClockSync_t *ClockSync_Get(void)
+{
+  return &g_clock_sync;
+}
@@ -1,168 +1,870 @@
 #include "command_parser.h"
 #include "rs485.h"
 #include "stepper_motor.h"
+#include "timebase.h"
+#include "clock_sync.h"
+#include "board_config.h"
+#include "thermal_model.h"
+#include "key_calibration.h"
 #include <string.h>
 #include <stdio.h>
-#include <ctype.h>
 
-// Global command queue
+#if !SPSC_RING_IS_POWER_OF_TWO(COMMAND_QUEUE_SIZE) || COMMAND_QUEUE_SIZE > 32
+#error "COMMAND_QUEUE_SIZE must be a power of two no larger than 32"
+#endif
+#if !SPSC_RING_IS_POWER_OF_TWO(COMMAND_PEDAL_QUEUE_SIZE) || COMMAND_PEDAL_QUEUE_SIZE > COMMAND_QUEUE_SIZE
+#error "COMMAND_PEDAL_QUEUE_SIZE must be a power of two no larger than COMMAND_QUEUE_SIZE"
+#endif
+
+// Global command queues: key commands, and the pedal lane
 static CommandQueue_t g_command_queue;
+static CommandQueue_t g_pedal_queue;
+
+// Running status for compact frames
+static RunningStatus_t g_running_status;
+
+// Key driver that settings frames apply to
+static KeyDriverModule_t *g_parser_key_driver = NULL;
+
+// Tables marked for saving to flash, by bit, and saves that had to wait
+#define COMMAND_SAVE_PROFILES 0x01
+#define COMMAND_SAVE_CALIBRATION 0x02
+static uint8_t g_pending_saves = 0;
+static uint32_t g_deferred_saves = 0;
 
 // External stepper motor instance
 extern StepperMotor_t g_stepper_motor;
 
 // No note mapping needed for direct channel/duty cycle format
 
-HAL_StatusTypeDef CommandParser_ParseMessage(const char *message, uint16_t length, ParsedCommand_t *command)
+/**
+ * @brief Remember a full-format P/R command as the reference for compact frames
+ * @param command: Successfully parsed full-format command
+ */
+static void CommandParser_RecordKeyframe(const ParsedCommand_t *command)
 {
-  // Expected formats:
-  // "P:0:100" - channel 0, duty cycle 100, default timing
-  // "P:0:100:50" - channel 0, duty cycle 100, initial strike time 50ms
-  // "P:0:100:50:80:100" - channel 0, duty cycle 100, initial strike 50ms, follow-up duty 80, follow-up time 100ms
-  // "P:0:100:50:80:100:30" - channel 0, duty cycle 100, initial strike 50ms, follow-up duty 80, follow-up time 100ms, hold duty 30
-  // "R:0:0" - release channel 0
-  // "P:P" - press pedal
-  // "R:P" - release pedal
-  if (message == NULL || command == NULL || length < 3) // Minimum length for "P:P"
+  g_running_status.opcode = command->type;
+  g_running_status.opcode_valid = 1;
+
+  if (command->type == COMMAND_PRESS && command->channel < NUM_KEYS)
+  {
+    ChannelReference_t *reference = &g_running_status.channels[command->channel];
+    reference->params[0] = command->duty_cycle;
+    reference->params[1] = command->initial_strike_time;
+    reference->params[2] = command->followup_duty_cycle;
+    reference->params[3] = command->followup_time;
+    reference->params[4] = command->hold_duty_cycle;
+    reference->profile = command->profile;
+    reference->valid = 1;
+  }
+}
+
+/**
+ * @brief Start tokenizing a new frame
+ * @param tokenizer: Tokenizer state
+ */
+void CommandTokenizer_Reset(CommandTokenizer_t *tokenizer)
+{
+  if (tokenizer == NULL)
+  {
+    return;
+  }
+
+  tokenizer->state = TOKEN_STATE_START;
+  tokenizer->opcode = 0;
+  tokenizer->special = 0;
+  tokenizer->field_count = 0;
+  tokenizer->present_mask = 0;
+  tokenizer->digits = 0;
+  tokenizer->value = 0;
+  tokenizer->is_timed = 0;
+}
+
+/**
+ * @brief Tokenize the next piece of a frame
+ *
+ * Every character is looked at exactly once, so a frame can be fed in any
+ * number of pieces as it arrives. Numbers are converted on the fly and each
+ * field is stored at its position in the frame; interpretation is left to
+ * CommandParser_ParseTokens. The state lives in locals for the length of the
+ * piece, since every character store could otherwise alias it.
+ * @param tokenizer: Tokenizer state
+ * @param data: Next characters of the frame
+ * @param length: Number of characters
+ */
+void CommandTokenizer_Feed(CommandTokenizer_t *tokenizer, const char *data, uint16_t length)
+{
+  if (tokenizer == NULL || data == NULL)
+  {
+    return;
+  }
+
+  TokenState_t state = tokenizer->state;
+  uint32_t value = tokenizer->value;
+  uint8_t digits = tokenizer->digits;
+  uint8_t field = tokenizer->field_count;
+  const char *end = data + length;
+
+  while (data != end && state != TOKEN_STATE_ERROR)
+  {
+    char c = *data++;
+    uint32_t digit = (uint32_t)(c - '0');
+
+    if (digit <= 9)
+    {
+      // Digits continue or start a number in every state that takes one
+      if (state == TOKEN_STATE_START || state == TOKEN_STATE_FIRST_FIELD || state == TOKEN_STATE_FIELD)
+      {
+        if (state == TOKEN_STATE_START)
+        {
+          tokenizer->separators[0] = 0; // Compact frame: the channel has no separator
+        }
+        state = TOKEN_STATE_NUMBER;
+      }
+      else if (state == TOKEN_STATE_TIME)
+      {
+        tokenizer->is_timed = 1;
+        state = TOKEN_STATE_TIME_DIGITS;
+      }
+      else if (state != TOKEN_STATE_NUMBER && state != TOKEN_STATE_TIME_DIGITS)
+      {
+        state = TOKEN_STATE_ERROR;
+        break;
+      }
+
+      // Ten digits can overflow 32 bits, fewer never can
+      if (digits >= 9 && value > (0xFFFFFFFFu - digit) / 10u)
+      {
+        state = TOKEN_STATE_ERROR;
+        break;
+      }
+      value = value * 10u + digit;
+      digits++;
+      continue;
+    }
+
+    switch (state)
+    {
+    case TOKEN_STATE_START:
+      if (c == 'P' || c == 'R' || c == 'N' || c == 'T' || c == 'V' || c == 'U' || c == 'S' || c == 'C' ||
+          c == 'E' || c == 'G' || c == 'D' || c == 'K')
+      {
+        tokenizer->opcode = c;
+        state = TOKEN_STATE_OPCODE;
+      }
+      else
+      {
+        state = TOKEN_STATE_ERROR;
+      }
+      break;
+
+    case TOKEN_STATE_OPCODE:
+      tokenizer->separators[0] = ':';
+      state = (c == ':') ? TOKEN_STATE_FIRST_FIELD : TOKEN_STATE_ERROR;
+      break;
+
+    case TOKEN_STATE_FIRST_FIELD:
+      if (c == 'P' || c == 'A' || c == 'W' || c == '?')
+      {
+        // "P:P", "R:P", "R:A", "E:W", "K:W", "C:?"
+        tokenizer->special = c;
+        state = TOKEN_STATE_SPECIAL;
+        break;
+      }
+      // fall through
+    case TOKEN_STATE_FIELD:
+    case TOKEN_STATE_NUMBER:
+      if (c != ':' && c != '+' && c != '-' && c != '@')
+      {
+        state = TOKEN_STATE_ERROR;
+        break;
+      }
+
+      // Close the field; separators open the next one, '@' starts the time
+      tokenizer->values[field] = value;
+      if (digits > 0)
+      {
+        tokenizer->present_mask |= (1u << field);
+      }
+      field++;
+      value = 0;
+      digits = 0;
+
+      if (c == '@')
+      {
+        state = TOKEN_STATE_TIME;
+      }
+      else if (field >= COMMAND_MAX_FIELDS)
+      {
+        state = TOKEN_STATE_ERROR;
+      }
+      else
+      {
+        tokenizer->separators[field] = c;
+        state = TOKEN_STATE_FIELD;
+      }
+      break;
+
+    case TOKEN_STATE_SPECIAL:
+      state = (c == '@') ? TOKEN_STATE_TIME : TOKEN_STATE_ERROR;
+      break;
+
+    default:
+      state = TOKEN_STATE_ERROR;
+      break;
+    }
+  }
+
+  tokenizer->state = state;
+  tokenizer->value = value;
+  tokenizer->digits = digits;
+  tokenizer->field_count = field;
+}
+
+/**
+ * @brief Check that fields [first, first + count) are all present and ':'-separated
+ * @param tokenizer: Finished tokenizer
+ * @return 1 if they are, 0 if not
+ */
+static uint8_t CommandTokenizer_FieldsAbsolute(const CommandTokenizer_t *tokenizer, uint8_t first, uint8_t count)
+{
+  for (uint8_t field = first; field < first + count; field++)
+  {
+    if (tokenizer->separators[field] != ':' || !(tokenizer->present_mask & (1u << field)))
+    {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * @brief Fill in a command from resolved press/release parameters
+ * @param params: Duty, strike time, follow-up duty, follow-up time, hold duty
+ * @param command: Command to fill in
+ * @return HAL_OK, or HAL_ERROR if a parameter is out of range
+ */
+static HAL_StatusTypeDef CommandParser_SetParams(const int32_t *params, ParsedCommand_t *command)
+{
+  if (params[0] < 0 || params[0] > 100 || params[2] < 0 || params[2] > 100 ||
+      params[4] < 0 || params[4] > 100 || params[1] < 0 || params[1] > 0xFFFF ||
+      params[3] < 0 || params[3] > 0xFFFF)
   {
     return HAL_ERROR;
   }
 
-  // Initialize command with defaults
-  command->initial_strike_time = 0; // 0 means use default
-  command->followup_duty_cycle = 0; // 0 means no follow-up
-  command->followup_time = 0;       // 0 means no follow-up
-  command->hold_duty_cycle = 0;     // 0 means use default
+  command->duty_cycle = params[0];
+  command->initial_strike_time = params[1];
+  command->followup_duty_cycle = params[2];
+  command->followup_time = params[3];
+  command->hold_duty_cycle = params[4];
+  return HAL_OK;
+}
 
-  // Parse command type (P or R)
-  if (message[0] == 'P')
+/**
+ * @brief Interpret a compact (running status) frame
+ *
+ * Format: "<channel>[<field>...]", where each field is ":n" (absolute), "+n"
+ * or "-n" (delta from the channel's last full press) or ":" (unchanged), in
+ * full-format parameter order. Omitted trailing fields are unchanged. Under a
+ * running press a resolved duty of 0 is a release, as with MIDI note-on
+ * velocity 0. Under a running release only "<channel>:0" is taken: any other
+ * frame is a press sent under a press keyframe that was lost, and running it
+ * as a release would cut the note. The execute-at time is relative to the
+ * frame start.
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command with the execute-at fields already filled in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseCompact(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (!g_running_status.opcode_valid)
   {
-    command->type = COMMAND_PRESS;
+    return HAL_ERROR; // No keyframe yet
   }
-  else if (message[0] == 'R')
+
+  if (tokenizer->values[0] >= NUM_KEYS)
+  {
+    return HAL_ERROR;
+  }
+
+  command->channel = tokenizer->values[0];
+
+  // Time is relative to the frame start, so it needs no clock sync
+  if (command->is_timed)
   {
+    if (command->execute_at > CLOCK_SYNC_MAX_PLAYOUT_US / COMMAND_COMPACT_TIME_UNIT_US)
+    {
+      return HAL_ERROR;
+    }
+    command->is_relative = 1;
+    command->execute_at *= COMMAND_COMPACT_TIME_UNIT_US;
+  }
+
+  if (g_running_status.opcode == COMMAND_RELEASE)
+  {
+    // Running release: an explicit duty of 0 and nothing else
+    if (tokenizer->field_count != 2 || tokenizer->separators[1] != ':' ||
+        !(tokenizer->present_mask & (1u << 1)) || tokenizer->values[1] != 0)
+    {
+      return HAL_ERROR;
+    }
     command->type = COMMAND_RELEASE;
+    command->duty_cycle = 0;
+    return HAL_OK;
   }
-  else
+
+  const ChannelReference_t *reference = &g_running_status.channels[command->channel];
+  if (!reference->valid)
   {
-    return HAL_ERROR; // Invalid command type
+    return HAL_ERROR; // Deltas need a full press on this channel first
   }
 
-  // Check for colon separator
-  if (message[1] != ':')
+  // Apply fields on top of the reference
+  int32_t params[COMMAND_NUM_PARAMS];
+  for (uint8_t p = 0; p < COMMAND_NUM_PARAMS; p++)
   {
-    return HAL_ERROR;
+    params[p] = reference->params[p];
   }
 
-  // Check for pedal commands "P:P" or "R:P"
-  if (length == 3 && message[2] == 'P')
+  for (uint8_t field = 1; field < tokenizer->field_count; field++)
   {
-    if (command->type == COMMAND_PRESS)
+    uint8_t present = (tokenizer->present_mask & (1u << field)) != 0;
+    int32_t value = (int32_t)tokenizer->values[field];
+    char separator = tokenizer->separators[field];
+
+    if (separator == ':')
+    {
+      if (present)
+      {
+        params[field - 1] = value;
+      }
+    }
+    else if (!present || tokenizer->values[field] > 0xFFFF)
     {
-      command->type = COMMAND_PEDAL_PRESS;
+      return HAL_ERROR; // Delta without a value, or one no parameter could take
     }
     else
     {
-      command->type = COMMAND_PEDAL_RELEASE;
+      params[field - 1] += (separator == '+') ? value : -value;
     }
-    return HAL_OK;
   }
 
-  // Parse channel (0-11)
-  int i = 2;
-  int channel = 0;
-  while (i < length && isdigit(message[i]))
+  if (CommandParser_SetParams(params, command) != HAL_OK)
   {
-    channel = channel * 10 + (message[i] - '0');
-    i++;
+    return HAL_ERROR;
   }
 
-  // Validate channel range
-  if (channel < 0 || channel > 11)
+  // A profile press stays one as long as only its duty cycle is changed
+  if (!(tokenizer->present_mask & ~0x3u))
+  {
+    command->profile = reference->profile;
+  }
+
+  command->type = (params[0] == 0) ? COMMAND_RELEASE : COMMAND_PRESS;
+  return HAL_OK;
+}
+
+/**
+ * @brief Interpret an envelope profile upload or save
+ *
+ * Format: "E:<id>:<duty>:<strike>:<fduty>:<ftime>:<hold>", all six fields
+ * given, or "E:W" to store the table in flash. Neither may be timed.
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command to fill in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseProfileUpload(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (command->is_timed)
   {
     return HAL_ERROR;
   }
 
-  command->channel = channel;
+  if (tokenizer->special == 'W')
+  {
+    command->type = COMMAND_PROFILE_SAVE;
+    return HAL_OK;
+  }
 
-  // Check for second colon separator
-  if (i >= length || message[i] != ':')
+  if (tokenizer->special != 0 || tokenizer->field_count != COMMAND_MAX_FIELDS ||
+      !CommandTokenizer_FieldsAbsolute(tokenizer, 0, COMMAND_MAX_FIELDS) ||
+      tokenizer->values[0] >= ENVELOPE_PROFILE_COUNT)
   {
     return HAL_ERROR;
   }
 
-  // Parse initial duty cycle
-  i++; // Skip the colon
-  int duty_cycle = 0;
-  while (i < length && isdigit(message[i]))
+  int32_t params[COMMAND_NUM_PARAMS];
+  for (uint8_t field = 1; field < COMMAND_MAX_FIELDS; field++)
+  {
+    if (tokenizer->values[field] > 0xFFFF)
+    {
+      return HAL_ERROR;
+    }
+    params[field - 1] = (int32_t)tokenizer->values[field];
+  }
+
+  command->type = COMMAND_PROFILE_SET;
+  command->channel = tokenizer->values[0];
+  return CommandParser_SetParams(params, command);
+}
+
+/**
+ * @brief Interpret an envelope profile segment upload
+ *
+ * Format: "G:<id>:<segment>:<duty>:<ramp>:<ms>", all fields given, never
+ * timed. Ramp is 0 (step), 1 (linear) or 2 (exponential).
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command to fill in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseProfileSegment(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (command->is_timed || tokenizer->special != 0 || tokenizer->field_count != 5 ||
+      !CommandTokenizer_FieldsAbsolute(tokenizer, 0, 5) || tokenizer->values[0] >= ENVELOPE_PROFILE_COUNT ||
+      tokenizer->values[1] >= KEY_MAX_SEGMENTS || tokenizer->values[2] > 100 ||
+      tokenizer->values[3] > KEY_RAMP_EXPONENTIAL || tokenizer->values[4] > 0xFFFF)
   {
-    duty_cycle = duty_cycle * 10 + (message[i] - '0');
-    i++;
+    return HAL_ERROR;
   }
 
-  // Validate duty cycle range
-  if (duty_cycle < 0 || duty_cycle > 100)
+  command->type = COMMAND_PROFILE_SEGMENT;
+  command->channel = tokenizer->values[0];
+  command->segment = tokenizer->values[1];
+  command->duty_cycle = tokenizer->values[2];
+  command->ramp = tokenizer->values[3];
+  command->initial_strike_time = tokenizer->values[4];
+  return HAL_OK;
+}
+
+/**
+ * @brief Interpret a release ramp setting
+ *
+ * Format: "D:<channel>:<ramp>:<ms>", applied as soon as it arrives.
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command with the execute-at fields already filled in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseReleaseSet(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (command->is_timed || tokenizer->special != 0 || tokenizer->field_count != 3 ||
+      !CommandTokenizer_FieldsAbsolute(tokenizer, 0, 3) || tokenizer->values[0] >= NUM_KEYS ||
+      tokenizer->values[1] > KEY_RAMP_EXPONENTIAL || tokenizer->values[2] > 0xFFFF)
   {
     return HAL_ERROR;
   }
 
-  command->duty_cycle = duty_cycle;
+  command->type = COMMAND_RELEASE_SET;
+  command->channel = tokenizer->values[0];
+  command->ramp = tokenizer->values[1];
+  command->initial_strike_time = tokenizer->values[2];
+  return HAL_OK;
+}
+
+/**
+ * @brief Interpret a key calibration update or save
+ *
+ * Format: "K:<channel>:<point>:<duty>" for a velocity curve point,
+ * "K:<channel>:<min strike>:<hold>:<latency us>" for the key's limits, or
+ * "K:W" to store the table in flash. None may be timed.
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command to fill in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseCalibration(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (command->is_timed)
+  {
+    return HAL_ERROR;
+  }
 
-  // For release commands, we're done
-  if (command->type == COMMAND_RELEASE)
+  if (tokenizer->special == 'W')
   {
+    command->type = COMMAND_CALIBRATION_SAVE;
     return HAL_OK;
   }
 
-  // Parse optional parameters for press commands
-  while (i < length && message[i] == ':')
+  uint8_t fields = tokenizer->field_count;
+  if (tokenizer->special != 0 || (fields != 3 && fields != 4) ||
+      !CommandTokenizer_FieldsAbsolute(tokenizer, 0, fields) || tokenizer->values[0] >= NUM_KEYS)
   {
-    i++; // Skip the colon
+    return HAL_ERROR;
+  }
 
-    // Parse next parameter
-    int param_value = 0;
-    while (i < length && isdigit(message[i]))
+  command->channel = tokenizer->values[0];
+  if (fields == 3)
+  {
+    if (tokenizer->values[1] >= KEY_CALIBRATION_POINTS || tokenizer->values[2] > 100)
     {
-      param_value = param_value * 10 + (message[i] - '0');
-      i++;
+      return HAL_ERROR;
     }
+    command->type = COMMAND_CALIBRATION_POINT;
+    command->segment = tokenizer->values[1];
+    command->duty_cycle = tokenizer->values[2];
+    return HAL_OK;
+  }
 
-    // Determine which parameter this is based on current state
-    if (command->initial_strike_time == 0) // First optional parameter
-    {
-      command->initial_strike_time = param_value;
-    }
-    else if (command->followup_duty_cycle == 0) // Second optional parameter
+  if (tokenizer->values[1] > 100 || tokenizer->values[2] > 100 ||
+      tokenizer->values[3] > KEY_CALIBRATION_MAX_LATENCY_US)
+  {
+    return HAL_ERROR;
+  }
+  command->type = COMMAND_CALIBRATION_LIMITS;
+  command->duty_cycle = tokenizer->values[1];
+  command->hold_duty_cycle = tokenizer->values[2];
+  command->initial_strike_time = tokenizer->values[3];
+  return HAL_OK;
+}
+
+/**
+ * @brief Turn a MIDI velocity into a press with the key's calibrated force
+ *
+ * The strike duty comes from the key's velocity curve and the hold from its
+ * calibrated hold duty. The envelope is the uploaded profile for the
+ * velocity (one per four velocities, as the main controller assigns them)
+ * when there is one, with its first segment at the calibrated duty, and a
+ * plain press otherwise.
+ * @param command: Command with the channel set
+ * @param velocity: MIDI velocity 1-127
+ */
+void CommandParser_VelocityPress(ParsedCommand_t *command, uint8_t velocity)
+{
+  uint8_t id = (velocity >> 2) % ENVELOPE_PROFILE_COUNT;
+  const KeyCalibration_t *calibration = KeyCalibration_Get(command->channel);
+
+  command->type = COMMAND_PRESS;
+  command->profile = (EnvelopeProfile_Get(id) != NULL) ? id : COMMAND_NO_PROFILE;
+  command->duty_cycle = KeyCalibration_StrikeDuty(command->channel, velocity);
+  command->hold_duty_cycle = (calibration != NULL) ? calibration->hold_duty : 0;
+}
+
+/**
+ * @brief Interpret a press or re-strike by MIDI velocity
+ *
+ * Format: "V:<channel>:<velocity>", or "U:<channel>:<velocity>" to re-strike
+ * a key that may still be down; see CommandParser_VelocityPress. A "V" with
+ * velocity 0 is a release, as with MIDI note-on. Either becomes the
+ * channel's reference for compact frames like a full-format command.
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command with the execute-at fields already filled in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseVelocityPress(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (tokenizer->special != 0 || tokenizer->field_count != 2 ||
+      !CommandTokenizer_FieldsAbsolute(tokenizer, 0, 2) || tokenizer->values[0] >= NUM_KEYS ||
+      tokenizer->values[1] > 127 || (tokenizer->opcode == 'U' && tokenizer->values[1] == 0))
+  {
+    return HAL_ERROR;
+  }
+
+  command->channel = tokenizer->values[0];
+  if (tokenizer->values[1] == 0)
+  {
+    command->type = COMMAND_RELEASE;
+  }
+  else
+  {
+    CommandParser_VelocityPress(command, tokenizer->values[1]);
+  }
+
+  CommandParser_RecordKeyframe(command);
+  if (tokenizer->opcode == 'U')
+  {
+    command->type = COMMAND_RESTRIKE;
+  }
+  return HAL_OK;
+}
+
+/**
+ * @brief Interpret a press or re-strike by envelope profile
+ *
+ * Format: "N:<channel>:<profile id>", or "T:<channel>:<profile id>" to
+ * re-strike a key that may still be down. The profile's segments are looked
+ * up when the press runs, which is what keeps queue entries small; a profile
+ * only changes as a whole, once its upload is complete, so the press gets
+ * either the old or the new envelope. A profile this board does not hold
+ * (lost upload, or a reset without a saved table) still plays the note, as a
+ * plain press at the duty the key's velocity curve gives the profile's
+ * velocities, which is the main controller's default table; the credit reply
+ * then tells the main controller to re-send it. Either becomes the channel's
+ * reference for compact frames like a full-format press, with the first
+ * segment's duty cycle as the reference duty.
+ * @param tokenizer: Finished tokenizer
+ * @param command: Command with the execute-at fields already filled in
+ * @return HAL status
+ */
+static HAL_StatusTypeDef CommandParser_ParseProfilePress(const CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (tokenizer->special != 0 || tokenizer->field_count != 2 ||
+      !CommandTokenizer_FieldsAbsolute(tokenizer, 0, 2) || tokenizer->values[0] >= NUM_KEYS ||
+      tokenizer->values[1] >= ENVELOPE_PROFILE_COUNT)
+  {
+    return HAL_ERROR;
+  }
+
+  const EnvelopeProfile_t *profile = EnvelopeProfile_Get(tokenizer->values[1]);
+
+  command->type = COMMAND_PRESS;
+  command->channel = tokenizer->values[0];
+  if (profile != NULL)
+  {
+    command->profile = tokenizer->values[1];
+    command->duty_cycle = profile->segments[0].duty_cycle;
+  }
+  else
+  {
+    // Profile n covers velocities 4n to 4n+3
+    command->duty_cycle = KeyCalibration_StrikeDuty(command->channel, (uint8_t)(tokenizer->values[1] * 4 + 2));
+  }
+
+  CommandParser_RecordKeyframe(command);
+  if (tokenizer->opcode == 'T')
+  {
+    command->type = COMMAND_RESTRIKE;
+  }
+  return HAL_OK;
+}
+
+/**
+ * @brief Turn a finished tokenizer into a command
+ * @param tokenizer: Tokenizer that has been fed the whole frame
+ * @param command: Pointer to store the command
+ * @return HAL status
+ */
+HAL_StatusTypeDef CommandParser_ParseTokens(CommandTokenizer_t *tokenizer, ParsedCommand_t *command)
+{
+  if (tokenizer == NULL || command == NULL)
+  {
+    return HAL_ERROR;
+  }
+
+  // Close the last field; a frame cannot end right after its opcode or '@'
+  switch (tokenizer->state)
+  {
+  case TOKEN_STATE_FIELD:
+  case TOKEN_STATE_NUMBER:
+    tokenizer->values[tokenizer->field_count] = tokenizer->value;
+    if (tokenizer->digits > 0)
     {
-      command->followup_duty_cycle = param_value;
+      tokenizer->present_mask |= (1u << tokenizer->field_count);
     }
-    else if (command->followup_time == 0) // Third optional parameter
+    tokenizer->field_count++;
+    break;
+  case TOKEN_STATE_SPECIAL:
+  case TOKEN_STATE_TIME_DIGITS:
+    break;
+  default:
+    return HAL_ERROR;
+  }
+  tokenizer->state = TOKEN_STATE_ERROR; // Tokenizer must be reset before reuse
+
+  // Initialize command with defaults
+  command->channel = 0;
+  command->duty_cycle = 0;
+  command->initial_strike_time = 0; // 0 means use default
+  command->followup_duty_cycle = 0; // 0 means no follow-up
+  command->followup_time = 0;       // 0 means no follow-up
+  command->hold_duty_cycle = 0;     // 0 means use default
+  command->profile = COMMAND_NO_PROFILE;
+  command->segment = 0;
+  command->ramp = KEY_RAMP_STEP;
+  command->is_timed = tokenizer->is_timed;
+  command->is_relative = 0;
+  command->execute_at = tokenizer->is_timed ? tokenizer->value : 0;
+
+  // Compact frames start with a channel number instead of an opcode
+  if (tokenizer->opcode == 0)
+  {
+    return CommandParser_ParseCompact(tokenizer, command);
+  }
+
+  uint8_t fields = tokenizer->field_count;
+
+  switch (tokenizer->opcode)
+  {
+  case 'S':
+    // Clock sync beacon "S:<time>"
+    if (tokenizer->special != 0 || fields != 1 || command->is_timed || !CommandTokenizer_FieldsAbsolute(tokenizer, 0, 1))
     {
-      command->followup_time = param_value;
+      return HAL_ERROR;
     }
-    else if (command->hold_duty_cycle == 0) // Fourth optional parameter
+    command->type = COMMAND_CLOCK_SYNC;
+    command->execute_at = tokenizer->values[0];
+    return HAL_OK;
+
+  case 'C':
+    // Credit query "C:?"
+    if (tokenizer->special != '?' || command->is_timed)
     {
-      command->hold_duty_cycle = param_value;
+      return HAL_ERROR;
     }
-    else
+    command->type = COMMAND_CREDIT_QUERY;
+    return HAL_OK;
+
+  case 'E':
+    return CommandParser_ParseProfileUpload(tokenizer, command);
+
+  case 'G':
+    return CommandParser_ParseProfileSegment(tokenizer, command);
+
+  case 'D':
+    return CommandParser_ParseReleaseSet(tokenizer, command);
+
+  case 'K':
+    return CommandParser_ParseCalibration(tokenizer, command);
+
+  case 'N':
+  case 'T':
+    return CommandParser_ParseProfilePress(tokenizer, command);
+
+  case 'V':
+  case 'U':
+    return CommandParser_ParseVelocityPress(tokenizer, command);
+
+  case 'P':
+  case 'R':
+    break;
+
+  default:
+    return HAL_ERROR;
+  }
+
+  // Pedal "P:P" / "R:P" and all notes off "R:A"
+  if (tokenizer->special == 'P')
+  {
+    command->type = (tokenizer->opcode == 'P') ? COMMAND_PEDAL_PRESS : COMMAND_PEDAL_RELEASE;
+    return HAL_OK;
+  }
+  if (tokenizer->special == 'A' && tokenizer->opcode == 'R')
+  {
+    command->type = COMMAND_RELEASE_ALL;
+    return HAL_OK;
+  }
+  if (tokenizer->special != 0)
+  {
+    return HAL_ERROR;
+  }
+
+  // Key commands: channel and duty, then for a press up to four more
+  // parameters, each at its own position
+  uint8_t max_fields = (tokenizer->opcode == 'P') ? 2 + COMMAND_NUM_PARAMS - 1 : 2;
+  if (fields < 2 || fields > max_fields || !CommandTokenizer_FieldsAbsolute(tokenizer, 0, fields))
+  {
+    return HAL_ERROR;
+  }
+
+  if (tokenizer->values[0] >= NUM_KEYS)
+  {
+    return HAL_ERROR;
+  }
+  command->channel = tokenizer->values[0];
+  command->type = (tokenizer->opcode == 'P') ? COMMAND_PRESS : COMMAND_RELEASE;
+
+  int32_t params[COMMAND_NUM_PARAMS] = {0};
+  for (uint8_t field = 1; field < fields; field++)
+  {
+    if (tokenizer->values[field] > 0xFFFF)
     {
-      return HAL_ERROR; // Too many parameters
+      return HAL_ERROR;
     }
+    params[field - 1] = (int32_t)tokenizer->values[field];
   }
 
-  // Validate follow-up duty cycle if specified
-  if (command->followup_duty_cycle < 0 || command->followup_duty_cycle > 100)
+  if (CommandParser_SetParams(params, command) != HAL_OK)
   {
     return HAL_ERROR;
   }
 
-  // Validate hold duty cycle if specified
-  if (command->hold_duty_cycle < 0 || command->hold_duty_cycle > 100)
+  CommandParser_RecordKeyframe(command);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef CommandParser_ParseMessage(const char *message, uint16_t length, ParsedCommand_t *command)
+{
+  // Expected formats:
+  // "P:0:100" - channel 0, duty cycle 100, default timing
+  // "P:0:100:50" - channel 0, duty cycle 100, initial strike time 50ms
+  // "P:0:100:50:80:100" - channel 0, duty cycle 100, initial strike 50ms, follow-up duty 80, follow-up time 100ms
+  // "P:0:100:50:80:100:30" - channel 0, duty cycle 100, initial strike 50ms, follow-up duty 80, follow-up time 100ms, hold duty 30
+  // "P:0:100:0:80" - 0 keeps a parameter at its default, later ones still apply
+  // "N:0:12" - channel 0, envelope profile 12
+  // "V:0:100" - channel 0, MIDI velocity 100 through the key's calibration
+  // "K:0:3:72" - channel 0, velocity curve point 3 at duty 72
+  // "K:0:40:25:1500" - channel 0, minimum strike 40, hold 25, latency 1500us
+  // "K:W" - store the calibration table in flash
+  // "E:12:100:50:80:100:30" - upload profile 12 (duty, strike, follow-up duty, follow-up time, hold)
+  // "E:W" - store the profile table in flash
+  // "R:0:0" - release channel 0
+  // "P:P" - press pedal
+  // "R:P" - release pedal
+  // "R:A" - release all keys (all notes off)
+  // "S:123456" - clock sync beacon carrying the master time in us
+  // "C:?" - credit query, answered with
+  //         "C:<unit>:<free slots>:<free pedal slots>:<dropped>:<hottest coil C>:<profile mask, hex>"
+  // Any command may end with "@<time>" to execute at that master time in us,
+  // e.g. "P:0:100@123456" or "R:P@123456"
+  // "3+2@450" - compact frame, see CommandParser_ParseCompact
+  if (message == NULL || command == NULL || length == 0)
   {
     return HAL_ERROR;
   }
 
-  return HAL_OK;
+  CommandTokenizer_t tokenizer;
+  CommandTokenizer_Reset(&tokenizer);
+  CommandTokenizer_Feed(&tokenizer, message, length);
+  return CommandParser_ParseTokens(&tokenizer, command);
+}
+
+/**
+ * @brief Press or re-strike a key with its command's envelope
+ *
+ * A press by profile runs the profile with the first segment at the command's
+ * duty cycle, which compact frames may have changed, and its last segment at
+ * the command's hold duty if it has one (a press by velocity); a profile that
+ * is no longer valid falls back to a plain press at that duty cycle. Other
+ * presses build their segments from the full-format parameters.
+ * @param command: Press or re-strike
+ * @param key_driver: Key driver
+ * @param restrike: 1 to partly release a key that is still down first
+ */
+static void CommandParser_Strike(const ParsedCommand_t *command, KeyDriverModule_t *key_driver, uint8_t restrike)
+{
+  const EnvelopeProfile_t *profile = NULL;
+  KeySegment_t segments[KEY_MAX_SEGMENTS];
+  uint8_t segment_count;
+
+  if (command->profile != COMMAND_NO_PROFILE)
+  {
+    profile = EnvelopeProfile_Get(command->profile);
+  }
+
+  if (profile != NULL)
+  {
+    memcpy(segments, profile->segments, sizeof(segments));
+    segments[0].duty_cycle = command->duty_cycle;
+    segment_count = profile->segment_count;
+    if (command->hold_duty_cycle != 0 && segment_count > 1)
+    {
+      segments[segment_count - 1].duty_cycle = command->hold_duty_cycle;
+    }
+  }
+  else
+  {
+    segment_count = KeyDriver_BuildSegments(segments, command->duty_cycle, command->initial_strike_time,
+                                            command->followup_duty_cycle, command->followup_time,
+                                            command->hold_duty_cycle);
+  }
+
+  if (restrike)
+  {
+    KeyDriver_RestrikeEnvelope(key_driver, command->channel, segments, segment_count);
+  }
+  else
+  {
+    KeyDriver_PressEnvelope(key_driver, command->channel, segments, segment_count);
+  }
 }
 
 void CommandParser_ExecuteCommand(const ParsedCommand_t *command, KeyDriverModule_t *key_driver)
@@ -190,17 +892,21 @@ void CommandParser_ExecuteCommand(const ParsedCommand_t *command, KeyDriverModul
     return;
   }
 
+  if (command->type == COMMAND_RELEASE_ALL)
+  {
+    KeyDriver_ReleaseAll(key_driver);
+    return;
+  }
+
   // Ensure channel is within valid range
   if (command->channel >= NUM_KEYS)
   {
     return;
   }
 
-  if (command->type == COMMAND_PRESS)
+  if (command->type == COMMAND_PRESS || command->type == COMMAND_RESTRIKE)
   {
-    KeyDriver_PressKey(key_driver, command->channel, command->duty_cycle,
-                       command->initial_strike_time, command->followup_duty_cycle,
-                       command->followup_time, command->hold_duty_cycle);
+    CommandParser_Strike(command, key_driver, command->type == COMMAND_RESTRIKE);
   }
   else if (command->type == COMMAND_RELEASE)
   {
@@ -208,6 +914,58 @@ void CommandParser_ExecuteCommand(const ParsedCommand_t *command, KeyDriverModul
   }
 }
 
+/**
+ * @brief Queue a command for the main loop, pedal commands on their own lane
+ * @param command: Key, pedal or release-all command with local execute-at time
+ * @return HAL status, HAL_ERROR if the queue was full
+ */
+HAL_StatusTypeDef CommandParser_Submit(const ParsedCommand_t *command)
+{
+  if (command == NULL)
+  {
+    return HAL_ERROR;
+  }
+
+  if (command->type == COMMAND_PEDAL_PRESS || command->type == COMMAND_PEDAL_RELEASE)
+  {
+    return CommandQueue_Enqueue(&g_pedal_queue, command);
+  }
+
+  return CommandQueue_Enqueue(&g_command_queue, command);
+}
+
+/**
+ * @brief Whether nothing is playing: no key sounding or waiting, no command queued and the pedal at rest
+ * @param key_driver: Pointer to key driver module
+ * @return 1 if idle, 0 if not
+ */
+static uint8_t CommandParser_BoardIdle(const KeyDriverModule_t *key_driver)
+{
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    if (key_driver->active[word] | key_driver->waiting[word])
+    {
+      return 0;
+    }
+  }
+
+  return CommandQueue_IsEmpty(&g_command_queue) && CommandQueue_IsEmpty(&g_pedal_queue) &&
+         !StepperMotor_IsMoving(&g_stepper_motor);
+}
+
+/**
+ * @brief Mark a table for saving by CommandParser_ProcessSaves
+ * @param table: COMMAND_SAVE_* bit
+ */
+static void CommandParser_RequestSave(uint8_t table)
+{
+  if (g_parser_key_driver != NULL && !CommandParser_BoardIdle(g_parser_key_driver))
+  {
+    g_deferred_saves++;
+  }
+  g_pending_saves |= table;
+}
+
 // Internal callback function for RS485 messages
 static void CommandParser_RS485Callback(const char *message, uint16_t length)
 {
@@ -218,11 +976,107 @@ static void CommandParser_RS485Callback(const char *message, uint16_t length)
 
   // Format: "P:11:100" or "R:11:0"
   ParsedCommand_t parsed_command;
-  if (CommandParser_ParseMessage(message, length, &parsed_command) == HAL_OK)
+  if (CommandParser_ParseMessage(message, length, &parsed_command) != HAL_OK)
+  {
+    return;
+  }
+
+  // Beacons are consumed right away, while the frame timestamp is fresh
+  if (parsed_command.type == COMMAND_CLOCK_SYNC)
+  {
+    ClockSync_OnBeacon(parsed_command.execute_at, RS485_GetFrameStartTime());
+    return;
+  }
+
+  // Credit queries are answered from here, after every earlier frame has been
+  // queued, so the reported free slots of both lanes are exact at the time of
+  // the reply; the hottest coil's temperature estimate and the profiles this
+  // board holds ride along, so the main controller can re-send any it lost
+  if (parsed_command.type == COMMAND_CREDIT_QUERY)
+  {
+    char reply[RS485_TX_BUFFER_SIZE];
+    snprintf(reply, sizeof(reply), "C:%u:%u:%u:%lu:%u:%lx", BoardConfig_Get()->unit_address,
+             CommandQueue_GetFreeSlots(&g_command_queue), CommandQueue_GetFreeSlots(&g_pedal_queue),
+             (unsigned long)(g_command_queue.dropped + g_pedal_queue.dropped),
+             ThermalModel_GetMaxTemperature(), (unsigned long)EnvelopeProfile_GetValidMask());
+    RS485_SendFrame(RS485_ADDR_MASTER, reply);
+    return;
+  }
+
+  // Profile uploads, release ramps and calibration take effect at once;
+  // presses resolve profiles and velocities while parsing, so frame order is
+  // all the ordering they need
+  if (parsed_command.type == COMMAND_PROFILE_SET)
+  {
+    EnvelopeProfile_t profile = {0};
+    profile.segment_count = KeyDriver_BuildSegments(profile.segments, parsed_command.duty_cycle,
+                                                    parsed_command.initial_strike_time,
+                                                    parsed_command.followup_duty_cycle,
+                                                    parsed_command.followup_time, parsed_command.hold_duty_cycle);
+    EnvelopeProfile_Set(parsed_command.channel, &profile);
+    return;
+  }
+  if (parsed_command.type == COMMAND_PROFILE_SEGMENT)
+  {
+    KeySegment_t segment;
+    segment.duty_cycle = parsed_command.duty_cycle;
+    segment.ramp = parsed_command.ramp;
+    segment.duration_ms = parsed_command.initial_strike_time;
+    EnvelopeProfile_SetSegment(parsed_command.channel, parsed_command.segment, &segment);
+    return;
+  }
+  if (parsed_command.type == COMMAND_PROFILE_SAVE)
+  {
+    CommandParser_RequestSave(COMMAND_SAVE_PROFILES);
+    return;
+  }
+  if (parsed_command.type == COMMAND_RELEASE_SET)
+  {
+    KeyDriver_SetRelease(g_parser_key_driver, parsed_command.channel, parsed_command.ramp,
+                         parsed_command.initial_strike_time);
+    return;
+  }
+  if (parsed_command.type == COMMAND_CALIBRATION_POINT)
+  {
+    KeyCalibration_SetPoint(parsed_command.channel, parsed_command.segment, parsed_command.duty_cycle);
+    return;
+  }
+  if (parsed_command.type == COMMAND_CALIBRATION_LIMITS)
   {
-    // Queue the parsed command for processing in main loop
-    CommandQueue_Enqueue(&g_command_queue, &parsed_command);
+    KeyCalibration_SetLimits(parsed_command.channel, parsed_command.duty_cycle, parsed_command.hold_duty_cycle,
+                             parsed_command.initial_strike_time);
+    return;
   }
+  if (parsed_command.type == COMMAND_CALIBRATION_SAVE)
+  {
+    CommandParser_RequestSave(COMMAND_SAVE_CALIBRATION);
+    return;
+  }
+
+  // Relative times count from the frame start on the local clock; absolute
+  // times are converted from the master clock, and without sync run on arrival
+  if (parsed_command.is_relative)
+  {
+    parsed_command.execute_at += RS485_GetFrameStartTime();
+  }
+  else if (parsed_command.is_timed &&
+      (!ClockSync_IsSynced(Timebase_Micros()) ||
+       ClockSync_MasterToLocal(parsed_command.execute_at, &parsed_command.execute_at) != HAL_OK))
+  {
+    parsed_command.is_timed = 0;
+  }
+
+  // Timed strikes start early by the key's latency, so every key sounds on
+  // time; the queue then runs them ahead of commands still held for later
+  if (parsed_command.is_timed &&
+      (parsed_command.type == COMMAND_PRESS || parsed_command.type == COMMAND_RESTRIKE))
+  {
+    parsed_command.execute_at -= KeyCalibration_Get(parsed_command.channel)->latency_us;
+  }
+
+  // Queue the parsed command for processing in main loop; a full queue is
+  // counted in the queue's drop counter and reported with the next credit reply
+  CommandParser_Submit(&parsed_command);
 }
 
 // Initialize the command parser module
@@ -233,8 +1087,14 @@ void CommandParser_Init(KeyDriverModule_t *key_driver)
     return;
   }
 
-  // Initialize the command queue
-  CommandQueue_Init(&g_command_queue);
+  g_parser_key_driver = key_driver;
+
+  // Initialize the command queues
+  CommandQueue_Init(&g_command_queue, COMMAND_QUEUE_SIZE);
+  CommandQueue_Init(&g_pedal_queue, COMMAND_PEDAL_QUEUE_SIZE);
+
+  // No running status until the first full command arrives
+  memset(&g_running_status, 0, sizeof(g_running_status));
 
   // Set up the RS485 callback to use our internal handler
   RS485_SetMessageCallback(CommandParser_RS485Callback);
@@ -247,24 +1107,25 @@ void CommandParser_Init(KeyDriverModule_t *key_driver)
 /**
  * @brief Initialize command queue
  * @param queue: Pointer to queue structure
+ * @param capacity: Slots used, a power of two up to COMMAND_QUEUE_SIZE
  * @return HAL status
  */
-HAL_StatusTypeDef CommandQueue_Init(CommandQueue_t *queue)
+HAL_StatusTypeDef CommandQueue_Init(CommandQueue_t *queue, uint32_t capacity)
 {
-  if (queue == NULL)
+  if (queue == NULL || capacity > COMMAND_QUEUE_SIZE)
   {
     return HAL_ERROR;
   }
 
-  queue->head = 0;
-  queue->tail = 0;
-  queue->count = 0;
+  queue->dropped = 0;
+  queue->coalesced = 0;
+  queue->run_ahead = 0;
 
-  return HAL_OK;
+  return SpscRing_Init(&queue->ring, capacity);
 }
 
 /**
- * @brief Add command to queue
+ * @brief Add command to queue (producer side)
  * @param queue: Pointer to queue structure
  * @param command: Pointer to command to enqueue
  * @return HAL status
@@ -276,22 +1137,22 @@ HAL_StatusTypeDef CommandQueue_Enqueue(CommandQueue_t *queue, const ParsedComman
     return HAL_ERROR;
   }
 
-  // Check if queue is full
-  if (CommandQueue_IsFull(queue))
+  uint32_t slot;
+  if (SpscRing_WriteSlot(&queue->ring, &slot) != HAL_OK)
   {
+    queue->dropped++;
     return HAL_ERROR; // Queue overflow
   }
 
   // Add command to queue
-  queue->commands[queue->tail] = *command;
-  queue->tail = (queue->tail + 1) % COMMAND_QUEUE_SIZE;
-  queue->count++;
+  queue->commands[slot] = *command;
+  SpscRing_Publish(&queue->ring);
 
   return HAL_OK;
 }
 
 /**
- * @brief Remove command from queue
+ * @brief Remove command from queue (consumer side)
  * @param queue: Pointer to queue structure
  * @param command: Pointer to store dequeued command
  * @return HAL status
@@ -303,18 +1164,48 @@ HAL_StatusTypeDef CommandQueue_Dequeue(CommandQueue_t *queue, ParsedCommand_t *c
     return HAL_ERROR;
   }
 
-  // Check if queue is empty
-  if (CommandQueue_IsEmpty(queue))
+  return CommandQueue_DequeueBatch(queue, command, 1) == 1 ? HAL_OK : HAL_ERROR;
+}
+
+/**
+ * @brief Remove up to max_count commands from queue in one go (consumer side)
+ * @param queue: Pointer to queue structure
+ * @param commands: Array to store dequeued commands, oldest first
+ * @param max_count: Size of commands array
+ * @return Number of commands dequeued
+ */
+uint8_t CommandQueue_DequeueBatch(CommandQueue_t *queue, ParsedCommand_t *commands, uint8_t max_count)
+{
+  if (queue == NULL || commands == NULL)
+  {
+    return 0;
+  }
+
+  uint8_t count = 0;
+  uint32_t slot;
+  while (count < max_count && SpscRing_ReadSlot(&queue->ring, count, &slot) == HAL_OK)
   {
-    return HAL_ERROR; // Queue empty
+    commands[count++] = queue->commands[slot];
   }
 
-  // Remove command from queue
-  *command = queue->commands[queue->head];
-  queue->head = (queue->head + 1) % COMMAND_QUEUE_SIZE;
-  queue->count--;
+  SpscRing_Release(&queue->ring, count);
+  return count;
+}
 
-  return HAL_OK;
+/**
+ * @brief Get the command at the head of the queue without removing it (consumer side)
+ * @param queue: Pointer to queue structure
+ * @return Pointer to head command, or NULL if the queue is empty
+ */
+ParsedCommand_t *CommandQueue_Peek(CommandQueue_t *queue)
+{
+  uint32_t slot;
+  if (queue == NULL || SpscRing_ReadSlot(&queue->ring, 0, &slot) != HAL_OK)
+  {
+    return NULL;
+  }
+
+  return &queue->commands[slot];
 }
 
 /**
@@ -329,7 +1220,7 @@ uint8_t CommandQueue_IsEmpty(const CommandQueue_t *queue)
     return 1;
   }
 
-  return (queue->count == 0);
+  return (SpscRing_Count(&queue->ring) == 0);
 }
 
 /**
@@ -344,30 +1235,331 @@ uint8_t CommandQueue_IsFull(const CommandQueue_t *queue)
     return 1;
   }
 
-  return (queue->count >= COMMAND_QUEUE_SIZE);
+  return (SpscRing_Free(&queue->ring) == 0);
+}
+
+/**
+ * @brief Get the number of free slots in the queue (credits for the sender)
+ * @param queue: Pointer to queue structure
+ * @return Number of commands that can be enqueued without overflow
+ */
+uint8_t CommandQueue_GetFreeSlots(const CommandQueue_t *queue)
+{
+  if (queue == NULL)
+  {
+    return 0;
+  }
+
+  return (uint8_t)SpscRing_Free(&queue->ring);
+}
+
+/**
+ * @brief Check whether a queued command has to wait for its execute-at time
+ * @param command: Queued command
+ * @param now: Current local time in us
+ * @return 1 if held, 0 if it can run now
+ */
+static uint8_t CommandQueue_IsHeld(const ParsedCommand_t *command, uint32_t now)
+{
+  // Times implausibly far ahead are run now rather than stalling the queue
+  int32_t wait = (int32_t)(command->execute_at - now);
+  return command->is_timed && wait > 0 && wait <= CLOCK_SYNC_MAX_PLAYOUT_US;
 }
 
 /**
- * @brief Process all commands in the queue
+ * @brief Count the pedal commands that can be retired now (consumer side)
+ *
+ * Timed commands are held at the head of the queue until their execute-at
+ * time; the main controller sends them in time order. An untimed command
+ * (sent so, or sent without clock sync) does not wait behind a held one: the
+ * count runs up to the last command that can run now, and as only that one
+ * moves the pedal, the held commands before it are superseded with the rest.
  * @param queue: Pointer to queue structure
+ * @param now: Current local time in us
+ * @return Number of commands, oldest first, to retire; the last one runs
+ */
+static uint32_t CommandQueue_CountDue(CommandQueue_t *queue, uint32_t now)
+{
+  uint32_t count = 0;
+  uint32_t slot;
+
+  for (uint32_t i = 0; SpscRing_ReadSlot(&queue->ring, i, &slot) == HAL_OK; i++)
+  {
+    const ParsedCommand_t *command = &queue->commands[slot];
+    if (!CommandQueue_IsHeld(command, now) && (i == count || !command->is_timed))
+    {
+      count = i + 1;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * @brief Drop the commands left behind ahead of one that replaces them
+ *
+ * A command run ahead of held commands supersedes the earlier ones for its
+ * channel, or all of them for "R:A", as it would have in one batch.
+ * @param queue: Key command queue
+ * @param end: Position of the replacing command
+ * @param command: Replacing command
+ * @param skip: Slots already run or taken into the current batch
+ * @param released: Per channel, set when a release is dropped, so a press
+ *                  replacing it is run as a re-strike
+ */
+static void CommandQueue_Supersede(CommandQueue_t *queue, uint32_t end, const ParsedCommand_t *command, uint32_t skip,
+                                   uint8_t *released)
+{
+  uint32_t slot;
+
+  for (uint32_t i = 0; i < end && SpscRing_ReadSlot(&queue->ring, i, &slot) == HAL_OK; i++)
+  {
+    const ParsedCommand_t *earlier = &queue->commands[slot];
+    if ((skip & (1UL << slot)) ||
+        (command->type != COMMAND_RELEASE_ALL && earlier->channel != command->channel) ||
+        earlier->type == COMMAND_RELEASE_ALL)
+    {
+      continue;
+    }
+
+    if (earlier->type == COMMAND_RELEASE && earlier->channel < NUM_KEYS)
+    {
+      released[earlier->channel] = 1;
+    }
+    queue->run_ahead |= 1UL << slot;
+    queue->coalesced++;
+  }
+}
+
+/**
+ * @brief Run one batch of due key commands
+ *
+ * Takes up to COMMAND_BATCH_SIZE commands that can run now, oldest first.
+ * Timed commands are held until their execute-at time. The queue is not in
+ * time order: strikes are brought forward by their key's latency, and
+ * untimed commands (R:A, or anything sent without clock sync) run on
+ * arrival. So commands that can run are taken from behind held ones,
+ * superseding the earlier commands they replace; a re-press brought forward
+ * past its own release replaces the release and runs as a re-strike. Slots
+ * run out of order are marked in run_ahead and handed back once everything
+ * before them is done.
+ *
+ * Only the last due command for each channel can still be seen on the
+ * strings: a press followed by a release that are both due would switch the
+ * coil on and off again within microseconds, and a release followed by a
+ * press is replaced by the press, run as a re-strike. So each channel runs
+ * at most one command, releases go first to free current for the strikes
+ * after them, and "R:A" only touches keys nothing later in the batch presses.
+ * Strikes run loudest first, so when the power budget holds some of them
+ * back it is the quieter ones that are staggered.
+ * @param queue: Key command queue
+ * @param now: Current local time in us
  * @param key_driver: Pointer to key driver module
+ * @return 1 if more commands were due than fit in the batch, 0 if not
  */
-void CommandParser_ProcessQueue(CommandQueue_t *queue, KeyDriverModule_t *key_driver)
+static uint8_t CommandParser_RunKeyBatch(CommandQueue_t *queue, uint32_t now, KeyDriverModule_t *key_driver)
+{
+  const ParsedCommand_t *latest[NUM_KEYS] = {NULL};
+  uint8_t released[NUM_KEYS] = {0};
+  uint8_t release_all = 0;
+  uint8_t held = 0;
+  uint8_t more = 0;
+  uint32_t taken = 0;
+  uint32_t batch = 0;
+  uint32_t slot;
+
+  for (uint32_t i = 0; SpscRing_ReadSlot(&queue->ring, i, &slot) == HAL_OK; i++)
+  {
+    const ParsedCommand_t *command = &queue->commands[slot];
+
+    if (queue->run_ahead & (1UL << slot))
+    {
+      continue;
+    }
+    if (CommandQueue_IsHeld(command, now))
+    {
+      held = 1;
+      continue;
+    }
+    if (taken == COMMAND_BATCH_SIZE)
+    {
+      more = 1;
+      break;
+    }
+    taken++;
+    batch |= 1UL << slot;
+
+    if (held)
+    {
+      CommandQueue_Supersede(queue, i, command, queue->run_ahead | batch, released);
+    }
+
+    if (command->type == COMMAND_RELEASE_ALL)
+    {
+      // Supersedes everything before it in the batch
+      for (uint8_t channel = 0; channel < NUM_KEYS; channel++)
+      {
+        if (latest[channel] != NULL)
+        {
+          queue->coalesced++;
+          latest[channel] = NULL;
+        }
+      }
+      release_all = 1;
+      memset(released, 1, sizeof(released));
+    }
+    else if ((command->type == COMMAND_PRESS || command->type == COMMAND_RESTRIKE || command->type == COMMAND_RELEASE) &&
+             command->channel < NUM_KEYS)
+    {
+      if (latest[command->channel] != NULL)
+      {
+        queue->coalesced++;
+      }
+      latest[command->channel] = command;
+      if (command->type == COMMAND_RELEASE)
+      {
+        released[command->channel] = 1;
+      }
+    }
+  }
+
+  if (taken > 0)
+  {
+    // Releases first; a release-all only reaches keys with nothing left to run
+    for (uint8_t channel = 0; channel < NUM_KEYS; channel++)
+    {
+      if (latest[channel] != NULL && latest[channel]->type == COMMAND_RELEASE)
+      {
+        CommandParser_ExecuteCommand(latest[channel], key_driver);
+      }
+      else if (latest[channel] == NULL && release_all)
+      {
+        KeyDriver_ReleaseKey(key_driver, channel);
+      }
+    }
+
+    // Then the strikes, sorted by duty cycle (insertion sort, at most NUM_KEYS)
+    const ParsedCommand_t *strikes[NUM_KEYS];
+    uint8_t strike_count = 0;
+    for (uint8_t channel = 0; channel < NUM_KEYS; channel++)
+    {
+      if (latest[channel] != NULL && latest[channel]->type != COMMAND_RELEASE)
+      {
+        uint8_t i = strike_count++;
+        while (i > 0 && strikes[i - 1]->duty_cycle < latest[channel]->duty_cycle)
+        {
+          strikes[i] = strikes[i - 1];
+          i--;
+        }
+        strikes[i] = latest[channel];
+      }
+    }
+    for (uint8_t i = 0; i < strike_count; i++)
+    {
+      if (released[strikes[i]->channel] && strikes[i]->type == COMMAND_PRESS)
+      {
+        // Released and pressed again within the batch: the key never got the
+        // chance to rise, so it is re-struck rather than pressed where it is
+        CommandParser_Strike(strikes[i], key_driver, 1);
+      }
+      else
+      {
+        CommandParser_ExecuteCommand(strikes[i], key_driver);
+      }
+    }
+
+    // The whole batch reaches the outputs in one commit
+    Channel_Commit();
+  }
+
+  // Hand back the slots at the head that are done
+  queue->run_ahead |= batch;
+  uint32_t done = 0;
+  while (SpscRing_ReadSlot(&queue->ring, done, &slot) == HAL_OK && (queue->run_ahead & (1UL << slot)))
+  {
+    queue->run_ahead &= ~(1UL << slot);
+    done++;
+  }
+  SpscRing_Release(&queue->ring, done);
+
+  return more;
+}
+
+/**
+ * @brief Process the commands in the queues that are due
+ *
+ * The pedal lane runs first and only its last due command is executed, since
+ * each one moves the pedal to an end position. Due key commands are then run
+ * in coalesced batches of up to COMMAND_BATCH_SIZE, their slots handed back
+ * batch by batch, until the queue has nothing due or the deadline is reached.
+ * @param queue: Pointer to key command queue
+ * @param key_driver: Pointer to key driver module
+ * @param deadline: DWT cycle count after which no further batch is started
+ * @return 1 if due commands were left for the next call, 0 if not
+ */
+uint8_t CommandParser_ProcessQueue(CommandQueue_t *queue, KeyDriverModule_t *key_driver, uint32_t deadline)
 {
   if (queue == NULL || key_driver == NULL)
   {
-    return;
+    return 0;
+  }
+
+  uint32_t now = Timebase_Micros();
+  uint32_t slot;
+
+  uint32_t pedal_due = CommandQueue_CountDue(&g_pedal_queue, now);
+  if (pedal_due > 0 && SpscRing_ReadSlot(&g_pedal_queue.ring, pedal_due - 1, &slot) == HAL_OK)
+  {
+    CommandParser_ExecuteCommand(&g_pedal_queue.commands[slot], key_driver);
+    g_pedal_queue.coalesced += pedal_due - 1;
+    SpscRing_Release(&g_pedal_queue.ring, pedal_due);
   }
 
-  // Process all commands in the queue
-  while (!CommandQueue_IsEmpty(queue))
+  while (CommandParser_RunKeyBatch(queue, now, key_driver))
   {
-    ParsedCommand_t command;
-    if (CommandQueue_Dequeue(queue, &command) == HAL_OK)
+    if (TIMEBASE_REACHED(TIMEBASE_CYCLES(), deadline))
     {
-      CommandParser_ExecuteCommand(&command, key_driver);
+      return 1;
     }
   }
+
+  return 0;
+}
+
+/**
+ * @brief Store a table marked for saving, once the board is idle
+ *
+ * One table per call, so each stall stays a single page erase. Saves wait
+ * for as long as anything is playing: the erase holds up the key timer
+ * interrupt, so a key mid-strike would stay at strike duty throughout.
+ * @param key_driver: Pointer to key driver module
+ */
+void CommandParser_ProcessSaves(KeyDriverModule_t *key_driver)
+{
+  if (g_pending_saves == 0 || key_driver == NULL || !CommandParser_BoardIdle(key_driver))
+  {
+    return;
+  }
+
+  if (g_pending_saves & COMMAND_SAVE_PROFILES)
+  {
+    g_pending_saves &= ~COMMAND_SAVE_PROFILES;
+    EnvelopeProfile_Save();
+  }
+  else if (g_pending_saves & COMMAND_SAVE_CALIBRATION)
+  {
+    g_pending_saves &= ~COMMAND_SAVE_CALIBRATION;
+    KeyCalibration_Save();
+  }
+}
+
+/**
+ * @brief Count the saves that arrived while the board was playing
+ * @return Saves held back until it went idle
+ */
+uint32_t CommandParser_GetDeferredSaves(void)
+{
+  return g_deferred_saves;
 }
 
 /**
@@ -378,3 +1570,12 @@ CommandQueue_t *CommandParser_GetQueue(void)
 {
   return &g_command_queue;
 }
+
+/**
+ * @brief Get pointer to the pedal lane (for external access)
+ * @return Pointer to pedal command queue
+ */
+CommandQueue_t *CommandParser_GetPedalQueue(void)
+{
+  return &g_pedal_queue;
+}
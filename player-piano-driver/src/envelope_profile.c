@@ -0,0 +1,134 @@
+#include "envelope_profile.h"
+#include "flash_storage.h"
+#include <string.h>
+
+// Profile table, indexed by profile ID
+static EnvelopeProfile_t g_profiles[ENVELOPE_PROFILE_COUNT];
+
+// Profile being uploaded segment by segment, published by its hold segment
+static EnvelopeProfile_t g_profile_upload;
+static uint8_t g_profile_upload_id;
+
+/**
+ * @brief Load the profile table from flash
+ *
+ * A blank or corrupt page leaves every profile invalid until the main
+ * controller uploads them.
+ */
+void EnvelopeProfile_Init(void)
+{
+  if (FlashStorage_Load(FLASH_STORAGE_ENVELOPE_PROFILE_PAGE, ENVELOPE_PROFILE_TAG,
+                        g_profiles, sizeof(g_profiles)) != HAL_OK)
+  {
+    memset(g_profiles, 0, sizeof(g_profiles));
+  }
+}
+
+/**
+ * @brief Replace one profile in RAM
+ * @param id: Profile ID
+ * @param profile: New parameters; the valid flag is set here
+ * @return HAL status, HAL_ERROR unless the last segment is a hold at or below
+ *         ENVELOPE_PROFILE_MAX_HOLD_DUTY
+ */
+HAL_StatusTypeDef EnvelopeProfile_Set(uint8_t id, const EnvelopeProfile_t *profile)
+{
+  if (profile == NULL || id >= ENVELOPE_PROFILE_COUNT || profile->segment_count == 0 ||
+      profile->segment_count > KEY_MAX_SEGMENTS)
+  {
+    return HAL_ERROR;
+  }
+
+  const KeySegment_t *hold = &profile->segments[profile->segment_count - 1];
+  if (hold->duration_ms != 0 || hold->duty_cycle > ENVELOPE_PROFILE_MAX_HOLD_DUTY)
+  {
+    return HAL_ERROR;
+  }
+
+  g_profiles[id] = *profile;
+  g_profiles[id].valid = 1;
+  return HAL_OK;
+}
+
+/**
+ * @brief Stage one segment of a profile upload and cut the upload after it
+ *
+ * Segment 0 starts a new upload; any later segment extends or shortens the
+ * upload of the same profile, so segments must arrive in order. A hold
+ * segment (duration 0) ends the upload and replaces the profile in the
+ * table; until then presses keep the previous version.
+ * @param id: Profile ID
+ * @param index: Segment index
+ * @param segment: Segment parameters
+ * @return HAL status, HAL_ERROR if an earlier segment is missing or the
+ *         finished profile is rejected
+ */
+HAL_StatusTypeDef EnvelopeProfile_SetSegment(uint8_t id, uint8_t index, const KeySegment_t *segment)
+{
+  if (segment == NULL || id >= ENVELOPE_PROFILE_COUNT || index >= KEY_MAX_SEGMENTS ||
+      segment->ramp > KEY_RAMP_EXPONENTIAL)
+  {
+    return HAL_ERROR;
+  }
+
+  EnvelopeProfile_t *upload = &g_profile_upload;
+  if (index > 0 && (!upload->valid || id != g_profile_upload_id || index > upload->segment_count))
+  {
+    return HAL_ERROR;
+  }
+
+  upload->segments[index] = *segment;
+  upload->segment_count = index + 1;
+  upload->valid = 1;
+  g_profile_upload_id = id;
+  if (segment->duration_ms != 0)
+  {
+    return HAL_OK;
+  }
+
+  upload->valid = 0;
+  return EnvelopeProfile_Set(id, upload);
+}
+
+/**
+ * @brief Look up a profile
+ * @param id: Profile ID
+ * @return Pointer to the profile, or NULL if it has not been uploaded
+ */
+const EnvelopeProfile_t *EnvelopeProfile_Get(uint8_t id)
+{
+  if (id >= ENVELOPE_PROFILE_COUNT || !g_profiles[id].valid)
+  {
+    return NULL;
+  }
+
+  return &g_profiles[id];
+}
+
+/**
+ * @brief Get the profiles that can be pressed by ID
+ * @return Bit n set if profile n is valid
+ */
+uint32_t EnvelopeProfile_GetValidMask(void)
+{
+  uint32_t mask = 0;
+
+  for (uint8_t id = 0; id < ENVELOPE_PROFILE_COUNT; id++)
+  {
+    if (g_profiles[id].valid)
+    {
+      mask |= (uint32_t)1 << id;
+    }
+  }
+  return mask;
+}
+
+/**
+ * @brief Store the current table in flash; only while the board is idle
+ * @return HAL status
+ */
+HAL_StatusTypeDef EnvelopeProfile_Save(void)
+{
+  return FlashStorage_Save(FLASH_STORAGE_ENVELOPE_PROFILE_PAGE, ENVELOPE_PROFILE_TAG,
+                           g_profiles, sizeof(g_profiles));
+}
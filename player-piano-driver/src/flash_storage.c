@@ -0,0 +1,108 @@
+#include "flash_storage.h"
+#include <string.h>
+
+// Compute FNV-1a checksum over a byte buffer
+static uint32_t FlashStorage_Checksum(const uint8_t *data, uint16_t length)
+{
+  uint32_t hash = 2166136261u;
+
+  for (uint16_t i = 0; i < length; i++)
+  {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/**
+ * @brief Load a record from a flash page
+ * @param page_address: Start address of the flash page
+ * @param tag: Expected record tag
+ * @param data: Buffer to receive the payload
+ * @param length: Expected payload length
+ * @return HAL_OK if a valid record was found, HAL_ERROR otherwise
+ */
+HAL_StatusTypeDef FlashStorage_Load(uint32_t page_address, uint16_t tag, void *data, uint16_t length)
+{
+  if (data == NULL || length > FLASH_STORAGE_MAX_PAYLOAD)
+  {
+    return HAL_ERROR;
+  }
+
+  const FlashStorageHeader_t *header = (const FlashStorageHeader_t *)page_address;
+  const uint8_t *payload = (const uint8_t *)(page_address + sizeof(FlashStorageHeader_t));
+
+  // Erased flash reads as 0xFFFF, so a blank page never matches a valid tag
+  if (header->tag != tag || header->length != length)
+  {
+    return HAL_ERROR;
+  }
+
+  if (header->checksum != FlashStorage_Checksum(payload, length))
+  {
+    return HAL_ERROR;
+  }
+
+  memcpy(data, payload, length);
+  return HAL_OK;
+}
+
+/**
+ * @brief Erase a flash page and write a record to it
+ * @param page_address: Start address of the flash page
+ * @param tag: Record tag
+ * @param data: Payload to store
+ * @param length: Payload length in bytes
+ * @return HAL status
+ */
+HAL_StatusTypeDef FlashStorage_Save(uint32_t page_address, uint16_t tag, const void *data, uint16_t length)
+{
+  if (data == NULL || length > FLASH_STORAGE_MAX_PAYLOAD)
+  {
+    return HAL_ERROR;
+  }
+
+  FlashStorageHeader_t header;
+  header.tag = tag;
+  header.length = length;
+  header.checksum = FlashStorage_Checksum((const uint8_t *)data, length);
+
+  HAL_StatusTypeDef status = HAL_FLASH_Unlock();
+  if (status != HAL_OK)
+  {
+    return status;
+  }
+
+  // Erase the page
+  FLASH_EraseInitTypeDef erase = {0};
+  erase.TypeErase = FLASH_TYPEERASE_PAGES;
+  erase.PageAddress = page_address;
+  erase.NbPages = 1;
+
+  uint32_t page_error = 0;
+  status = HAL_FLASHEx_Erase(&erase, &page_error);
+
+  // Program header followed by payload, one halfword at a time
+  uint32_t address = page_address;
+  const uint8_t *bytes = (const uint8_t *)&header;
+  for (uint16_t i = 0; i < sizeof(header) && status == HAL_OK; i += 2)
+  {
+    uint16_t halfword = bytes[i] | (bytes[i + 1] << 8);
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, halfword);
+    address += 2;
+  }
+
+  bytes = (const uint8_t *)data;
+  for (uint16_t i = 0; i < length && status == HAL_OK; i += 2)
+  {
+    // Pad an odd trailing byte with the erased value
+    uint16_t high = (i + 1 < length) ? bytes[i + 1] : 0xFF;
+    uint16_t halfword = bytes[i] | (high << 8);
+    status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address, halfword);
+    address += 2;
+  }
+
+  HAL_FLASH_Lock();
+  return status;
+}
@@ -0,0 +1,160 @@
+#include "key_calibration.h"
+#include "flash_storage.h"
+#include <string.h>
+
+#if NUM_KEYS > KEY_CALIBRATION_MAX_KEYS
+#error "The calibration table for NUM_KEYS keys does not fit in one flash page"
+#endif
+
+// Calibration table as stored in flash, and the strike duties expanded from it
+static KeyCalibration_t g_calibration[NUM_KEYS];
+static uint8_t g_strike_lut[NUM_KEYS][KEY_CALIBRATION_LUT_SIZE];
+
+/**
+ * @brief Fill in a key's default calibration, the old linear velocity mapping
+ */
+static void KeyCalibration_Default(KeyCalibration_t *calibration)
+{
+  memset(calibration, 0, sizeof(*calibration));
+  for (uint8_t point = 0; point < KEY_CALIBRATION_POINTS; point++)
+  {
+    calibration->curve[point] = 65 + (15 * point) / (KEY_CALIBRATION_POINTS - 1);
+  }
+}
+
+/**
+ * @brief Expand a key's curve into its lookup table
+ *
+ * Each entry is the curve interpolated at the middle of its four velocities,
+ * raised to the key's minimum strike duty.
+ */
+static void KeyCalibration_Expand(uint8_t key)
+{
+  const KeyCalibration_t *calibration = &g_calibration[key];
+
+  for (uint8_t entry = 0; entry < KEY_CALIBRATION_LUT_SIZE; entry++)
+  {
+    // Position along the curve in 127ths of a point
+    uint32_t position = (uint32_t)(entry * 4 + 2) * (KEY_CALIBRATION_POINTS - 1);
+    uint8_t point = position / 127;
+    int32_t duty = calibration->curve[KEY_CALIBRATION_POINTS - 1];
+
+    if (point < KEY_CALIBRATION_POINTS - 1)
+    {
+      int32_t from = calibration->curve[point];
+      int32_t to = calibration->curve[point + 1];
+      duty = from + ((to - from) * (int32_t)(position % 127) + 63) / 127;
+    }
+
+    if (duty < calibration->min_strike_duty)
+    {
+      duty = calibration->min_strike_duty;
+    }
+    g_strike_lut[key][entry] = (uint8_t)duty;
+  }
+}
+
+/**
+ * @brief Load the calibration table from flash and build the lookup tables
+ *
+ * A blank or corrupt page, or one written for a different key count, gives
+ * every key the default calibration.
+ */
+void KeyCalibration_Init(void)
+{
+  if (FlashStorage_Load(FLASH_STORAGE_KEY_CALIBRATION_PAGE, KEY_CALIBRATION_TAG,
+                        g_calibration, sizeof(g_calibration)) != HAL_OK)
+  {
+    for (uint8_t key = 0; key < NUM_KEYS; key++)
+    {
+      KeyCalibration_Default(&g_calibration[key]);
+    }
+  }
+
+  for (uint8_t key = 0; key < NUM_KEYS; key++)
+  {
+    KeyCalibration_Expand(key);
+  }
+}
+
+/**
+ * @brief Replace one point of a key's velocity curve in RAM
+ * @param key: Key index
+ * @param point: Curve point, 0 to KEY_CALIBRATION_POINTS - 1
+ * @param duty: Strike duty at that point (0-100)
+ * @return HAL status
+ */
+HAL_StatusTypeDef KeyCalibration_SetPoint(uint8_t key, uint8_t point, uint8_t duty)
+{
+  if (key >= NUM_KEYS || point >= KEY_CALIBRATION_POINTS || duty > 100)
+  {
+    return HAL_ERROR;
+  }
+
+  g_calibration[key].curve[point] = duty;
+  KeyCalibration_Expand(key);
+  return HAL_OK;
+}
+
+/**
+ * @brief Replace a key's minimum strike, hold duty and latency in RAM
+ * @param key: Key index
+ * @param min_strike_duty: Lowest strike duty (0-100)
+ * @param hold_duty: Hold duty (0-100, 0 = the envelope's own)
+ * @param latency_us: Strike latency
+ * @return HAL status
+ */
+HAL_StatusTypeDef KeyCalibration_SetLimits(uint8_t key, uint8_t min_strike_duty, uint8_t hold_duty, uint16_t latency_us)
+{
+  if (key >= NUM_KEYS || min_strike_duty > 100 || hold_duty > 100 || latency_us > KEY_CALIBRATION_MAX_LATENCY_US)
+  {
+    return HAL_ERROR;
+  }
+
+  g_calibration[key].min_strike_duty = min_strike_duty;
+  g_calibration[key].hold_duty = hold_duty;
+  g_calibration[key].latency_us = latency_us;
+  KeyCalibration_Expand(key);
+  return HAL_OK;
+}
+
+/**
+ * @brief Look up a key's calibration
+ * @param key: Key index
+ * @return Pointer to the calibration, or NULL for an invalid key
+ */
+const KeyCalibration_t *KeyCalibration_Get(uint8_t key)
+{
+  if (key >= NUM_KEYS)
+  {
+    return NULL;
+  }
+
+  return &g_calibration[key];
+}
+
+/**
+ * @brief Strike duty for a key at a MIDI velocity
+ * @param key: Key index
+ * @param velocity: MIDI velocity (1-127)
+ * @return Duty cycle (0-100), 0 for an invalid key or velocity 0
+ */
+uint8_t KeyCalibration_StrikeDuty(uint8_t key, uint8_t velocity)
+{
+  if (key >= NUM_KEYS || velocity == 0 || velocity > 127)
+  {
+    return 0;
+  }
+
+  return g_strike_lut[key][velocity >> 2];
+}
+
+/**
+ * @brief Store the current table in flash; only while the board is idle
+ * @return HAL status
+ */
+HAL_StatusTypeDef KeyCalibration_Save(void)
+{
+  return FlashStorage_Save(FLASH_STORAGE_KEY_CALIBRATION_PAGE, KEY_CALIBRATION_TAG,
+                           g_calibration, sizeof(g_calibration));
+}
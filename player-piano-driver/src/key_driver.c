@@ -1,8 +1,282 @@
 #include "key_driver.h"
+#include "key_timer.h"
+#include "timebase.h"
 
 // Global key driver instance
 KeyDriverModule_t g_key_driver;
 
+// Power budget in PWM duty units (more than one channel's worth)
+#define KEY_POWER_BUDGET_DUTY (((uint32_t)KEY_POWER_BUDGET_PERCENT * PWM_DUTY_MAX) / 100)
+
+// Instance whose segment deadlines are on the key timer
+static KeyDriverModule_t *g_timed_driver = NULL;
+
+// Write the current duty cycle at full PWM resolution within the key's
+// thermal limits, if it changed; the divisor is a constant, which the
+// compiler turns into a multiply
+static void KeyDriver_WriteDuty(uint8_t index, KeyDriver_t *key)
+{
+  uint16_t duty = (uint16_t)(((uint32_t)(key->duty_q16 >> 8) * PWM_DUTY_MAX) / (100u << (KEY_DUTY_SHIFT - 8)));
+
+  if (key->state == KEY_STATE_HOLD)
+  {
+    duty = (uint16_t)(((uint32_t)duty * key->hold_scale) >> 8);
+  }
+  if (duty > key->duty_cap)
+  {
+    duty = key->duty_cap;
+  }
+
+  if (duty != key->output_duty)
+  {
+    key->output_duty = duty;
+    Channel_SetDuty(index, duty);
+  }
+}
+
+// Move a key to a new state and keep the key bitmaps in step; the bitmap
+// words are shared with the compare interrupt, so they change with it masked
+static void KeyDriver_SetState(KeyDriverModule_t *key_driver, uint8_t index, KeyDriver_t *key, KeyState_t state)
+{
+  uint32_t bit = 1u << (index & 31);
+  uint8_t word = index >> 5;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  key->state = state;
+  if (state == KEY_STATE_IDLE)
+  {
+    key_driver->active[word] &= ~bit;
+  }
+  else
+  {
+    key_driver->active[word] |= bit;
+  }
+  if (state == KEY_STATE_WAITING)
+  {
+    key_driver->waiting[word] |= bit;
+  }
+  else
+  {
+    key_driver->waiting[word] &= ~bit;
+  }
+  __set_PRIMASK(primask);
+}
+
+// Schedule the next ramp tick after 'from', never past the end of the segment
+static void KeyDriver_ScheduleTick(uint8_t index, KeyDriver_t *key, uint32_t from)
+{
+  uint32_t next = from + KEY_RAMP_TICK_US;
+
+  if (TIMEBASE_REACHED(next, key->segment_end_us))
+  {
+    next = key->segment_end_us;
+  }
+  KeyTimer_Schedule(index, next);
+}
+
+// Start the key's current segment at time 'start' (main loop with the key's
+// deadline cancelled, or the compare interrupt)
+static void KeyDriver_StartSegment(KeyDriverModule_t *key_driver, uint8_t index, KeyDriver_t *key, uint32_t start)
+{
+  if (key->segment >= key->segment_count && key->state == KEY_STATE_RELEASING)
+  {
+    // End of the release ramp, the output already at 0
+    KeyDriver_SetState(key_driver, index, key, KEY_STATE_IDLE);
+    return;
+  }
+
+  if (key->segment >= key->segment_count)
+  {
+    // Past the last segment: its target is held until release, derated if hot
+    KeyDriver_SetState(key_driver, index, key, KEY_STATE_HOLD);
+    KeyDriver_WriteDuty(index, key);
+    return;
+  }
+
+  const KeySegment_t *segment = &key->segments[key->segment];
+  int32_t target = (int32_t)segment->duty_cycle << KEY_DUTY_SHIFT;
+
+  if (segment->duration_ms == 0)
+  {
+    key->duty_q16 = target;
+    KeyDriver_SetState(key_driver, index, key, KEY_STATE_HOLD);
+    KeyDriver_WriteDuty(index, key);
+    return;
+  }
+
+  if (key->state != KEY_STATE_RELEASING)
+  {
+    KeyDriver_SetState(key_driver, index, key, KEY_STATE_ENVELOPE);
+  }
+  key->segment_end_us = start + (uint32_t)segment->duration_ms * 1000;
+
+  if (key->rates[key->segment] == 0)
+  {
+    // Step: straight to the target, next deadline at the end of the segment
+    key->duty_q16 = target;
+    KeyDriver_WriteDuty(index, key);
+    KeyTimer_Schedule(index, key->segment_end_us);
+    return;
+  }
+
+  // Ramps start from wherever the output is; a linear one fixes its step now
+  if (segment->ramp == KEY_RAMP_LINEAR)
+  {
+    key->step_q16 = (int32_t)(((int64_t)(target - key->duty_q16) * key->rates[key->segment]) >> 16);
+  }
+  KeyDriver_ScheduleTick(index, key, start);
+}
+
+// Supply load of every key but 'index', in PWM duty units; only keys that
+// are not idle can draw any
+static uint32_t KeyDriver_PowerLoad(const KeyDriverModule_t *key_driver, uint8_t index)
+{
+  uint32_t load = 0;
+
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    for (uint32_t bits = key_driver->active[word]; bits != 0; bits &= bits - 1)
+    {
+      uint8_t i = (word << 5) + KEY_MASK_LOWEST(bits);
+      const KeyDriver_t *key = &key_driver->keys[i];
+      if (i == index)
+      {
+        continue;
+      }
+
+      uint32_t demand = key->output_duty;
+      if (key->state == KEY_STATE_ENVELOPE)
+      {
+        uint32_t target = PWM_PERCENT_TO_DUTY(key->segments[key->segment].duty_cycle);
+        if (target > key->duty_cap)
+        {
+          target = key->duty_cap;
+        }
+        if (target > demand)
+        {
+          demand = target;
+        }
+      }
+      load += demand;
+    }
+  }
+
+  return load;
+}
+
+// Whether a key's strike may start now: it fits the budget and no louder
+// strike is waiting for it (interrupts masked or in the ISR)
+static uint8_t KeyDriver_FitsBudget(const KeyDriverModule_t *key_driver, uint8_t index)
+{
+  const KeyDriver_t *key = &key_driver->keys[index];
+
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    for (uint32_t bits = key_driver->waiting[word]; bits != 0; bits &= bits - 1)
+    {
+      uint8_t i = (word << 5) + KEY_MASK_LOWEST(bits);
+      if (i != index && key_driver->keys[i].strike_duty > key->strike_duty)
+      {
+        return 0;
+      }
+    }
+  }
+
+  return KeyDriver_PowerLoad(key_driver, index) + key->strike_duty <= KEY_POWER_BUDGET_DUTY;
+}
+
+// Start a pressed key's envelope at 'now' if the power budget allows, or once
+// it has waited long enough; otherwise try again a stagger later (interrupts
+// masked or in the ISR)
+static void KeyDriver_Admit(KeyDriverModule_t *key_driver, uint8_t index, KeyDriver_t *key, uint32_t now)
+{
+  if (!TIMEBASE_REACHED(now, key->admit_by_us) && !KeyDriver_FitsBudget(key_driver, index))
+  {
+    if (key->state != KEY_STATE_WAITING)
+    {
+      KeyDriver_SetState(key_driver, index, key, KEY_STATE_WAITING);
+      key_driver->staggered_strikes++;
+    }
+
+    uint32_t retry = now + KEY_POWER_STAGGER_US;
+    if (TIMEBASE_REACHED(retry, key->admit_by_us))
+    {
+      retry = key->admit_by_us;
+    }
+    KeyTimer_Schedule(index, retry);
+    return;
+  }
+
+  // Time waited, from the press
+  if (key->state == KEY_STATE_WAITING)
+  {
+    uint32_t waited = now - (key->admit_by_us - KEY_POWER_MAX_DELAY_US);
+    if (waited > key_driver->max_stagger_us)
+    {
+      key_driver->max_stagger_us = waited;
+    }
+  }
+
+  KeyDriver_StartSegment(key_driver, index, key, now);
+}
+
+// Advance a key's envelope when its deadline is reached (compare interrupt)
+static void KeyDriver_OnDeadline(uint8_t index, uint32_t deadline)
+{
+  KeyDriver_t *key = &g_timed_driver->keys[index];
+
+  // End of a re-strike's partial release: the strike now goes through the power budget
+  if (key->state == KEY_STATE_RESET)
+  {
+    key->admit_by_us = deadline + KEY_POWER_MAX_DELAY_US;
+    KeyDriver_Admit(g_timed_driver, index, key, deadline);
+    return;
+  }
+
+  if (key->state == KEY_STATE_WAITING)
+  {
+    KeyDriver_Admit(g_timed_driver, index, key, deadline);
+    return;
+  }
+
+  if (key->state != KEY_STATE_ENVELOPE && key->state != KEY_STATE_RELEASING)
+  {
+    return;
+  }
+
+  // End of the segment: land exactly on the target and start the next one,
+  // timed from the deadline so lateness does not add up
+  if (TIMEBASE_REACHED(deadline, key->segment_end_us))
+  {
+    key->duty_q16 = (int32_t)key->segments[key->segment].duty_cycle << KEY_DUTY_SHIFT;
+    KeyDriver_WriteDuty(index, key);
+    key->segment++;
+    KeyDriver_StartSegment(g_timed_driver, index, key, key->segment_end_us);
+    return;
+  }
+
+  // Ramp tick
+  const KeySegment_t *segment = &key->segments[key->segment];
+  int32_t remaining = ((int32_t)segment->duty_cycle << KEY_DUTY_SHIFT) - key->duty_q16;
+  int32_t step = key->step_q16;
+  if (segment->ramp != KEY_RAMP_LINEAR)
+  {
+    step = (int32_t)(((int64_t)remaining * key->rates[key->segment]) >> 16);
+  }
+
+  // The shifts round down, so a falling step is up to one unit too big each
+  // tick; never let that carry the ramp past its target, which for a ramp to
+  // 0 would turn into a negative duty and near full output
+  if ((step < 0) ? (step < remaining) : (step > remaining))
+  {
+    step = remaining;
+  }
+  key->duty_q16 += step;
+  KeyDriver_WriteDuty(index, key);
+  KeyDriver_ScheduleTick(index, key, deadline);
+}
+
 // Initialize the key driver module
 void KeyDriver_Init(KeyDriverModule_t *key_driver)
 {
@@ -15,59 +289,185 @@ void KeyDriver_Init(KeyDriverModule_t *key_driver)
   for (uint8_t i = 0; i < NUM_KEYS; i++)
   {
     key_driver->keys[i].state = KEY_STATE_IDLE;
-    key_driver->keys[i].initial_strike_start_time = 0;
-    key_driver->keys[i].followup_start_time = 0;
-    key_driver->keys[i].initial_duty_cycle = 0;
-    key_driver->keys[i].followup_duty_cycle = 0;
-    key_driver->keys[i].hold_duty_cycle = HOLD_DUTY_CYCLE;
-    key_driver->keys[i].initial_strike_time_ms = INITIAL_STRIKE_TIME_MS;
-    key_driver->keys[i].followup_time_ms = 0;
+    key_driver->keys[i].segment = 0;
+    key_driver->keys[i].segment_count = 0;
+    key_driver->keys[i].output_duty = 0;
+    key_driver->keys[i].duty_cap = PWM_DUTY_MAX;
+    key_driver->keys[i].hold_scale = KEY_HOLD_SCALE_FULL;
+    key_driver->keys[i].duty_q16 = 0;
+    key_driver->keys[i].step_q16 = 0;
+    key_driver->keys[i].segment_end_us = 0;
+    key_driver->keys[i].admit_by_us = 0;
+    key_driver->keys[i].strike_duty = 0;
+    key_driver->keys[i].release.duty_cycle = 0;
+    key_driver->keys[i].release.ramp = KEY_RAMP_STEP;
+    key_driver->keys[i].release.duration_ms = 0;
+  }
+
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    key_driver->active[word] = 0;
+    key_driver->waiting[word] = 0;
   }
 
   // Set global hold duty cycle
   key_driver->hold_duty_cycle = HOLD_DUTY_CYCLE;
+  key_driver->staggered_strikes = 0;
+  key_driver->max_stagger_us = 0;
+
+  // Segment changes and ramp ticks run from the TIM1 compare interrupt
+  g_timed_driver = key_driver;
+  KeyTimer_Init(KeyDriver_OnDeadline);
 }
 
-// Press a key with specified duty cycle and optional timing parameters
-void KeyDriver_PressKey(KeyDriverModule_t *key_driver, uint8_t key, uint8_t duty_cycle, uint16_t initial_strike_time, uint8_t followup_duty_cycle, uint16_t followup_time, uint8_t hold_duty_cycle)
+// Turn full-format press parameters into step segments: strike, optional
+// follow-up, then hold. Returns the number of segments (2 or 3).
+uint8_t KeyDriver_BuildSegments(KeySegment_t *segments, uint8_t duty_cycle, uint16_t initial_strike_time, uint8_t followup_duty_cycle, uint16_t followup_time, uint8_t hold_duty_cycle)
 {
-  if (key_driver == NULL || key >= NUM_KEYS)
-  {
-    return;
-  }
+  uint8_t count = 0;
 
-  // Clamp duty cycle to valid range (0-100)
+  // Clamp duty cycles to valid range (0-100)
   if (duty_cycle > 100)
   {
     duty_cycle = 100;
   }
-
-  // Clamp follow-up duty cycle to valid range (0-100)
   if (followup_duty_cycle > 100)
   {
     followup_duty_cycle = 100;
   }
-
-  // Clamp hold duty cycle to valid range (0-100)
   if (hold_duty_cycle > 100)
   {
     hold_duty_cycle = 100;
   }
 
-  // Set key state to initial strike
-  key_driver->keys[key].state = KEY_STATE_INITIAL_STRIKE;
-  key_driver->keys[key].initial_strike_start_time = HAL_GetTick();
-  key_driver->keys[key].followup_start_time = 0;
-  key_driver->keys[key].initial_duty_cycle = duty_cycle;
-  key_driver->keys[key].followup_duty_cycle = followup_duty_cycle;
-  key_driver->keys[key].hold_duty_cycle = (hold_duty_cycle > 0) ? hold_duty_cycle : HOLD_DUTY_CYCLE;
+  // Initial strike (use default time if 0)
+  segments[count].duty_cycle = duty_cycle;
+  segments[count].ramp = KEY_RAMP_STEP;
+  segments[count].duration_ms = (initial_strike_time > 0) ? initial_strike_time : INITIAL_STRIKE_TIME_MS;
+  count++;
+
+  // Follow-up, only with both parameters
+  if (followup_duty_cycle > 0 && followup_time > 0)
+  {
+    segments[count].duty_cycle = followup_duty_cycle;
+    segments[count].ramp = KEY_RAMP_STEP;
+    segments[count].duration_ms = followup_time;
+    count++;
+  }
+
+  // Hold (use default duty cycle if 0)
+  segments[count].duty_cycle = (hold_duty_cycle > 0) ? hold_duty_cycle : HOLD_DUTY_CYCLE;
+  segments[count].ramp = KEY_RAMP_STEP;
+  segments[count].duration_ms = 0;
+  count++;
+
+  return count;
+}
+
+// Press a key with specified duty cycle and optional timing parameters
+void KeyDriver_PressKey(KeyDriverModule_t *key_driver, uint8_t key, uint8_t duty_cycle, uint16_t initial_strike_time, uint8_t followup_duty_cycle, uint16_t followup_time, uint8_t hold_duty_cycle)
+{
+  KeySegment_t segments[KEY_MAX_SEGMENTS];
+  uint8_t count = KeyDriver_BuildSegments(segments, duty_cycle, initial_strike_time, followup_duty_cycle,
+                                          followup_time, hold_duty_cycle);
+
+  KeyDriver_PressEnvelope(key_driver, key, segments, count);
+}
+
+// Load an envelope into a key whose deadline has been cancelled, ready for segment 0
+static void KeyDriver_LoadEnvelope(KeyDriverModule_t *key_driver, uint8_t key, KeyDriver_t *state,
+                                   const KeySegment_t *segments, uint8_t segment_count)
+{
+  KeyDriver_SetState(key_driver, key, state, KEY_STATE_ENVELOPE);
+
+  if (segment_count > KEY_MAX_SEGMENTS)
+  {
+    segment_count = KEY_MAX_SEGMENTS;
+  }
+
+  // Copy the segments and work out each ramp's rate; the only divisions are here
+  for (uint8_t i = 0; i < segment_count; i++)
+  {
+    KeySegment_t segment = segments[i];
+    if (segment.duty_cycle > 100)
+    {
+      segment.duty_cycle = 100;
+    }
+
+    uint32_t ticks = ((uint32_t)segment.duration_ms * 1000) / KEY_RAMP_TICK_US;
+    uint32_t rate = 0;
+    if (ticks > 1 && segment.ramp == KEY_RAMP_LINEAR)
+    {
+      rate = 0x10000 / ticks;
+    }
+    else if (ticks > 1 && segment.ramp == KEY_RAMP_EXPONENTIAL)
+    {
+      // Three time constants per segment leave ~5% for the final snap
+      rate = (ticks > 3) ? (3 * 0x10000) / ticks : 0x10000;
+    }
+
+    state->segments[i] = segment;
+    state->rates[i] = rate;
+  }
+  state->segment_count = segment_count;
+  state->segment = 0;
+
+  // The strike goes through the power budget; the key's own output, if it
+  // is still sounding, is replaced by it and not counted
+  state->strike_duty = PWM_PERCENT_TO_DUTY(state->segments[0].duty_cycle);
+  if (state->strike_duty > state->duty_cap)
+  {
+    state->strike_duty = state->duty_cap;
+  }
+}
+
+// Press a key with an envelope of up to KEY_MAX_SEGMENTS segments
+void KeyDriver_PressEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments, uint8_t segment_count)
+{
+  if (key_driver == NULL || key >= NUM_KEYS || segments == NULL || segment_count == 0)
+  {
+    return;
+  }
+
+  // Keep the interrupt off this key while it is rewritten
+  KeyTimer_Cancel(key);
+  KeyDriver_t *state = &key_driver->keys[key];
+  KeyDriver_LoadEnvelope(key_driver, key, state, segments, segment_count);
 
-  // Set timing parameters (use defaults if 0)
-  key_driver->keys[key].initial_strike_time_ms = (initial_strike_time > 0) ? initial_strike_time : INITIAL_STRIKE_TIME_MS;
-  key_driver->keys[key].followup_time_ms = followup_time;
+  uint32_t now = Timebase_Micros();
+  state->admit_by_us = now + KEY_POWER_MAX_DELAY_US;
 
-  // Immediately set the initial duty cycle
-  PWM_SetDutyCycle(key, duty_cycle);
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  KeyDriver_Admit(key_driver, key, state, now);
+  __set_PRIMASK(primask);
+}
+
+// Re-strike a key with an envelope: a key that is down is partly released
+// first, one that is up is pressed straight away
+void KeyDriver_RestrikeEnvelope(KeyDriverModule_t *key_driver, uint8_t key, const KeySegment_t *segments, uint8_t segment_count)
+{
+  if (key_driver == NULL || key >= NUM_KEYS || segments == NULL || segment_count == 0)
+  {
+    return;
+  }
+
+  KeyDriver_t *state = &key_driver->keys[key];
+  if (state->state == KEY_STATE_IDLE || state->output_duty == 0)
+  {
+    KeyDriver_PressEnvelope(key_driver, key, segments, segment_count);
+    return;
+  }
+
+  KeyTimer_Cancel(key);
+  KeyDriver_LoadEnvelope(key_driver, key, state, segments, segment_count);
+
+  // Let the key rise for the reset time; the strike follows from the key timer
+  KeyDriver_SetState(key_driver, key, state, KEY_STATE_RESET);
+  state->duty_q16 = (int32_t)KEY_RESTRIKE_DUTY << KEY_DUTY_SHIFT;
+  KeyDriver_WriteDuty(key, state);
+  state->segment_end_us = Timebase_Micros() + KEY_RESTRIKE_RESET_MS * 1000;
+  KeyTimer_Schedule(key, state->segment_end_us);
 }
 
 // Release a key (set duty cycle to 0)
@@ -78,68 +478,89 @@ void KeyDriver_ReleaseKey(KeyDriverModule_t *key_driver, uint8_t key)
     return;
   }
 
-  // Set key state to idle
-  key_driver->keys[key].state = KEY_STATE_IDLE;
+  // An idle key's output is already 0, and a releasing one is on its way there
+  KeyDriver_t *state = &key_driver->keys[key];
+  if (state->state == KEY_STATE_IDLE || state->state == KEY_STATE_RELEASING)
+  {
+    return;
+  }
+
+  KeyTimer_Cancel(key);
+
+  // Ramp down from wherever the output is, as a one-segment envelope to 0
+  if (state->release.duration_ms > 0 && state->release.ramp != KEY_RAMP_STEP && state->output_duty > 0)
+  {
+    // The ramp starts from the output itself, after the hold scale and the
+    // thermal cap, so a derated key does not sit at the cap before it falls
+    state->duty_q16 = (int32_t)(((uint64_t)state->output_duty * (100u << KEY_DUTY_SHIFT) + PWM_DUTY_MAX / 2) /
+                                PWM_DUTY_MAX);
+    KeyDriver_LoadEnvelope(key_driver, key, state, &state->release, 1);
+    KeyDriver_SetState(key_driver, key, state, KEY_STATE_RELEASING);
+    KeyDriver_StartSegment(key_driver, key, state, Timebase_Micros());
+    return;
+  }
+
+  // Set key state to idle, with no segment change left pending
+  KeyDriver_SetState(key_driver, key, state, KEY_STATE_IDLE);
+  key_driver->keys[key].duty_q16 = 0;
 
   // Set duty cycle to 0
-  PWM_SetDutyCycle(key, 0);
+  key_driver->keys[key].output_duty = 0;
+  Channel_SetDuty(key, 0);
 }
 
-// Update key driver state machine (call this in main loop)
-void KeyDriver_Update(KeyDriverModule_t *key_driver)
+// Release every key (all notes off)
+void KeyDriver_ReleaseAll(KeyDriverModule_t *key_driver)
 {
   if (key_driver == NULL)
   {
     return;
   }
 
-  uint32_t current_time = HAL_GetTick();
-
-  for (uint8_t i = 0; i < NUM_KEYS; i++)
+  // Only keys that are not idle have anything to release; each word is read
+  // once, since releasing clears bits in it
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
   {
-    KeyDriver_t *key = &key_driver->keys[i];
-
-    switch (key->state)
+    for (uint32_t bits = key_driver->active[word]; bits != 0; bits &= bits - 1)
     {
-    case KEY_STATE_IDLE:
-      // Nothing to do in idle state
-      break;
+      KeyDriver_ReleaseKey(key_driver, (word << 5) + KEY_MASK_LOWEST(bits));
+    }
+  }
+}
 
-    case KEY_STATE_INITIAL_STRIKE:
-      // Check if initial strike time has elapsed
-      if ((current_time - key->initial_strike_start_time) >= key->initial_strike_time_ms)
-      {
-        // Check if we have follow-up parameters
-        if (key->followup_duty_cycle > 0 && key->followup_time_ms > 0)
-        {
-          // Transition to follow-up state
-          key->state = KEY_STATE_FOLLOWUP;
-          key->followup_start_time = current_time;
-          PWM_SetDutyCycle(i, key->followup_duty_cycle);
-        }
-        else
-        {
-          // Transition directly to hold state
-          key->state = KEY_STATE_HOLD;
-          PWM_SetDutyCycle(i, key->hold_duty_cycle);
-        }
-      }
-      break;
+// Set a key's thermal limits (main loop). A held key is rewritten at once; the
+// compare interrupt leaves held keys alone, so this cannot race it. A key
+// running an envelope picks the limits up on its next write.
+void KeyDriver_SetThermalLimit(KeyDriverModule_t *key_driver, uint8_t key, uint16_t duty_cap, uint16_t hold_scale)
+{
+  if (key_driver == NULL || key >= NUM_KEYS)
+  {
+    return;
+  }
 
-    case KEY_STATE_FOLLOWUP:
-      // Check if follow-up time has elapsed
-      if ((current_time - key->followup_start_time) >= key->followup_time_ms)
-      {
-        // Transition to hold state
-        key->state = KEY_STATE_HOLD;
-        PWM_SetDutyCycle(i, key->hold_duty_cycle);
-      }
-      break;
+  KeyDriver_t *state = &key_driver->keys[key];
+  if (state->duty_cap == duty_cap && state->hold_scale == hold_scale)
+  {
+    return;
+  }
 
-    case KEY_STATE_HOLD:
-      // Continue holding at hold duty cycle
-      // This state is maintained until key is released
-      break;
-    }
+  state->duty_cap = duty_cap;
+  state->hold_scale = hold_scale;
+  if (state->state == KEY_STATE_HOLD)
+  {
+    KeyDriver_WriteDuty(key, state);
   }
 }
+
+// Set a key's release ramp (KeyRamp_t, duration 0 or a step to cut at once);
+// a release already running keeps the ramp it started with
+void KeyDriver_SetRelease(KeyDriverModule_t *key_driver, uint8_t key, uint8_t ramp, uint16_t duration_ms)
+{
+  if (key_driver == NULL || key >= NUM_KEYS || ramp > KEY_RAMP_EXPONENTIAL)
+  {
+    return;
+  }
+
+  key_driver->keys[key].release.ramp = ramp;
+  key_driver->keys[key].release.duration_ms = duration_ms;
+}
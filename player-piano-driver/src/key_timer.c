@@ -0,0 +1,193 @@
+#include "key_timer.h"
+#include "timebase.h"
+#include <string.h>
+
+// Pending deadlines, sorted: g_order[0] is the key due first
+static uint32_t g_deadlines[NUM_KEYS];
+static uint8_t g_order[NUM_KEYS];
+static volatile uint8_t g_count = 0;
+static KeyTimer_Callback_t g_callback = NULL;
+static KeyTimerStats_t g_stats;
+
+/**
+ * @brief Remove a key from the sorted list (interrupts masked or in the ISR)
+ * @return 1 if the key had a pending deadline
+ */
+static uint8_t KeyTimer_Remove(uint8_t key)
+{
+  for (uint8_t i = 0; i < g_count; i++)
+  {
+    if (g_order[i] == key)
+    {
+      memmove(&g_order[i], &g_order[i + 1], g_count - i - 1);
+      g_count--;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Program the compare for the earliest deadline (interrupts masked or in the ISR)
+ */
+static void KeyTimer_Arm(void)
+{
+  TIM_TypeDef *tim = TIMEBASE_TIM_INSTANCE;
+
+  if (g_count == 0)
+  {
+    tim->DIER &= ~TIM_DIER_CC1IE;
+    return;
+  }
+
+  // The low 16 bits of the timebase are the counter itself
+  uint32_t now = Timebase_Micros();
+  uint32_t compare = g_deadlines[g_order[0]];
+  if ((int32_t)(compare - now) > KEY_TIMER_MAX_ARM_US)
+  {
+    compare = now + KEY_TIMER_MAX_ARM_US; // Wake up on the way there
+  }
+
+  tim->CCR1 = (uint16_t)compare;
+  tim->SR = ~TIM_SR_CC1IF;
+  tim->DIER |= TIM_DIER_CC1IE;
+
+  // A compare already passed would only match a whole counter period later
+  if (TIMEBASE_REACHED(Timebase_Micros(), compare))
+  {
+    tim->EGR = TIM_EGR_CC1G;
+  }
+}
+
+/**
+ * @brief Set up compare channel 1 of the timebase timer
+ *
+ * Timebase_Init must have started TIM1 already. The channel stays in frozen
+ * (timing only) mode, so it never drives a pin.
+ * @param callback: Function run from the interrupt for each deadline reached
+ */
+void KeyTimer_Init(KeyTimer_Callback_t callback)
+{
+  g_callback = callback;
+  g_count = 0;
+  memset(&g_stats, 0, sizeof(g_stats));
+
+  TIMEBASE_TIM_INSTANCE->DIER &= ~TIM_DIER_CC1IE;
+  TIMEBASE_TIM_INSTANCE->SR = ~TIM_SR_CC1IF;
+
+  // Same preemption level as the receive path and timebase overflow, which
+  // Timebase_Micros accounts for itself if it is still pending
+  HAL_NVIC_SetPriority(TIM1_CC_IRQn, 0, 2);
+  HAL_NVIC_EnableIRQ(TIM1_CC_IRQn);
+}
+
+/**
+ * @brief Set a key's deadline, replacing any it had
+ * @param key: Key index
+ * @param deadline: Timebase time in us, at most ~35 minutes ahead
+ */
+void KeyTimer_Schedule(uint8_t key, uint32_t deadline)
+{
+  if (key >= NUM_KEYS)
+  {
+    return;
+  }
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  KeyTimer_Remove(key);
+
+  // Insert after every deadline that is not later
+  uint8_t position = g_count;
+  while (position > 0 && (int32_t)(g_deadlines[g_order[position - 1]] - deadline) > 0)
+  {
+    g_order[position] = g_order[position - 1];
+    position--;
+  }
+  g_order[position] = key;
+  g_deadlines[key] = deadline;
+  g_count++;
+
+  if (position == 0)
+  {
+    KeyTimer_Arm();
+  }
+
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief Drop a key's pending deadline, if any
+ *
+ * Once this returns, the callback will not run for the key until it is
+ * scheduled again.
+ * @param key: Key index
+ */
+void KeyTimer_Cancel(uint8_t key)
+{
+  if (key >= NUM_KEYS)
+  {
+    return;
+  }
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  uint8_t was_first = (g_count > 0 && g_order[0] == key);
+  if (KeyTimer_Remove(key) && was_first)
+  {
+    KeyTimer_Arm();
+  }
+
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief Get deadline timing statistics
+ * @return Pointer to statistics
+ */
+const KeyTimerStats_t *KeyTimer_GetStats(void)
+{
+  return &g_stats;
+}
+
+/**
+ * @brief TIM1 capture/compare interrupt handler
+ *
+ * Runs the callback for every deadline reached, in deadline order; a callback
+ * may schedule the key's next deadline straight away.
+ */
+void TIM1_CC_IRQHandler(void)
+{
+  if (!(TIMEBASE_TIM_INSTANCE->SR & TIM_SR_CC1IF))
+  {
+    return;
+  }
+  TIMEBASE_TIM_INSTANCE->SR = ~TIM_SR_CC1IF;
+
+  uint32_t now = Timebase_Micros();
+  while (g_count > 0 && TIMEBASE_REACHED(now, g_deadlines[g_order[0]]))
+  {
+    uint8_t key = g_order[0];
+    uint32_t deadline = g_deadlines[key];
+    KeyTimer_Remove(key);
+
+    if (now - deadline > g_stats.max_late_us)
+    {
+      g_stats.max_late_us = now - deadline;
+    }
+    g_stats.fired++;
+
+    if (g_callback != NULL)
+    {
+      g_callback(key, deadline);
+    }
+    now = Timebase_Micros();
+  }
+
+  // Duty changes made by the callbacks go out in one commit
+  Channel_Commit();
+  KeyTimer_Arm();
+}
@@ -1,12 +1,26 @@
 #include "stm32f1xx_hal.h"
 #include "gpio_config.h"
-#include "pwm_output_config.h"
+#include "channel_backend.h"
 #include "key_driver.h"
 #include "rs485.h"
 #include "command_parser.h"
 #include "stepper_motor.h"
+#include "board_config.h"
+#include "timebase.h"
+#include "clock_sync.h"
+#include "scheduler.h"
+#include "envelope_profile.h"
+#include "midi_input.h"
+#include "thermal_model.h"
+#include "key_calibration.h"
 
-static uint32_t last_update_time = 0;
+// Main loop stage budgets; the stepper runs between every two stages, so the
+// largest budget plus one unit of work bounds its step jitter
+#define MAIN_BUS_BUDGET_US 20      // Receive scan, already capped per call in rs485.h
+#define MAIN_COMMAND_BUDGET_US 20  // Coalesced command batches
+#define MAIN_THERMAL_BUDGET_US 20  // Coil temperature sample, and derating every 64th
+#define MAIN_SAVE_BUDGET_US 20     // Idle check; a save itself stalls for a whole page erase
+#define MAIN_SAVE_PERIOD_US 10000
 
 // Stepper motor demo variables
 static uint32_t demo_start_time = 0;
@@ -15,40 +29,97 @@ static uint8_t demo_phase = 0;
 // Global stepper motor instance
 extern StepperMotor_t g_stepper_motor;
 
+// Stepper step timing, run before every other stage
+static SchedulerResult_t Main_StepperStage(uint32_t deadline)
+{
+  (void)deadline;
+  StepperMotor_Update(&g_stepper_motor);
+  return SCHEDULER_DONE;
+}
+
+// Parse frames the DMA has received since the last pass
+static SchedulerResult_t Main_BusStage(uint32_t deadline)
+{
+  (void)deadline;
+  RS485_Update();
+  return SCHEDULER_DONE;
+}
+
+// Run queued commands as soon as they are due, not on the next 1ms tick
+static SchedulerResult_t Main_CommandStage(uint32_t deadline)
+{
+  uint8_t more = CommandParser_ProcessQueue(CommandParser_GetQueue(), &g_key_driver, deadline);
+  return more ? SCHEDULER_MORE : SCHEDULER_DONE;
+}
+
+// Track coil temperatures and push any derating out to the outputs
+static SchedulerResult_t Main_ThermalStage(uint32_t deadline)
+{
+  (void)deadline;
+  ThermalModel_Sample();
+  Channel_Commit();
+  return SCHEDULER_DONE;
+}
+
+// Store tables marked for saving once nothing is playing; the only stage
+// that overruns its budget, and only while the board is idle
+static SchedulerResult_t Main_SaveStage(uint32_t deadline)
+{
+  (void)deadline;
+  CommandParser_ProcessSaves(&g_key_driver);
+  return SCHEDULER_DONE;
+}
+
 int main(void)
 {
   HAL_Init();
 
   GPIO_Init();
-  PWM_Init();
-  PWM_Start();
-  RS485_Init();
+  Channel_Init();
+  Channel_Start();
+  Timebase_Init();
+  ClockSync_Init();
+
+  // Load bus address, envelope profiles and key calibration from flash before accepting any frames;
+  // key envelope phases run from TIM1 compare interrupts, so the timebase comes first
+  BoardConfig_Init();
+  EnvelopeProfile_Init();
+  KeyCalibration_Init();
   KeyDriver_Init(&g_key_driver);
+  ThermalModel_Init(&g_key_driver);
   CommandParser_Init(&g_key_driver);
 
+  // Take commands from the main controller, or MIDI straight from a MIDI source;
+  // a unit with nothing to play on MIDI stays on the bus
+  const BoardConfig_t *config = BoardConfig_Get();
+  if (config->input_mode == BOARD_INPUT_MIDI &&
+      MidiInput_Init(MIDI_INPUT_CHANNEL, config->unit_address,
+                     (config->group_mask & RS485_GROUP_BIT(RS485_GROUP_PEDAL)) != 0) == HAL_OK)
+  {
+    RS485_InitRaw(MIDI_INPUT_BAUDRATE, MidiInput_ProcessByte);
+  }
+  else
+  {
+    RS485_SetAddressFilter(config->unit_address, config->group_mask);
+    RS485_Init();
+  }
+
   // Initialize stepper motor (includes ADC init and calibration)
   StepperMotor_Init(&g_stepper_motor);
   StepperMotor_SetSpeed(&g_stepper_motor, 1500);
 
-  last_update_time = HAL_GetTick();
   demo_start_time = HAL_GetTick();
 
+  Scheduler_Init(Main_StepperStage);
+  Scheduler_AddStage(Main_BusStage, 0, MAIN_BUS_BUDGET_US);
+  Scheduler_AddStage(Main_CommandStage, 0, MAIN_COMMAND_BUDGET_US);
+  Scheduler_AddStage(Main_ThermalStage, THERMAL_SAMPLE_US, MAIN_THERMAL_BUDGET_US);
+  Scheduler_AddStage(Main_SaveStage, MAIN_SAVE_PERIOD_US, MAIN_SAVE_BUDGET_US);
+
   // Main loop - non-blocking
   while (1)
   {
-    uint32_t current_time = HAL_GetTick();
-
-    // Always update stepper motor for accurate timing
-    StepperMotor_Update(&g_stepper_motor);
-
-    // Update other systems at 1ms intervals
-    if ((current_time - last_update_time) >= 1)
-    {
-      KeyDriver_Update(&g_key_driver);
-      CommandParser_ProcessQueue(CommandParser_GetQueue(), &g_key_driver);
-
-      last_update_time = current_time;
-    }
+    Scheduler_RunPass();
   }
 }
 
@@ -0,0 +1,160 @@
+#include "midi_input.h"
+#include "command_parser.h"
+#include <string.h>
+
+// Decoder state
+typedef struct
+{
+  uint8_t status;       // Running status, 0 if none (after system common or at start)
+  uint8_t data[2];      // Data bytes of the message being read
+  uint8_t data_count;   // Data bytes read so far
+  uint8_t data_needed;  // Data bytes the running status takes
+  uint8_t in_sysex;     // 1 between 0xF0 and the next status byte
+} MidiDecoder_t;
+
+static MidiDecoder_t g_decoder;
+static MidiInputStats_t g_stats;
+
+// Filter
+static uint8_t g_channel = MIDI_INPUT_OMNI;
+static uint8_t g_unit = 0;
+static uint8_t g_pedal = 0; // 1 if this board drives the sustain pedal
+
+/**
+ * @brief Start decoding
+ * @param channel: MIDI channel 0-15, or MIDI_INPUT_OMNI
+ * @param unit: Unit number, which selects the keyboard blocks this board plays
+ * @param pedal: 1 to follow the sustain controller
+ * @return HAL status, HAL_ERROR if the unit would play no note and no pedal
+ */
+HAL_StatusTypeDef MidiInput_Init(uint8_t channel, uint8_t unit, uint8_t pedal)
+{
+  // First note of the unit's first block; wider than a note number, as high
+  // unit numbers are past the end of the MIDI range
+  uint16_t first_note = MIDI_INPUT_LOWEST_NOTE + (uint16_t)unit * NUM_KEYS;
+  if (!pedal && (unit >= MIDI_INPUT_NUM_BOARDS || first_note >= MIDI_INPUT_LOWEST_NOTE + MIDI_INPUT_NUM_NOTES))
+  {
+    return HAL_ERROR;
+  }
+
+  memset(&g_decoder, 0, sizeof(g_decoder));
+  memset(&g_stats, 0, sizeof(g_stats));
+  g_channel = channel;
+  g_unit = unit;
+  g_pedal = pedal;
+  return HAL_OK;
+}
+
+/**
+ * @brief Act on a complete channel message
+ */
+static void MidiInput_Dispatch(void)
+{
+  uint8_t kind = g_decoder.status & 0xF0;
+  uint8_t channel = g_decoder.status & 0x0F;
+  ParsedCommand_t command = {0};
+
+  g_stats.messages++;
+  if (g_channel != MIDI_INPUT_OMNI && channel != g_channel)
+  {
+    return;
+  }
+
+  if (kind == 0x90 || kind == 0x80)
+  {
+    uint8_t key_index = g_decoder.data[0] - MIDI_INPUT_LOWEST_NOTE;
+    if (g_decoder.data[0] < MIDI_INPUT_LOWEST_NOTE || key_index >= MIDI_INPUT_NUM_NOTES ||
+        (key_index / NUM_KEYS) % MIDI_INPUT_NUM_BOARDS != g_unit)
+    {
+      return; // Off the keyboard, or another board's note
+    }
+
+    g_stats.notes++;
+    command.channel = key_index % NUM_KEYS;
+    if (kind == 0x90 && g_decoder.data[1] > 0)
+    {
+      CommandParser_VelocityPress(&command, g_decoder.data[1]);
+    }
+    else
+    {
+      command.type = COMMAND_RELEASE; // Note off, or note on with velocity 0
+    }
+  }
+  else if (kind == 0xB0 && g_decoder.data[0] == MIDI_CC_SUSTAIN && g_pedal)
+  {
+    command.type = (g_decoder.data[1] >= 64) ? COMMAND_PEDAL_PRESS : COMMAND_PEDAL_RELEASE;
+  }
+  else if (kind == 0xB0 && g_decoder.data[0] == MIDI_CC_ALL_NOTES_OFF)
+  {
+    command.type = COMMAND_RELEASE_ALL;
+  }
+  else
+  {
+    return;
+  }
+
+  // Untimed: runs on the next pass of the main loop
+  if (CommandParser_Submit(&command) != HAL_OK)
+  {
+    g_stats.dropped++;
+  }
+}
+
+/**
+ * @brief Feed one received byte to the decoder
+ *
+ * Real-time bytes (0xF8-0xFF) may appear anywhere, even inside a message,
+ * and are skipped without touching the decoder. System exclusive data is
+ * skipped up to the next status byte. System common messages cancel running
+ * status, so their data bytes are skipped too.
+ * @param byte: Received byte
+ * @param time: Local time the byte arrived in us (unused, commands run on arrival)
+ */
+void MidiInput_ProcessByte(uint8_t byte, uint32_t time)
+{
+  (void)time;
+
+  if (byte >= 0xF8)
+  {
+    return;
+  }
+
+  if (byte & 0x80)
+  {
+    g_decoder.in_sysex = (byte == 0xF0);
+    g_decoder.data_count = 0;
+
+    if (byte >= 0xF0)
+    {
+      g_decoder.status = 0;
+      return;
+    }
+
+    // Program change and channel pressure take one data byte, the rest two
+    g_decoder.status = byte;
+    g_decoder.data_needed = ((byte & 0xF0) == 0xC0 || (byte & 0xF0) == 0xD0) ? 1 : 2;
+    return;
+  }
+
+  if (g_decoder.in_sysex || g_decoder.status == 0)
+  {
+    return;
+  }
+
+  g_decoder.data[g_decoder.data_count++] = byte;
+  if (g_decoder.data_count == g_decoder.data_needed)
+  {
+    // Running status: the next data byte starts another message of this kind
+    g_decoder.data_count = 0;
+    MidiInput_Dispatch();
+  }
+}
+
+/**
+ * @brief Get MIDI receive statistics
+ * @return Pointer to statistics
+ */
+const MidiInputStats_t *MidiInput_GetStats(void)
+{
+  return &g_stats;
+}
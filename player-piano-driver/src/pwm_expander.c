@@ -0,0 +1,180 @@
+#include "pwm_expander.h"
+#include "channel_backend.h"
+#include <string.h>
+
+#if PWM_EXPANDER_CHIPS > 0
+
+static SPI_HandleTypeDef hspi2;
+static DMA_HandleTypeDef hdma_spi2_tx;
+
+// 12-bit duties by expander channel, staged by PwmExpander_SetDuty
+static uint16_t g_expander_staged[PWM_EXPANDER_CHANNELS];
+static uint8_t g_expander_frame[PWM_EXPANDER_CHIPS * PWM_EXPANDER_BYTES_PER_CHIP];
+static volatile uint8_t g_expander_dirty = 0;
+static volatile uint8_t g_expander_busy = 0;
+
+/**
+ * @brief Pack the staged duties into the shift frame
+ *
+ * The first bit shifted ends up in the far chip's channel 23, so channels go
+ * out from the last down to the first, two 12-bit duties per three bytes.
+ */
+static void PwmExpander_Pack(void)
+{
+  uint8_t *out = g_expander_frame;
+
+  for (int16_t channel = PWM_EXPANDER_CHANNELS - 1; channel > 0; channel -= 2)
+  {
+    uint16_t high = g_expander_staged[channel];
+    uint16_t low = g_expander_staged[channel - 1];
+    *out++ = (uint8_t)(high >> 4);
+    *out++ = (uint8_t)((high << 4) | (low >> 8));
+    *out++ = (uint8_t)low;
+  }
+}
+
+/**
+ * @brief Set up SPI2, its transmit DMA and the latch pins; every output starts blanked
+ */
+void PwmExpander_Init(void)
+{
+  __HAL_RCC_GPIOB_CLK_ENABLE();
+  __HAL_RCC_SPI2_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  // SCK and MOSI
+  GPIO_InitStruct.Pin = GPIO_PIN_13 | GPIO_PIN_15;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+  // XLAT low, BLANK high until the first frame is latched
+  HAL_GPIO_WritePin(PWM_EXPANDER_XLAT_PORT, PWM_EXPANDER_XLAT_PIN, GPIO_PIN_RESET);
+  HAL_GPIO_WritePin(PWM_EXPANDER_BLANK_PORT, PWM_EXPANDER_BLANK_PIN, GPIO_PIN_SET);
+  GPIO_InitStruct.Pin = PWM_EXPANDER_XLAT_PIN | PWM_EXPANDER_BLANK_PIN;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+  // Mode 0, MSB first, 9 MHz from the 36 MHz APB1 clock
+  hspi2.Instance = SPI2;
+  hspi2.Init.Mode = SPI_MODE_MASTER;
+  hspi2.Init.Direction = SPI_DIRECTION_2LINES;
+  hspi2.Init.DataSize = SPI_DATASIZE_8BIT;
+  hspi2.Init.CLKPolarity = SPI_POLARITY_LOW;
+  hspi2.Init.CLKPhase = SPI_PHASE_1EDGE;
+  hspi2.Init.NSS = SPI_NSS_SOFT;
+  hspi2.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_4;
+  hspi2.Init.FirstBit = SPI_FIRSTBIT_MSB;
+  hspi2.Init.TIMode = SPI_TIMODE_DISABLE;
+  hspi2.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
+  if (HAL_SPI_Init(&hspi2) != HAL_OK)
+  {
+    // Error handling
+  }
+
+  hdma_spi2_tx.Instance = DMA1_Channel5;
+  hdma_spi2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma_spi2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_spi2_tx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_spi2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_spi2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_spi2_tx.Init.Mode = DMA_NORMAL;
+  hdma_spi2_tx.Init.Priority = DMA_PRIORITY_MEDIUM; // Below the RS485 receive DMA
+  if (HAL_DMA_Init(&hdma_spi2_tx) != HAL_OK)
+  {
+    // Error handling
+  }
+  __HAL_LINKDMA(&hspi2, hdmatx, hdma_spi2_tx);
+
+  // Below the key timer, which commits from its own interrupt
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 3);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+  memset(g_expander_staged, 0, sizeof(g_expander_staged));
+  g_expander_dirty = 1;
+}
+
+/**
+ * @brief Send the initial all-off frame; BLANK is released once it is latched
+ */
+void PwmExpander_Start(void)
+{
+  PwmExpander_Commit();
+}
+
+/**
+ * @brief Stage an expander channel's duty for the next commit
+ * @param channel: Channel along the chain, 0 = first chip's output 0
+ * @param duty: Output duty, PWM_DUTY_MAX = full
+ */
+void PwmExpander_SetDuty(uint8_t channel, uint16_t duty)
+{
+  if (channel >= PWM_EXPANDER_CHANNELS)
+  {
+    return;
+  }
+
+  g_expander_staged[channel] = duty >> 4;
+  g_expander_dirty = 1;
+}
+
+/**
+ * @brief Shift the staged duties out, or leave them for when the frame in flight is latched
+ */
+void PwmExpander_Commit(void)
+{
+  if (!g_expander_dirty)
+  {
+    return;
+  }
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  // Left for the main loop's own commit while it has a batch part staged
+  if (!g_expander_busy && !Channel_BatchOpen())
+  {
+    g_expander_dirty = 0;
+    g_expander_busy = 1;
+    PwmExpander_Pack();
+    if (HAL_SPI_Transmit_DMA(&hspi2, g_expander_frame, sizeof(g_expander_frame)) != HAL_OK)
+    {
+      // Try again on the next commit
+      g_expander_dirty = 1;
+      g_expander_busy = 0;
+    }
+  }
+
+  __set_PRIMASK(primask);
+}
+
+/**
+ * @brief SPI transmit complete: latch the frame and send anything staged since
+ */
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  if (hspi->Instance != SPI2)
+  {
+    return;
+  }
+
+  // The HAL has waited for the last bit to leave, so every chip holds its data
+  HAL_GPIO_WritePin(PWM_EXPANDER_XLAT_PORT, PWM_EXPANDER_XLAT_PIN, GPIO_PIN_SET);
+  HAL_GPIO_WritePin(PWM_EXPANDER_XLAT_PORT, PWM_EXPANDER_XLAT_PIN, GPIO_PIN_RESET);
+  HAL_GPIO_WritePin(PWM_EXPANDER_BLANK_PORT, PWM_EXPANDER_BLANK_PIN, GPIO_PIN_RESET);
+
+  g_expander_busy = 0;
+  PwmExpander_Commit();
+}
+
+/**
+ * @brief DMA1 channel 5 (SPI2_TX) interrupt handler
+ */
+void DMA1_Channel5_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_spi2_tx);
+}
+
+#endif // PWM_EXPANDER_CHIPS > 0
@@ -1,52 +1,143 @@
 #include "pwm_output_config.h"
+#include "channel_backend.h"
+#include <string.h>
 
 // Timer handles for PWM generation
 TIM_HandleTypeDef htim2;
 TIM_HandleTypeDef htim3;
 TIM_HandleTypeDef htim4;
 
+// DMA for the CCR bursts: TIM2_UP on channel 2 and TIM4_UP on channel 7.
+// TIM3_UP shares channel 3 with USART3 RX, so TIM3 uses its CC1 request on
+// channel 6 instead, moved to the update event by CCDS.
+static DMA_HandleTypeDef hdma_pwm[PWM_NUM_TIMERS];
+static TIM_HandleTypeDef *const pwm_timers[PWM_NUM_TIMERS] = {&htim2, &htim3, &htim4};
+static DMA_Channel_TypeDef *const pwm_dma_channels[PWM_NUM_TIMERS] = {DMA1_Channel2, DMA1_Channel6, DMA1_Channel7};
+static const uint32_t pwm_dma_requests[PWM_NUM_TIMERS] = {TIM_DMA_UPDATE, TIM_DMA_CC1, TIM_DMA_UPDATE};
+static const IRQn_Type pwm_dma_irqs[PWM_NUM_TIMERS] = {DMA1_Channel2_IRQn, DMA1_Channel6_IRQn, DMA1_Channel7_IRQn};
+
+// Pulses by timer and CCR: staged by PWM_SetDuty, snapshotted by PWM_Commit,
+// then copied a timer at a time into the committed buffer, which the
+// circular DMA bursts out again on every update event
+static uint16_t pwm_staged[PWM_NUM_TIMERS][PWM_CHANNELS_PER_TIMER];
+static uint16_t pwm_snapshot[PWM_NUM_TIMERS][PWM_CHANNELS_PER_TIMER];
+static uint16_t pwm_committed[PWM_NUM_TIMERS][PWM_CHANNELS_PER_TIMER];
+static volatile uint8_t pwm_dirty = 0;
+static volatile uint8_t pwm_pending = 0; // Timers yet to take the snapshot, by bit
+
+#define PWM_ALL_TIMERS ((1U << PWM_NUM_TIMERS) - 1)
+
+// Auto-reload value; the counter goes 0 -> ARR -> 0 each period
+static uint32_t pwm_period = 1;
+
+// Channels pulsing around the counter's high point (CH2 and CH4), by CCR index
+#define PWM_CCR_IS_MODE2(ccr_index) (((ccr_index) & 1) != 0)
+
 // PWM configuration for all 12 outputs at 20kHz
 static const PWM_Config_t pwm_configs[] = {
     // TIM3 channels (PA6, PA7, PB0, PB1)
-    {.htim = &htim3, .channel = PWM_PB1_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim3, .channel = PWM_PB0_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim3, .channel = PWM_PA7_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim3, .channel = PWM_PA6_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
+    {.htim = &htim3, .channel = PWM_PB1_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim3, .channel = PWM_PB0_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim3, .channel = PWM_PA7_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim3, .channel = PWM_PA6_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
 
     // TIM2 channels (PA0, PA1, PA2, PA3)
-    {.htim = &htim2, .channel = PWM_PA3_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim2, .channel = PWM_PA2_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim2, .channel = PWM_PA1_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim2, .channel = PWM_PA0_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
+    {.htim = &htim2, .channel = PWM_PA3_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim2, .channel = PWM_PA2_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim2, .channel = PWM_PA1_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim2, .channel = PWM_PA0_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
 
     // TIM4 channels (PB6, PB7, PB8, PB9)
-    {.htim = &htim4, .channel = PWM_PB9_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim4, .channel = PWM_PB8_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim4, .channel = PWM_PB7_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0},
-    {.htim = &htim4, .channel = PWM_PB6_CHANNEL, .frequency = 20000, .resolution = 100, .duty_cycle = 0}};
+    {.htim = &htim4, .channel = PWM_PB9_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim4, .channel = PWM_PB8_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim4, .channel = PWM_PB7_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0},
+    {.htim = &htim4, .channel = PWM_PB6_CHANNEL, .frequency = PWM_FREQUENCY_HZ, .duty_cycle = 0}};
 
-// Helper function to configure a timer for PWM
-static void PWM_ConfigureTimer(TIM_HandleTypeDef *htim, uint32_t frequency, uint32_t resolution)
+// Helper function to configure a timer for centre-aligned PWM, using every timer clock for resolution
+static void PWM_ConfigureTimer(TIM_HandleTypeDef *htim, uint32_t frequency)
 {
-  htim->Init.Prescaler = (SystemCoreClock / (frequency * resolution)) - 1;
-  htim->Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim->Init.Period = resolution - 1;
+  pwm_period = SystemCoreClock / (2 * frequency);
+  htim->Init.Prescaler = 0;
+  htim->Init.CounterMode = TIM_COUNTERMODE_CENTERALIGNED1;
+  htim->Init.Period = pwm_period;
   htim->Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
-  htim->Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  htim->Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
+}
+
+// Helper function to find a timer's index in pwm_timers
+static uint8_t PWM_TimerIndex(const TIM_HandleTypeDef *htim)
+{
+  for (uint8_t i = 0; i < PWM_NUM_TIMERS; i++)
+  {
+    if (pwm_timers[i] == htim)
+    {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// Helper function to set up a timer's CCR burst DMA; the request is enabled by PWM_Start
+static void PWM_ConfigureDma(uint8_t index)
+{
+  TIM_HandleTypeDef *htim = pwm_timers[index];
+  DMA_HandleTypeDef *hdma = &hdma_pwm[index];
+
+  hdma->Instance = pwm_dma_channels[index];
+  hdma->Init.Direction = DMA_MEMORY_TO_PERIPH;
+  hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma->Init.MemInc = DMA_MINC_ENABLE;
+  hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+  hdma->Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+  hdma->Init.Mode = DMA_CIRCULAR; // Never stopped, so a burst can't be cut off halfway
+  hdma->Init.Priority = DMA_PRIORITY_MEDIUM; // Below the RS485 receive DMA
+  if (HAL_DMA_Init(hdma) != HAL_OK)
+  {
+    // Error handling
+  }
+
+  // Every request writes CCR1-CCR4 through the DMA burst register
+  hdma->Instance->CPAR = (uint32_t)&htim->Instance->DMAR;
+  htim->Instance->DCR = TIM_DMABASE_CCR1 | TIM_DMABURSTLENGTH_4TRANSFERS;
+  if (pwm_dma_requests[index] == TIM_DMA_CC1)
+  {
+    htim->Instance->CR2 |= TIM_CR2_CCDS;
+  }
+
+  hdma->Instance->CMAR = (uint32_t)pwm_committed[index];
+  hdma->Instance->CNDTR = PWM_CHANNELS_PER_TIMER;
+  __HAL_DMA_ENABLE(hdma);
+
+  // The transfer-complete interrupt is only enabled while a snapshot waits
+  // for this timer. Same priority as the key timer, so neither can cut into
+  // the other's staging
+  HAL_NVIC_SetPriority(pwm_dma_irqs[index], 0, 2);
+  HAL_NVIC_EnableIRQ(pwm_dma_irqs[index]);
+}
+
+// Turn a pulse length into the CCR value for a channel; a mode 2 channel is
+// active above its CCR, so it counts from the top
+static uint16_t PWM_PulseToCompare(uint8_t ccr_index, uint32_t pulse)
+{
+  return (uint16_t)(PWM_CCR_IS_MODE2(ccr_index) ? pwm_period - pulse : pulse);
 }
 
 // Helper function to configure PWM channels for a timer
 static void PWM_ConfigureChannels(TIM_HandleTypeDef *htim, const PWM_Config_t *configs, uint8_t start_idx, uint8_t count)
 {
   TIM_OC_InitTypeDef sConfigOC = {0};
-  sConfigOC.OCMode = TIM_OCMODE_PWM1;
   sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
   sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
 
   for (uint8_t i = 0; i < count; i++)
   {
     const PWM_Config_t *config = &configs[start_idx + i];
-    sConfigOC.Pulse = (config->duty_cycle * config->resolution) / 100;
+    uint8_t ccr_index = config->channel >> 2;
+    sConfigOC.OCMode = PWM_CCR_IS_MODE2(ccr_index) ? TIM_OCMODE_PWM2 : TIM_OCMODE_PWM1;
+    sConfigOC.Pulse = PWM_PulseToCompare(ccr_index, (config->duty_cycle * pwm_period) / 100);
+
+    // Commits start from the same values, so untouched channels keep them
+    pwm_staged[PWM_TimerIndex(htim)][ccr_index] = (uint16_t)sConfigOC.Pulse;
 
     if (HAL_TIM_PWM_ConfigChannel(htim, &sConfigOC, config->channel) != HAL_OK)
     {
@@ -62,6 +153,8 @@ void PWM_Init(void)
   __HAL_RCC_TIM3_CLK_ENABLE();
   __HAL_RCC_TIM4_CLK_ENABLE();
 
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
   // Enable GPIO clocks
   __HAL_RCC_GPIOA_CLK_ENABLE();
   __HAL_RCC_GPIOB_CLK_ENABLE();
@@ -83,7 +176,7 @@ void PWM_Init(void)
 
   // Configure TIM2
   htim2.Instance = TIM2;
-  PWM_ConfigureTimer(&htim2, pwm_configs[0].frequency, pwm_configs[0].resolution);
+  PWM_ConfigureTimer(&htim2, pwm_configs[0].frequency);
   if (HAL_TIM_PWM_Init(&htim2) != HAL_OK)
   {
     // Error handling
@@ -92,7 +185,7 @@ void PWM_Init(void)
 
   // Configure TIM3
   htim3.Instance = TIM3;
-  PWM_ConfigureTimer(&htim3, pwm_configs[4].frequency, pwm_configs[4].resolution);
+  PWM_ConfigureTimer(&htim3, pwm_configs[4].frequency);
   if (HAL_TIM_PWM_Init(&htim3) != HAL_OK)
   {
     // Error handling
@@ -101,36 +194,146 @@ void PWM_Init(void)
 
   // Configure TIM4
   htim4.Instance = TIM4;
-  PWM_ConfigureTimer(&htim4, pwm_configs[8].frequency, pwm_configs[8].resolution);
+  PWM_ConfigureTimer(&htim4, pwm_configs[8].frequency);
   if (HAL_TIM_PWM_Init(&htim4) != HAL_OK)
   {
     // Error handling
   }
   PWM_ConfigureChannels(&htim4, pwm_configs, 8, 4);
+
+  // TIM2 starts the other two, so all three count in step
+  TIM_MasterConfigTypeDef sMasterConfig = {0};
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_ENABLE;
+  sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_ENABLE;
+  HAL_TIMEx_MasterConfigSynchronization(&htim2, &sMasterConfig);
+
+  TIM_SlaveConfigTypeDef sSlaveConfig = {0};
+  sSlaveConfig.SlaveMode = TIM_SLAVEMODE_TRIGGER;
+  sSlaveConfig.InputTrigger = TIM_TS_ITR1; // TIM2 TRGO for both TIM3 and TIM4
+  HAL_TIM_SlaveConfigSynchro(&htim3, &sSlaveConfig);
+  HAL_TIM_SlaveConfigSynchro(&htim4, &sSlaveConfig);
+
+  // CCR preload is already on (HAL_TIM_PWM_ConfigChannel sets OCxPE), so
+  // the bursts only take effect at the following update event
+  for (uint8_t i = 0; i < PWM_NUM_TIMERS; i++)
+  {
+    PWM_ConfigureDma(i);
+  }
 }
 
-void PWM_SetDutyCycle(uint8_t channel_index, uint32_t duty_cycle)
+void PWM_SetDuty(uint8_t channel_index, uint16_t duty)
 {
   // Validate channel index
-  if (channel_index >= 12)
+  if (channel_index >= PWM_NUM_CHANNELS)
     return;
 
+  // Scale to ARR, rounded; PWM_DUTY_MAX gives a pulse of the whole period
+  const PWM_Config_t *config = &pwm_configs[channel_index];
+  uint32_t pulse = ((uint32_t)duty * pwm_period + 0x8000) >> 16;
+  uint8_t ccr_index = config->channel >> 2; // TIM_CHANNEL_n / 4 is the CCR's place in the burst
+
+  // Stage the compare value for the next commit
+  pwm_staged[PWM_TimerIndex(config->htim)][ccr_index] = PWM_PulseToCompare(ccr_index, pulse);
+  pwm_dirty = 1;
+}
+
+// Percent wrapper around PWM_SetDuty
+void PWM_SetDutyCycle(uint8_t channel_index, uint32_t duty_cycle)
+{
   if (duty_cycle > 100)
     duty_cycle = 100;
 
-  // Get the configuration for this channel index
-  const PWM_Config_t *config = &pwm_configs[channel_index];
-  uint32_t pulse = (duty_cycle * config->resolution) / 100;
-  __HAL_TIM_SET_COMPARE(config->htim, config->channel, pulse);
+  PWM_SetDuty(channel_index, PWM_PERCENT_TO_DUTY(duty_cycle));
+}
+
+// Snapshot every staged pulse for the next PWM period boundary
+// Safe from both the main loop and interrupts. While the main loop has a
+// batch part staged, or the last snapshot has not reached every timer yet,
+// the commit is left for the main loop's commit or the last timer to take it;
+// commits made in the meantime merge into one.
+void PWM_Commit(void)
+{
+  if (!pwm_dirty)
+    return;
+
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  if (pwm_pending == 0 && !Channel_BatchOpen())
+  {
+    pwm_dirty = 0;
+    memcpy(pwm_snapshot, pwm_staged, sizeof(pwm_staged));
+    pwm_pending = PWM_ALL_TIMERS;
+
+    // A flag left from an earlier burst would fire at once, mid-period
+    for (uint8_t i = 0; i < PWM_NUM_TIMERS; i++)
+    {
+      __HAL_DMA_CLEAR_FLAG(&hdma_pwm[i], __HAL_DMA_GET_TC_FLAG_INDEX(&hdma_pwm[i]));
+      __HAL_DMA_ENABLE_IT(&hdma_pwm[i], DMA_IT_TC);
+    }
+  }
+
+  __set_PRIMASK(primask);
+}
+
+// A timer's burst has just finished: hand it its part of the snapshot
+// The DMA is left running: stopping and re-arming it could cut a burst
+// short, and the timer's burst index would then put the next burst's values
+// into the wrong CCRs. Instead the copy is made just after a burst, half a
+// period before the next one reads the buffer, so every timer sends the
+// whole snapshot on one update event.
+static void PWM_BurstComplete(uint8_t index)
+{
+  DMA_HandleTypeDef *hdma = &hdma_pwm[index];
+
+  __HAL_DMA_CLEAR_FLAG(hdma, __HAL_DMA_GET_TC_FLAG_INDEX(hdma));
+  __HAL_DMA_DISABLE_IT(hdma, DMA_IT_TC);
+  if (!(pwm_pending & (1U << index)))
+    return;
+
+  memcpy(pwm_committed[index], pwm_snapshot[index], sizeof(pwm_committed[index]));
+  pwm_pending &= ~(1U << index);
+
+  // Everything staged since the snapshot goes out once all three have it
+  if (pwm_pending == 0)
+  {
+    PWM_Commit();
+  }
+}
+
+void DMA1_Channel2_IRQHandler(void)
+{
+  PWM_BurstComplete(0);
+}
+
+void DMA1_Channel6_IRQHandler(void)
+{
+  PWM_BurstComplete(1);
+}
+
+void DMA1_Channel7_IRQHandler(void)
+{
+  PWM_BurstComplete(2);
 }
 
 void PWM_Start(void)
 {
-  // Start all TIM2 channels
-  HAL_TIM_PWM_Start(&htim2, PWM_PA0_CHANNEL);
-  HAL_TIM_PWM_Start(&htim2, PWM_PA1_CHANNEL);
-  HAL_TIM_PWM_Start(&htim2, PWM_PA2_CHANNEL);
-  HAL_TIM_PWM_Start(&htim2, PWM_PA3_CHANNEL);
+  // The bursts write the committed pulses from the first update event on;
+  // a commit made before now had no bursts to wait for
+  memcpy(pwm_committed, pwm_staged, sizeof(pwm_staged));
+  pwm_pending = 0;
+  pwm_dirty = 0;
+  for (uint8_t i = 0; i < PWM_NUM_TIMERS; i++)
+  {
+    __HAL_TIM_ENABLE_DMA(pwm_timers[i], pwm_dma_requests[i]);
+  }
+
+  // Stagger the counters by a sixth of a period each (a third of the way up
+  // the count); the slaves wait for TIM2's trigger and then count in step
+  for (uint8_t i = 0; i < PWM_NUM_TIMERS; i++)
+  {
+    __HAL_TIM_SET_COUNTER(pwm_timers[i], (pwm_period * i) / PWM_NUM_TIMERS);
+  }
 
   // Start all TIM3 channels
   HAL_TIM_PWM_Start(&htim3, PWM_PA6_CHANNEL);
@@ -143,6 +346,12 @@ void PWM_Start(void)
   HAL_TIM_PWM_Start(&htim4, PWM_PB7_CHANNEL);
   HAL_TIM_PWM_Start(&htim4, PWM_PB8_CHANNEL);
   HAL_TIM_PWM_Start(&htim4, PWM_PB9_CHANNEL);
+
+  // Start all TIM2 channels last; enabling TIM2 starts TIM3 and TIM4
+  HAL_TIM_PWM_Start(&htim2, PWM_PA0_CHANNEL);
+  HAL_TIM_PWM_Start(&htim2, PWM_PA1_CHANNEL);
+  HAL_TIM_PWM_Start(&htim2, PWM_PA2_CHANNEL);
+  HAL_TIM_PWM_Start(&htim2, PWM_PA3_CHANNEL);
 }
 
 void PWM_Stop(void)
@@ -1,14 +1,63 @@
 #include "rs485.h"
 #include "stm32f1xx_hal.h"
+#include "timebase.h"
 #include <string.h>
 
 // Global UART handle
 UART_HandleTypeDef huart3;
 
-// Receive buffer and state
-static char rx_buffer[RS485_RX_BUFFER_SIZE];
-static uint16_t rx_index = 0;
+// Receive state machine
+typedef enum
+{
+  RX_STATE_WAIT_ADDRESS = 0, // Between frames, waiting for an address byte
+  RX_STATE_RECEIVING,        // Frame addressed to this board, buffering
+  RX_STATE_DISCARD           // Frame addressed elsewhere, dropping bytes
+} RxState_t;
+
+// Circular DMA receive buffer, written by DMA1 channel 3 and read in place
+static uint8_t rx_dma_buffer[RS485_RX_DMA_BUFFER_SIZE];
+static DMA_HandleTypeDef hdma_usart3_rx;
+
+// Receive event: how far the DMA had got, and when
+typedef struct
+{
+  uint32_t head;   // Bytes received up to this event
+  uint32_t time;   // Time the stop bit of byte head - 1 ended
+  uint8_t overrun; // A byte before head was lost in the UART
+} RxEvent_t;
+
+// Events pushed by the UART idle and DMA half/full interrupts, consumed by
+// RS485_Update. The interrupts do nothing else with the received data.
+static RxEvent_t rx_events[RS485_RX_EVENT_QUEUE_SIZE];
+static volatile uint32_t rx_event_write = 0;  // Written by interrupts only
+static volatile uint32_t rx_event_read = 0;   // Written by the main loop only
+static volatile uint16_t rx_dma_position = 0; // DMA write index at the last event
+static volatile uint32_t rx_head = 0;         // Bytes received since reception started
+static volatile uint8_t rx_restart_pending = 0;
+
+// Frame scanner state, main loop only
+static uint32_t rx_tail = 0;        // Next byte to scan
+static uint32_t rx_frame_begin = 0; // First text byte of the current frame
+static RxState_t rx_state = RX_STATE_WAIT_ADDRESS;
+static uint32_t rx_frame_start_time = 0;
 static RS485_MessageCallback_t message_callback = NULL;
+static RS485_ByteCallback_t byte_callback = NULL; // Set in raw mode, replaces framing
+static RS485_RxStats_t rx_stats = {0};
+
+// Line rate, RS485_BAUDRATE unless started in raw mode at another rate
+static uint32_t rx_baudrate = RS485_BAUDRATE;
+static uint32_t rx_byte_time_ns = RS485_BYTE_TIME_NS;
+
+// Linear copy for the rare frame that wraps around the end of the DMA buffer
+static char rx_wrap_buffer[RS485_RX_BUFFER_SIZE];
+
+// Transmit buffer for replies (sent by interrupt, so it must outlive the call)
+static uint8_t tx_buffer[RS485_TX_BUFFER_SIZE];
+static volatile uint8_t tx_busy = 0;
+
+// Address filter
+static uint8_t rx_unicast_address = RS485_ADDR_UNICAST_BASE;
+static uint16_t rx_group_mask = 0;
 
 /**
  * @brief Initialize RS485 module
@@ -25,13 +74,56 @@ HAL_StatusTypeDef RS485_Init(void)
   return HAL_OK;
 }
 
+/**
+ * @brief Initialize the UART as a plain byte stream instead of the RS485 bus
+ *
+ * No addressing or framing is applied: RS485_Update hands every received
+ * byte to the callback together with the local time its stop bit ended. Used
+ * to take MIDI straight from a MIDI source.
+ * @param baudrate: Line rate, e.g. 31250 for MIDI
+ * @param callback: Function to receive each byte
+ * @return HAL status
+ */
+HAL_StatusTypeDef RS485_InitRaw(uint32_t baudrate, RS485_ByteCallback_t callback)
+{
+  if (baudrate == 0 || callback == NULL)
+  {
+    return HAL_ERROR;
+  }
+
+  rx_baudrate = baudrate;
+  rx_byte_time_ns = (uint32_t)(10000000000ULL / baudrate);
+  byte_callback = callback;
+
+  return RS485_Init();
+}
+
 /**
  * @brief Start receiving data (non-blocking)
+ *
+ * The DMA runs continuously around rx_dma_buffer; the CPU is only involved
+ * when the line goes idle and at the half and full buffer marks.
  * @return HAL status
  */
 HAL_StatusTypeDef RS485_StartReceive(void)
 {
-  return HAL_UART_Receive_IT(&huart3, (uint8_t *)rx_buffer, 1);
+  rx_dma_position = 0;
+  rx_head = 0;
+  rx_tail = 0;
+  rx_event_read = rx_event_write;
+  rx_state = RX_STATE_WAIT_ADDRESS;
+
+  HAL_StatusTypeDef status = HAL_UART_Receive_DMA(&huart3, rx_dma_buffer, RS485_RX_DMA_BUFFER_SIZE);
+  if (status != HAL_OK)
+  {
+    return status;
+  }
+
+  // Clear a stale idle flag so the first event comes from real traffic
+  __HAL_UART_CLEAR_IDLEFLAG(&huart3);
+  __HAL_UART_ENABLE_IT(&huart3, UART_IT_IDLE);
+
+  return HAL_OK;
 }
 
 /**
@@ -46,6 +138,18 @@ void RS485_UART_Init(void)
   __HAL_RCC_GPIOB_CLK_ENABLE();
   __HAL_RCC_GPIOA_CLK_ENABLE();
 
+  // Configure UART pins (PB10 = TX, PB11 = RX)
+  // There is no DE pin: this assumes an auto-direction transceiver, as on the
+  // main controller, that drives the bus only while TX is active and lets go
+  // within about a bit time of the stop bit. That release time is the part's
+  // datasheet figure, not measured on this board; replies start no sooner
+  // than a main loop pass after the query's newline, which is taken to be
+  // enough margin for the main controller's transceiver to let go too.
+  GPIO_InitStruct.Pin = GPIO_PIN_10;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
   GPIO_InitStruct.Pin = GPIO_PIN_11;
   GPIO_InitStruct.Mode = GPIO_MODE_AF_INPUT;
   GPIO_InitStruct.Pull = GPIO_NOPULL;
@@ -53,11 +157,11 @@ void RS485_UART_Init(void)
 
   // Configure UART
   huart3.Instance = RS485_UART_INSTANCE;
-  huart3.Init.BaudRate = RS485_BAUDRATE;
+  huart3.Init.BaudRate = rx_baudrate;
   huart3.Init.WordLength = UART_WORDLENGTH_8B;
   huart3.Init.StopBits = UART_STOPBITS_1;
   huart3.Init.Parity = UART_PARITY_NONE;
-  huart3.Init.Mode = UART_MODE_RX;
+  huart3.Init.Mode = UART_MODE_TX_RX;
   huart3.Init.HwFlowCtl = UART_HWCONTROL_NONE;
   huart3.Init.OverSampling = UART_OVERSAMPLING_16;
 
@@ -66,9 +170,29 @@ void RS485_UART_Init(void)
     // Error handling - could be improved with proper error reporting
   }
 
-  // Enable UART interrupt in NVIC
+  // Configure DMA1 channel 3 (USART3_RX) as a circular byte stream
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  hdma_usart3_rx.Instance = DMA1_Channel3;
+  hdma_usart3_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+  hdma_usart3_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+  hdma_usart3_rx.Init.MemInc = DMA_MINC_ENABLE;
+  hdma_usart3_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+  hdma_usart3_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+  hdma_usart3_rx.Init.Mode = DMA_CIRCULAR;
+  hdma_usart3_rx.Init.Priority = DMA_PRIORITY_HIGH;
+
+  if (HAL_DMA_Init(&hdma_usart3_rx) != HAL_OK)
+  {
+    // Error handling - could be improved with proper error reporting
+  }
+
+  __HAL_LINKDMA(&huart3, hdmarx, hdma_usart3_rx);
+
+  // Enable UART and DMA interrupts in NVIC
   HAL_NVIC_SetPriority(USART3_IRQn, 0, 0);
   HAL_NVIC_EnableIRQ(USART3_IRQn);
+  HAL_NVIC_SetPriority(DMA1_Channel3_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel3_IRQn);
 }
 
 /**
@@ -80,46 +204,411 @@ void RS485_SetMessageCallback(RS485_MessageCallback_t callback)
   message_callback = callback;
 }
 
+/**
+ * @brief Set the addresses this board accepts frames for
+ * @param unit_address: Unicast unit number (0-110)
+ * @param group_mask: Bit n set = accept frames sent to group n
+ */
+void RS485_SetAddressFilter(uint8_t unit_address, uint16_t group_mask)
+{
+  rx_unicast_address = RS485_ADDR_UNICAST(unit_address);
+  rx_group_mask = group_mask;
+}
+
+/**
+ * @brief Check whether a frame address selects this board
+ * @param address: Address byte received at the start of a frame
+ * @return 1 if the frame should be received, 0 if it should be dropped
+ */
+static uint8_t RS485_AddressMatches(uint8_t address)
+{
+  if (address == RS485_ADDR_BROADCAST || address == rx_unicast_address)
+  {
+    return 1;
+  }
+
+  if (address >= RS485_ADDR_GROUP_BASE)
+  {
+    return (rx_group_mask & RS485_GROUP_BIT(address - RS485_ADDR_GROUP_BASE)) != 0;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Get the local time at which the current frame started on the wire
+ *
+ * Valid inside the message callback. Worked back from the time of the last
+ * receive event by the number of bytes received since the address byte, so
+ * it does not depend on when the main loop gets to the frame.
+ * @return Frame start time in microseconds
+ */
+uint32_t RS485_GetFrameStartTime(void)
+{
+  return rx_frame_start_time;
+}
+
+/**
+ * @brief Send an addressed frame without blocking
+ *
+ * Used for replies to the main controller, which only polls one board at a
+ * time, so at most one reply is ever in flight. Safe to call from the
+ * message callback.
+ * @param address: Destination address byte
+ * @param payload: Null-terminated text, without newline
+ * @return HAL_OK if queued for transmission, HAL_BUSY if a reply is still going out
+ */
+HAL_StatusTypeDef RS485_SendFrame(uint8_t address, const char *payload)
+{
+  if (payload == NULL)
+  {
+    return HAL_ERROR;
+  }
+
+  if (tx_busy)
+  {
+    return HAL_BUSY;
+  }
+
+  uint16_t length = 0;
+  tx_buffer[length++] = address;
+  while (*payload != '\0' && length < RS485_TX_BUFFER_SIZE - 1)
+  {
+    tx_buffer[length++] = (uint8_t)*payload++;
+  }
+  tx_buffer[length++] = '\n';
+
+  tx_busy = 1;
+  HAL_StatusTypeDef status = HAL_UART_Transmit_IT(&huart3, tx_buffer, length);
+  if (status != HAL_OK)
+  {
+    tx_busy = 0;
+  }
+
+  return status;
+}
+
+/**
+ * @brief Get receive statistics
+ * @return Pointer to receive statistics
+ */
+const RS485_RxStats_t *RS485_GetRxStats(void)
+{
+  return &rx_stats;
+}
+
+/**
+ * @brief Record the worst-case duration of a receive interrupt
+ * @param start: Cycle count at interrupt entry
+ */
+static void RS485_RecordIsrCycles(uint32_t start)
+{
+  uint32_t cycles = TIMEBASE_CYCLES() - start;
+  if (cycles > rx_stats.isr_max_cycles)
+  {
+    rx_stats.isr_max_cycles = cycles;
+  }
+}
+
+/**
+ * @brief Push an event for the bytes the DMA has written since the last one
+ *
+ * Called from interrupt context only. When the main loop has fallen so far
+ * behind that the event queue is full, the newest event is extended instead,
+ * which only costs frame timing accuracy for the frames it covers.
+ * @param line_idle: 1 if the line has been idle for one character time
+ * @param overrun: 1 if the UART reported a lost byte
+ */
+static void RS485_OnReceiveEvent(uint8_t line_idle, uint8_t overrun)
+{
+  uint16_t position = (RS485_RX_DMA_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(huart3.hdmarx)) &
+                      (RS485_RX_DMA_BUFFER_SIZE - 1);
+  uint16_t received = (position - rx_dma_position) & (RS485_RX_DMA_BUFFER_SIZE - 1);
+  uint32_t now = Timebase_Micros();
+
+  if (received == 0 && !overrun)
+  {
+    // Line went idle right after a half/full mark that already covered it
+    return;
+  }
+
+  rx_dma_position = position;
+  rx_head += received;
+
+  uint32_t write = rx_event_write;
+  RxEvent_t *event;
+  uint8_t push = (write - rx_event_read) < RS485_RX_EVENT_QUEUE_SIZE;
+
+  if (push)
+  {
+    event = &rx_events[write & (RS485_RX_EVENT_QUEUE_SIZE - 1)];
+    event->overrun = 0;
+  }
+  else
+  {
+    event = &rx_events[(write - 1) & (RS485_RX_EVENT_QUEUE_SIZE - 1)];
+    rx_stats.event_overflows++;
+  }
+
+  event->head = rx_head;
+  event->time = line_idle ? now - rx_byte_time_ns / 1000UL : now;
+  event->overrun |= overrun;
+
+  if (push)
+  {
+    // Entry must be complete before the main loop can see it
+    __DMB();
+    rx_event_write = write + 1;
+  }
+}
+
 /**
  * @brief UART3 interrupt handler
+ *
+ * Line idle and overrun are handled here; transmit interrupts and receive
+ * errors go on to the HAL.
  */
 void USART3_IRQHandler(void)
 {
+  uint32_t start = TIMEBASE_CYCLES();
+  uint32_t status = huart3.Instance->SR;
+
+  if ((status & (UART_FLAG_IDLE | UART_FLAG_ORE)) && __HAL_UART_GET_IT_SOURCE(&huart3, UART_IT_IDLE))
+  {
+    // SR then DR read clears both; the DMA carries on with the next byte
+    __HAL_UART_CLEAR_IDLEFLAG(&huart3);
+    RS485_OnReceiveEvent((status & UART_FLAG_IDLE) != 0, (status & UART_FLAG_ORE) != 0);
+  }
+
   HAL_UART_IRQHandler(&huart3);
+  RS485_RecordIsrCycles(start);
+}
+
+/**
+ * @brief DMA1 channel 3 (USART3_RX) interrupt handler
+ */
+void DMA1_Channel3_IRQHandler(void)
+{
+  uint32_t start = TIMEBASE_CYCLES();
+  HAL_DMA_IRQHandler(&hdma_usart3_rx);
+  RS485_RecordIsrCycles(start);
+}
+
+/**
+ * @brief DMA half transfer callback
+ */
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  if (huart->Instance == RS485_UART_INSTANCE)
+  {
+    RS485_OnReceiveEvent(0, 0);
+  }
 }
 
 /**
- * @brief UART receive complete callback
+ * @brief DMA transfer complete callback (the DMA wraps around and keeps going)
  */
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
 {
   if (huart->Instance == RS485_UART_INSTANCE)
   {
-    // Check for end of message
-    if (rx_buffer[rx_index] == '\n' || rx_buffer[rx_index] == '\r')
+    RS485_OnReceiveEvent(0, 0);
+  }
+}
+
+/**
+ * @brief UART error callback
+ *
+ * The HAL stops a DMA reception on any receive error. Reception is restarted
+ * from the main loop, which drops the damaged frame.
+ */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  if (huart->Instance == RS485_UART_INSTANCE)
+  {
+    rx_restart_pending = 1;
+  }
+}
+
+/**
+ * @brief Hand a complete frame to the message callback
+ *
+ * The text is passed in place in the DMA buffer, with the newline replaced by
+ * a terminator. Only a frame that wraps around the end of the buffer is copied.
+ * @param end: Index of the newline byte
+ */
+static void RS485_DeliverFrame(uint32_t end)
+{
+  uint16_t length = (uint16_t)(end - rx_frame_begin);
+  uint16_t first = rx_frame_begin & (RS485_RX_DMA_BUFFER_SIZE - 1);
+  const char *message;
+
+  if (first + length < RS485_RX_DMA_BUFFER_SIZE)
+  {
+    // The DMA is past this frame, so the newline is free to overwrite
+    rx_dma_buffer[first + length] = '\0';
+    message = (const char *)&rx_dma_buffer[first];
+  }
+  else
+  {
+    uint16_t head_part = RS485_RX_DMA_BUFFER_SIZE - first;
+    memcpy(rx_wrap_buffer, &rx_dma_buffer[first], head_part);
+    memcpy(&rx_wrap_buffer[head_part], rx_dma_buffer, length - head_part);
+    rx_wrap_buffer[length] = '\0';
+    message = rx_wrap_buffer;
+  }
+
+  rx_stats.frames++;
+  if (message_callback != NULL)
+  {
+    uint32_t start = TIMEBASE_CYCLES();
+    message_callback(message, length);
+
+    uint32_t cycles = TIMEBASE_CYCLES() - start;
+    if (cycles > rx_stats.frame_max_cycles)
     {
-      rx_buffer[rx_index] = '\0';
+      rx_stats.frame_max_cycles = cycles;
+    }
+  }
+}
 
-      // Call callback if set
-      if (message_callback != NULL)
-      {
-        message_callback(rx_buffer, rx_index);
-      }
+/**
+ * @brief Get the number of bytes the DMA has written since reception started
+ *
+ * rx_head only moves at receive events; this adds what the DMA has stored
+ * since the last one. Interrupts are held off for the two reads so rx_head
+ * and rx_dma_position belong to the same event.
+ * @return Live DMA write count, in the same units as rx_head and rx_tail
+ */
+static uint32_t RS485_DmaHead(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  uint16_t position = (RS485_RX_DMA_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(huart3.hdmarx)) &
+                      (RS485_RX_DMA_BUFFER_SIZE - 1);
+  uint32_t head = rx_head + ((position - rx_dma_position) & (RS485_RX_DMA_BUFFER_SIZE - 1));
+
+  __set_PRIMASK(primask);
+  return head;
+}
+
+/**
+ * @brief Scan received bytes and deliver frames (call from main loop)
+ *
+ * Works through the receive events in order, using each event's timestamp
+ * for the frames it completes. Each call scans at most RS485_UPDATE_MAX_BYTES
+ * bytes and delivers at most RS485_UPDATE_MAX_FRAMES frames, so one pass of
+ * the main loop stays short however much arrived; the rest waits for the
+ * next pass. Frames not addressed to this board are rejected on their
+ * address byte and the rest of the frame is skipped, before any parsing.
+ */
+void RS485_Update(void)
+{
+  if (rx_restart_pending)
+  {
+    rx_restart_pending = 0;
+    rx_stats.restarts++;
+    HAL_UART_DMAStop(&huart3);
+    RS485_StartReceive();
+    return;
+  }
+
+  uint16_t bytes = 0;
+  uint8_t frames = 0;
+
+  while (rx_event_read != rx_event_write)
+  {
+    const RxEvent_t *event = &rx_events[rx_event_read & (RS485_RX_EVENT_QUEUE_SIZE - 1)];
+    uint32_t head = event->head;
+
+    // Checked against where the DMA is now, not against this event: the
+    // oldest queued event can be well inside the buffer while later bytes
+    // have already wrapped round over the ones it covers
+    uint32_t dma_head = RS485_DmaHead();
+    if (dma_head - rx_tail > RS485_RX_DMA_BUFFER_SIZE ||
+        (rx_state == RX_STATE_RECEIVING && dma_head - rx_frame_begin > RS485_RX_DMA_BUFFER_SIZE))
+    {
+      // The DMA lapped the scanner and overwrote unread bytes
+      rx_stats.overflows++;
+      rx_tail = dma_head;
+      rx_state = RX_STATE_WAIT_ADDRESS;
+    }
 
-      // Reset for next message
-      rx_index = 0;
+    if ((int32_t)(head - rx_tail) < 0)
+    {
+      // Everything this event covers went with the lap
+      rx_event_read++;
+      continue;
     }
-    else
+
+    while (rx_tail != head)
     {
-      rx_index++;
-      if (rx_index >= RS485_RX_BUFFER_SIZE - 1)
+      if (bytes >= RS485_UPDATE_MAX_BYTES || frames >= RS485_UPDATE_MAX_FRAMES)
       {
-        // Buffer overflow, reset
-        rx_index = 0;
+        return;
+      }
+      bytes++;
+
+      uint32_t index = rx_tail++;
+      uint8_t byte = rx_dma_buffer[index & (RS485_RX_DMA_BUFFER_SIZE - 1)];
+
+      if (byte_callback != NULL)
+      {
+        // Raw mode: the byte stream has its own framing
+        rx_stats.overruns += (event->overrun && index + 1 == head);
+        byte_callback(byte, event->time - (((head - 1 - index) * rx_byte_time_ns) / 1000UL));
+        continue;
+      }
+
+      if (event->overrun && index + 1 == head)
+      {
+        // Overrun reported with this byte; whatever frame it belongs to is damaged
+        rx_stats.overruns++;
+        if (!(byte & 0x80))
+        {
+          rx_state = RX_STATE_DISCARD;
+          continue;
+        }
+      }
+
+      if (byte & 0x80)
+      {
+        // Address byte always starts a new frame, even if the previous one was cut short
+        rx_frame_start_time = event->time - (((head - index) * rx_byte_time_ns) / 1000UL);
+        rx_frame_begin = rx_tail;
+        rx_state = RS485_AddressMatches(byte) ? RX_STATE_RECEIVING : RX_STATE_DISCARD;
+      }
+      else if (byte == '\n' || byte == '\r')
+      {
+        // End of message
+        if (rx_state == RX_STATE_RECEIVING && index > rx_frame_begin)
+        {
+          RS485_DeliverFrame(index);
+          frames++;
+        }
+
+        // Reset for next message
+        rx_state = RX_STATE_WAIT_ADDRESS;
+      }
+      else if (rx_state == RX_STATE_RECEIVING && index - rx_frame_begin >= RS485_RX_BUFFER_SIZE - 1)
+      {
+        // Frame too long, drop the rest of it
+        rx_state = RX_STATE_DISCARD;
       }
     }
 
-    // Restart reception
-    HAL_UART_Receive_IT(&huart3, (uint8_t *)&rx_buffer[rx_index], 1);
+    rx_event_read++;
+  }
+}
+
+/**
+ * @brief UART transmit complete callback
+ */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  if (huart->Instance == RS485_UART_INSTANCE)
+  {
+    tx_busy = 0;
   }
 }
@@ -0,0 +1,184 @@
+#include "scheduler.h"
+#include "timebase.h"
+#include <string.h>
+
+// Realtime stage, run before every other stage
+static SchedulerStageFunc_t g_realtime;
+static SchedulerStats_t g_realtime_stats;
+static uint32_t g_realtime_last_cycles;
+static uint32_t g_realtime_max_gap_cycles;
+
+// Other stages, in priority order
+static SchedulerStage_t g_stages[SCHEDULER_MAX_STAGES];
+static uint8_t g_stage_count;
+
+/**
+ * @brief Reset the scheduler
+ * @param realtime: Stage run between all others, or NULL for none
+ */
+void Scheduler_Init(SchedulerStageFunc_t realtime)
+{
+  g_realtime = realtime;
+  memset(&g_realtime_stats, 0, sizeof(g_realtime_stats));
+  g_realtime_last_cycles = TIMEBASE_CYCLES();
+  g_realtime_max_gap_cycles = SCHEDULER_US_TO_CYCLES(SCHEDULER_REALTIME_MAX_GAP_US);
+
+  memset(g_stages, 0, sizeof(g_stages));
+  g_stage_count = 0;
+}
+
+/**
+ * @brief Add a stage after the ones already added
+ * @param run: Stage function
+ * @param period_us: Run period in us, 0 to run on every pass
+ * @param budget_us: Time the stage may use per run
+ * @return HAL_OK, or HAL_ERROR if the table is full
+ */
+HAL_StatusTypeDef Scheduler_AddStage(SchedulerStageFunc_t run, uint32_t period_us, uint32_t budget_us)
+{
+  if (run == NULL || g_stage_count >= SCHEDULER_MAX_STAGES)
+  {
+    return HAL_ERROR;
+  }
+
+  SchedulerStage_t *stage = &g_stages[g_stage_count++];
+  stage->run = run;
+  stage->period_us = period_us;
+  stage->budget_cycles = SCHEDULER_US_TO_CYCLES(budget_us);
+  stage->next_due_us = Timebase_Micros() + period_us;
+  stage->carry = 0;
+  memset(&stage->stats, 0, sizeof(stage->stats));
+  return HAL_OK;
+}
+
+/**
+ * @brief Run the realtime stage and track the gap since its last run
+ */
+static void Scheduler_RunRealtime(void)
+{
+  if (g_realtime == NULL)
+  {
+    return;
+  }
+
+  uint32_t start = TIMEBASE_CYCLES();
+  uint32_t gap = start - g_realtime_last_cycles;
+  uint32_t gap_us = gap / SCHEDULER_US_TO_CYCLES(1);
+
+  if (gap_us > g_realtime_stats.max_late_us)
+  {
+    g_realtime_stats.max_late_us = gap_us;
+  }
+  if (gap > g_realtime_max_gap_cycles)
+  {
+    g_realtime_stats.deadline_misses++;
+  }
+
+  g_realtime(start + g_realtime_max_gap_cycles);
+
+  uint32_t end = TIMEBASE_CYCLES();
+  if (end - start > g_realtime_stats.max_cycles)
+  {
+    g_realtime_stats.max_cycles = end - start;
+  }
+  g_realtime_stats.runs++;
+  g_realtime_last_cycles = end;
+}
+
+/**
+ * @brief Run one stage against its budget and record how it went
+ * @param stage: Stage that is due or has work carried over
+ * @param now: Current time in us
+ */
+static void Scheduler_RunStage(SchedulerStage_t *stage, uint32_t now)
+{
+  SchedulerStats_t *stats = &stage->stats;
+
+  if (stage->period_us > 0 && !stage->carry)
+  {
+    // Periodic stage starting a new period; a whole period late is a miss and
+    // the schedule restarts from now rather than running a burst of catch-ups
+    uint32_t late = now - stage->next_due_us;
+    if (late > stats->max_late_us)
+    {
+      stats->max_late_us = late;
+    }
+    if (late >= stage->period_us)
+    {
+      stats->deadline_misses++;
+      stage->next_due_us = now;
+    }
+    stage->next_due_us += stage->period_us;
+  }
+
+  uint32_t start = TIMEBASE_CYCLES();
+  SchedulerResult_t result = stage->run(start + stage->budget_cycles);
+  uint32_t cycles = TIMEBASE_CYCLES() - start;
+
+  stats->runs++;
+  if (cycles > stats->max_cycles)
+  {
+    stats->max_cycles = cycles;
+  }
+  if (cycles > stage->budget_cycles)
+  {
+    stats->overruns++;
+  }
+
+  stage->carry = (result == SCHEDULER_MORE);
+  if (stage->carry)
+  {
+    stats->carry_overs++;
+  }
+}
+
+/**
+ * @brief One pass of the main loop
+ *
+ * Every stage that is due, or has work carried over, runs once, with the
+ * realtime stage run again before each of them.
+ */
+void Scheduler_RunPass(void)
+{
+  for (uint8_t i = 0; i < g_stage_count; i++)
+  {
+    SchedulerStage_t *stage = &g_stages[i];
+
+    Scheduler_RunRealtime();
+
+    uint32_t now = Timebase_Micros();
+    if (stage->period_us == 0 || stage->carry || TIMEBASE_REACHED(now, stage->next_due_us))
+    {
+      Scheduler_RunStage(stage, now);
+    }
+  }
+
+  if (g_stage_count == 0)
+  {
+    Scheduler_RunRealtime();
+  }
+}
+
+/**
+ * @brief Get the realtime stage's statistics
+ * @return Statistics; max_late_us is the longest gap between two runs
+ */
+const SchedulerStats_t *Scheduler_GetRealtimeStats(void)
+{
+  return &g_realtime_stats;
+}
+
+/**
+ * @brief Get a stage's statistics
+ * @param index: Stage index, in the order the stages were added
+ * @return Statistics, or NULL for an unknown stage
+ */
+const SchedulerStats_t *Scheduler_GetStageStats(uint8_t index)
+{
+  if (index >= g_stage_count)
+  {
+    return NULL;
+  }
+
+  return &g_stages[index].stats;
+}
@@ -0,0 +1,119 @@
+#include "spsc_ring.h"
+
+/**
+ * @brief Initialize an empty ring
+ * @param ring: Pointer to ring
+ * @param capacity: Number of elements in the owner's array, a power of two
+ * @return HAL status
+ */
+HAL_StatusTypeDef SpscRing_Init(SpscRing_t *ring, uint32_t capacity)
+{
+  if (ring == NULL || !SPSC_RING_IS_POWER_OF_TWO(capacity))
+  {
+    return HAL_ERROR;
+  }
+
+  ring->head = 0;
+  ring->tail = 0;
+  ring->mask = capacity - 1;
+
+  return HAL_OK;
+}
+
+/**
+ * @brief Get the number of elements waiting to be read
+ *
+ * Exact for the consumer; the producer may see a value that is too high by
+ * what the consumer is releasing at that moment, never too low.
+ * @param ring: Pointer to ring
+ * @return Number of published, unreleased elements
+ */
+uint32_t SpscRing_Count(const SpscRing_t *ring)
+{
+  return ring->head - ring->tail;
+}
+
+/**
+ * @brief Get the number of elements that can be written
+ * @param ring: Pointer to ring
+ * @return Number of free slots
+ */
+uint32_t SpscRing_Free(const SpscRing_t *ring)
+{
+  return (ring->mask + 1) - (ring->head - ring->tail);
+}
+
+/**
+ * @brief Get the slot for the next element to write (producer only)
+ *
+ * Fill the slot, then make it visible with SpscRing_Publish.
+ * @param ring: Pointer to ring
+ * @param slot: Array index to fill
+ * @return HAL_OK, or HAL_BUSY if the ring is full
+ */
+HAL_StatusTypeDef SpscRing_WriteSlot(const SpscRing_t *ring, uint32_t *slot)
+{
+  uint32_t head = ring->head;
+
+  if (head - ring->tail > ring->mask)
+  {
+    return HAL_BUSY;
+  }
+
+  *slot = head & ring->mask;
+  return HAL_OK;
+}
+
+/**
+ * @brief Make the element written to the slot from SpscRing_WriteSlot visible (producer only)
+ * @param ring: Pointer to ring
+ */
+void SpscRing_Publish(SpscRing_t *ring)
+{
+  // The element must be in memory before the consumer can see the new head
+  __DMB();
+  ring->head = ring->head + 1;
+}
+
+/**
+ * @brief Get the slot of a waiting element without removing it (consumer only)
+ *
+ * Elements from offset 0 up to SpscRing_Count - 1 can be read in place and
+ * are handed back in one go with SpscRing_Release, for batch dequeue.
+ * @param ring: Pointer to ring
+ * @param offset: Position from the oldest waiting element
+ * @param slot: Array index to read
+ * @return HAL_OK, or HAL_ERROR if fewer than offset + 1 elements are waiting
+ */
+HAL_StatusTypeDef SpscRing_ReadSlot(const SpscRing_t *ring, uint32_t offset, uint32_t *slot)
+{
+  uint32_t tail = ring->tail;
+
+  if (ring->head - tail <= offset)
+  {
+    return HAL_ERROR;
+  }
+
+  // Element reads must not be satisfied before the head that published them
+  __DMB();
+  *slot = (tail + offset) & ring->mask;
+  return HAL_OK;
+}
+
+/**
+ * @brief Remove elements from the ring once they have been read (consumer only)
+ * @param ring: Pointer to ring
+ * @param count: Number of oldest elements to remove
+ */
+void SpscRing_Release(SpscRing_t *ring, uint32_t count)
+{
+  uint32_t waiting = ring->head - ring->tail;
+  if (count > waiting)
+  {
+    count = waiting;
+  }
+
+  // Reads of the elements must be complete before the producer may reuse them
+  __DMB();
+  ring->tail = ring->tail + count;
+}
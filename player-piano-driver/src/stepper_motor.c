@@ -1,6 +1,10 @@
 #include "stepper_motor.h"
 #include "core_cm3.h" // For DWT registers
 
+#if !SPSC_RING_IS_POWER_OF_TWO(STEPPER_QUEUE_SIZE)
+#error "STEPPER_QUEUE_SIZE must be a power of two"
+#endif
+
 // Global stepper motor instance
 StepperMotor_t g_stepper_motor;
 
@@ -412,37 +416,34 @@ void StepperMotor_CheckIdleTimeout(StepperMotor_t *motor)
 // Initialize command queue
 void StepperMotor_QueueInit(StepperQueue_t *queue)
 {
-  queue->head = 0;
-  queue->tail = 0;
-  queue->count = 0;
+  SpscRing_Init(&queue->ring, STEPPER_QUEUE_SIZE);
   queue->last_command_time = 0;
 }
 
 // Check if queue is empty
 uint8_t StepperMotor_QueueIsEmpty(StepperQueue_t *queue)
 {
-  return (queue->count == 0);
+  return (SpscRing_Count(&queue->ring) == 0);
 }
 
 // Check if queue is full
 uint8_t StepperMotor_QueueIsFull(StepperQueue_t *queue)
 {
-  return (queue->count >= STEPPER_QUEUE_SIZE);
+  return (SpscRing_Free(&queue->ring) == 0);
 }
 
 // Enqueue a command
 uint8_t StepperMotor_QueueEnqueue(StepperQueue_t *queue, StepperCommandType_t type, int32_t value)
 {
-  if (StepperMotor_QueueIsFull(queue))
+  uint32_t slot;
+  if (SpscRing_WriteSlot(&queue->ring, &slot) != HAL_OK)
   {
     return 0; // Queue is full
   }
 
-  queue->commands[queue->tail].type = type;
-  queue->commands[queue->tail].value = value;
-
-  queue->tail = (queue->tail + 1) % STEPPER_QUEUE_SIZE;
-  queue->count++;
+  queue->commands[slot].type = type;
+  queue->commands[slot].value = value;
+  SpscRing_Publish(&queue->ring);
 
   return 1; // Success
 }
@@ -450,14 +451,14 @@ uint8_t StepperMotor_QueueEnqueue(StepperQueue_t *queue, StepperCommandType_t ty
 // Dequeue a command
 uint8_t StepperMotor_QueueDequeue(StepperQueue_t *queue, StepperCommand_t *command)
 {
-  if (StepperMotor_QueueIsEmpty(queue))
+  uint32_t slot;
+  if (SpscRing_ReadSlot(&queue->ring, 0, &slot) != HAL_OK)
   {
     return 0; // Queue is empty
   }
 
-  *command = queue->commands[queue->head];
-  queue->head = (queue->head + 1) % STEPPER_QUEUE_SIZE;
-  queue->count--;
+  *command = queue->commands[slot];
+  SpscRing_Release(&queue->ring, 1);
 
   return 1; // Success
 }
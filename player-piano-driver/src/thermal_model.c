@@ -0,0 +1,138 @@
+#include "thermal_model.h"
+#include <string.h>
+
+// Rise at which derating starts, and the width of the derating band, Q16
+#define THERMAL_DERATE_START_Q16 ((int32_t)(THERMAL_DERATE_START_C - THERMAL_AMBIENT_C) << THERMAL_RISE_SHIFT)
+#define THERMAL_DERATE_BAND_Q16 ((int32_t)(THERMAL_LIMIT_C - THERMAL_DERATE_START_C) << THERMAL_RISE_SHIFT)
+
+static ThermalKey_t g_thermal_keys[NUM_KEYS];
+static uint32_t g_thermal_warm[KEY_MASK_WORDS]; // Bit n set = key n above ambient or heated since the last update
+static KeyDriverModule_t *g_thermal_driver = NULL;
+static uint8_t g_thermal_samples = 0;
+
+/**
+ * @brief Start every coil at ambient
+ * @param key_driver: Key driver whose outputs are modelled and derated
+ */
+void ThermalModel_Init(KeyDriverModule_t *key_driver)
+{
+  memset(g_thermal_keys, 0, sizeof(g_thermal_keys));
+  memset(g_thermal_warm, 0, sizeof(g_thermal_warm));
+  g_thermal_driver = key_driver;
+  g_thermal_samples = 0;
+}
+
+/**
+ * @brief Work out a key's derating from its temperature rise and hand it to the key driver
+ */
+static void ThermalModel_Derate(uint8_t key, int32_t rise_q16)
+{
+  // Progress through the derating band, 0-256; the divisor is a constant
+  int32_t over = rise_q16 - THERMAL_DERATE_START_Q16;
+  uint32_t progress = 0;
+  if (over >= THERMAL_DERATE_BAND_Q16)
+  {
+    progress = 256;
+  }
+  else if (over > 0)
+  {
+    progress = ((uint32_t)over << 8) / (uint32_t)THERMAL_DERATE_BAND_Q16;
+  }
+
+  uint16_t hold_scale = (uint16_t)(KEY_HOLD_SCALE_FULL - (((KEY_HOLD_SCALE_FULL - THERMAL_HOLD_MIN_SCALE) * progress) >> 8));
+  uint16_t duty_cap = (uint16_t)(PWM_DUTY_MAX - (((PWM_DUTY_MAX - PWM_PERCENT_TO_DUTY(THERMAL_STRIKE_MIN_CAP)) * progress) >> 8));
+
+  KeyDriver_SetThermalLimit(g_thermal_driver, key, duty_cap, hold_scale);
+}
+
+/**
+ * @brief Sample every key's output; call every THERMAL_SAMPLE_US from the main loop
+ *
+ * Only keys that are not idle can be heating, and only warm ones cooling,
+ * so both passes walk key bitmaps and cost nothing on a cold, idle board.
+ */
+void ThermalModel_Sample(void)
+{
+  if (g_thermal_driver == NULL)
+  {
+    return;
+  }
+
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    for (uint32_t bits = g_thermal_driver->active[word]; bits != 0; bits &= bits - 1)
+    {
+      uint8_t i = (word << 5) + KEY_MASK_LOWEST(bits);
+      uint32_t duty = g_thermal_driver->keys[i].output_duty;
+      if (duty != 0)
+      {
+        uint8_t ripple = THERMAL_EXPANDER_RIPPLE_HEATING && i >= PWM_NUM_CHANNELS;
+        g_thermal_keys[i].heat += ripple ? duty : (duty * duty) >> 16;
+        g_thermal_warm[word] |= bits & -bits;
+      }
+    }
+  }
+
+  if (++g_thermal_samples < (1u << THERMAL_UPDATE_SHIFT))
+  {
+    return;
+  }
+  g_thermal_samples = 0;
+
+  // Move each rise towards where the mean heating since the last update would
+  // settle; a key back at ambient has had its limits lifted and drops out
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    for (uint32_t bits = g_thermal_warm[word]; bits != 0; bits &= bits - 1)
+    {
+      uint8_t i = (word << 5) + KEY_MASK_LOWEST(bits);
+      ThermalKey_t *thermal = &g_thermal_keys[i];
+      int32_t target = (int32_t)((thermal->heat >> THERMAL_UPDATE_SHIFT) * THERMAL_FULL_ON_RISE_C);
+      thermal->heat = 0;
+      thermal->rise_q16 += (target - thermal->rise_q16) >> THERMAL_TAU_SHIFT;
+
+      ThermalModel_Derate(i, thermal->rise_q16);
+      if (thermal->rise_q16 == 0)
+      {
+        g_thermal_warm[word] &= ~(bits & -bits);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Estimated coil temperature of a key
+ * @return Degrees C, or 0 for an invalid key
+ */
+uint16_t ThermalModel_GetTemperature(uint8_t key)
+{
+  if (key >= NUM_KEYS)
+  {
+    return 0;
+  }
+
+  return (uint16_t)(THERMAL_AMBIENT_C + (g_thermal_keys[key].rise_q16 >> THERMAL_RISE_SHIFT));
+}
+
+/**
+ * @brief Estimated temperature of the hottest coil on the board
+ * @return Degrees C
+ */
+uint16_t ThermalModel_GetMaxTemperature(void)
+{
+  int32_t max_rise = 0;
+
+  for (uint8_t word = 0; word < KEY_MASK_WORDS; word++)
+  {
+    for (uint32_t bits = g_thermal_warm[word]; bits != 0; bits &= bits - 1)
+    {
+      uint8_t i = (word << 5) + KEY_MASK_LOWEST(bits);
+      if (g_thermal_keys[i].rise_q16 > max_rise)
+      {
+        max_rise = g_thermal_keys[i].rise_q16;
+      }
+    }
+  }
+
+  return (uint16_t)(THERMAL_AMBIENT_C + (max_rise >> THERMAL_RISE_SHIFT));
+}
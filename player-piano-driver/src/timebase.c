@@ -0,0 +1,80 @@
+#include "timebase.h"
+
+// Timer handle for the timebase
+TIM_HandleTypeDef htim1;
+
+// Upper 16 bits of the microsecond counter
+static volatile uint32_t timebase_overflows = 0;
+
+/**
+ * @brief Start TIM1 as a free-running 1 MHz counter
+ */
+void Timebase_Init(void)
+{
+  __HAL_RCC_TIM1_CLK_ENABLE();
+
+  htim1.Instance = TIMEBASE_TIM_INSTANCE;
+  htim1.Init.Prescaler = (SystemCoreClock / TIMEBASE_TICK_HZ) - 1;
+  htim1.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim1.Init.Period = 0xFFFF;
+  htim1.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  htim1.Init.RepetitionCounter = 0;
+  htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+
+  if (HAL_TIM_Base_Init(&htim1) != HAL_OK)
+  {
+    // Error handling
+  }
+
+  // Overflow interrupt extends the counter to 32 bits
+  HAL_NVIC_SetPriority(TIM1_UP_IRQn, 0, 1);
+  HAL_NVIC_EnableIRQ(TIM1_UP_IRQn);
+
+  __HAL_TIM_CLEAR_FLAG(&htim1, TIM_FLAG_UPDATE);
+  HAL_TIM_Base_Start_IT(&htim1);
+
+  // Start the DWT cycle counter used by TIMEBASE_CYCLES
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * @brief Get the current time in microseconds
+ *
+ * Safe to call from any context, including interrupts that preempt the
+ * overflow interrupt: a pending overflow is accounted for directly.
+ * @return Microseconds since Timebase_Init (wraps at 2^32)
+ */
+uint32_t Timebase_Micros(void)
+{
+  uint32_t overflows;
+  uint32_t counter;
+
+  do
+  {
+    overflows = timebase_overflows;
+    counter = TIMEBASE_TIM_INSTANCE->CNT;
+
+    // Overflow happened but its interrupt has not run yet
+    if (TIMEBASE_TIM_INSTANCE->SR & TIM_SR_UIF)
+    {
+      counter = TIMEBASE_TIM_INSTANCE->CNT;
+      overflows++;
+    }
+  } while (overflows != timebase_overflows && overflows != timebase_overflows + 1);
+
+  return (overflows << 16) | counter;
+}
+
+/**
+ * @brief TIM1 update interrupt handler
+ */
+void TIM1_UP_IRQHandler(void)
+{
+  if (TIMEBASE_TIM_INSTANCE->SR & TIM_SR_UIF)
+  {
+    TIMEBASE_TIM_INSTANCE->SR = ~TIM_SR_UIF;
+    timebase_overflows++;
+  }
+}